@@ -1,20 +1,82 @@
 #ifndef DELAUNAY_HPP
 #define DELAUNAY_HPP
 
+#include "delaunay/mesh.h"
+#include "delaunay/predicates.h"
 #include "delaunay/quad_edge_ref.h"
+#include "delaunay/stats.h"
 #include <opencv2/core/types.hpp>
+#include <utility>
 #include <vector>
 
+// Definitions are explicitly instantiated in delaunay.cpp for cv::Point (exact
+// integer predicates), cv::Point2f and cv::Point2d (sub-pixel coordinates)
 namespace delaunay {
-  bool inCircle(cv::Point a, cv::Point b, cv::Point c, cv::Point test);
-  bool isCCW(cv::Point a, cv::Point b, cv::Point c);
-  bool isLeftOf(cv::Point test, quadedge::QuadEdgeRef *edge);
-  bool isRightOf(cv::Point test, quadedge::QuadEdgeRef *edge);
-  bool isAbove(quadedge::QuadEdgeRef *test, quadedge::QuadEdgeRef *baseL);
-  quadedge::QuadEdgeRef* triangulate(const std::vector<cv::Point> &points);
-  std::vector<std::vector<cv::Point>>
-    extractTriangles(quadedge::QuadEdgeRef *edge);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  bool inCircle(PointT a, PointT b, PointT c, PointT test);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  bool isCCW(PointT a, PointT b, PointT c);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  bool isLeftOf(PointT test, quadedge::QuadEdgeRef<PointT> *edge);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  bool isRightOf(PointT test, quadedge::QuadEdgeRef<PointT> *edge);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  bool isAbove(
+      quadedge::QuadEdgeRef<PointT> *test,
+      quadedge::QuadEdgeRef<PointT> *baseL);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  quadedge::QuadEdgeRef<PointT>* triangulate(const std::vector<PointT> &points);
+  // Same, for points stored elsewhere (e.g. a memory-mapped file). Either way
+  // the distinct points are sorted into a copy, the input is left untouched.
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  quadedge::QuadEdgeRef<PointT>* triangulate(
+      const PointT *points,
+      size_t nPoints);
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  Mesh<PointT> extractTriangles(
+      quadedge::QuadEdgeRef<PointT> *edge,
+      TriangleOrder order = TriangleOrder::Traversal);
+  // Reorder a mesh's triangles (and colors, if any), renumbering the
+  // vertices in order of first use
+  template <typename PointT>
+  void sortTriangles(Mesh<PointT> &mesh, TriangleOrder order);
+  // Insert a point strictly inside the (CCW) triangle left of triangleEdge and
+  // restore the Delaunay property with edge flips. Returns an edge leaving the
+  // new vertex; every triangle that changed is incident to it.
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  quadedge::QuadEdgeRef<PointT>* insertSite(
+      quadedge::QuadEdgeRef<PointT> *triangleEdge,
+      PointT point);
+  // Force each segment (between two vertices of the triangulation) to be an
+  // edge: the edges it crosses are flipped out of its way, then the Delaunay
+  // property is restored everywhere but across segments. A segment through
+  // another vertex is split there, and one that would cross an earlier
+  // segment is dropped. Returns the number of edges now constrained.
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  size_t insertConstraints(
+      quadedge::QuadEdgeRef<PointT> *edge,
+      const std::vector<std::pair<PointT, PointT>> &segments);
+  // Remove each interior vertex whose surrounding triangles' colors (mesh,
+  // extracted from this triangulation and colored) are all within tolerance
+  // of their area-weighted mean, filling the hole by ear clipping and Delaunay
+  // flips inside it, in that mean color. The per-channel range of the input
+  // colors behind each face is kept, so no input triangle ends up farther
+  // than tolerance from the color now covering it. Vertices on constraints
+  // (the segments given to insertConstraints) are kept, so are their edges.
+  // edge is moved off removed edges; returns the decimated mesh, colors
+  // included.
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  Mesh<PointT> decimate(
+      quadedge::QuadEdgeRef<PointT> *&edge,
+      const Mesh<PointT> &mesh,
+      double tolerance,
+      TriangleOrder order = TriangleOrder::Traversal,
+      const std::vector<std::pair<PointT, PointT>> &constraints = {});
+  // Voronoi cells read off the dual of the triangulation, clipped to bounds
+  template <typename PointT, typename Predicates = PredicatesFor<PointT>>
+  Cells<PointT> extractCells(
+      quadedge::QuadEdgeRef<PointT> *edge,
+      const cv::Rect2d &bounds);
 }
 
 #endif // !DELAUNAY_HPP
-
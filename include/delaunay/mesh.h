@@ -0,0 +1,51 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core/types.hpp>
+#include <vector>
+
+namespace delaunay {
+
+  // Order of the triangles in a Mesh: as the face walk finds them, or along
+  // a Hilbert curve through their centroids so that consecutive triangles
+  // (and their vertices) cover nearby pixels
+  enum class TriangleOrder { Traversal, Hilbert };
+
+  // Compact triangle mesh: a shared vertex array, three indices per triangle
+  // (CCW order) and one color per triangle (filled in by the caller)
+  template <typename PointT>
+  struct Mesh {
+    size_t size() const { return indices.size() / 3; }
+    PointT vertex(size_t triangle, int corner) const {
+      return vertices[indices[3 * triangle + corner]];
+    }
+
+    std::vector<PointT> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<cv::Scalar> colors;
+  };
+
+  // Voronoi cells, one per site (vertex of the triangulation): each cell is a
+  // convex polygon (CCW, clipped to the requested bounds) stored as a run of
+  // corners, and one color per cell (filled in by the caller)
+  template <typename PointT>
+  struct Cells {
+    size_t size() const { return sites.size(); }
+    size_t cellSize(size_t cell) const {
+      return offsets[cell + 1] - offsets[cell];
+    }
+    const cv::Point2d *cell(size_t cell) const {
+      return corners.data() + offsets[cell];
+    }
+
+    std::vector<PointT> sites;
+    std::vector<cv::Point2d> corners;
+    std::vector<uint32_t> offsets = { 0 }; // cell i: [offsets[i], offsets[i+1])
+    std::vector<cv::Scalar> colors;
+  };
+
+}
+
+#endif // !MESH_HPP
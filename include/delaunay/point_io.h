@@ -0,0 +1,49 @@
+#ifndef POINT_IO_HPP
+#define POINT_IO_HPP
+
+#include "delaunay/mesh.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace delaunay {
+
+  // Layouts for point sets produced by other tools, picked by extension:
+  // ".i32" and ".f64" are raw little-endian x, y pairs (int32 and float64),
+  // anything else is text with one "x y" (or "x,y") pair per line and '#'
+  // comment lines
+  enum class PointFormat { Int32, Float64, Text };
+  PointFormat pointFormat(const std::string &path);
+
+  // The points of a file: binary files are memory-mapped and used in place,
+  // text is parsed into memory. Throws std::runtime_error if the file can't
+  // be read, doesn't hold PointT coordinates (.i32 holds cv::Point, .f64
+  // holds cv::Point2d, text either) or is binary on a big-endian host.
+  // Instantiated for cv::Point and cv::Point2d in point_io.cpp.
+  template <typename PointT>
+  class PointFile {
+  public:
+    explicit PointFile(const std::string &path);
+    ~PointFile();
+    PointFile(const PointFile&) = delete;
+    PointFile &operator=(const PointFile&) = delete;
+    const PointT *data() const { return points; }
+    size_t size() const { return nPoints; }
+
+  private:
+    const PointT *points = nullptr;
+    size_t nPoints = 0;
+    void *mapped = nullptr;
+    size_t mappedBytes = 0;
+    std::vector<PointT> parsed;
+  };
+
+  // Writes text OFF for ".off" paths, otherwise raw binary: uint64 vertex
+  // count, uint64 triangle count, the vertices as x, y pairs of PointT's
+  // coordinate type, then three uint32 indices (CCW) per triangle
+  template <typename PointT>
+  void writeMesh(const std::string &path, const Mesh<PointT> &mesh);
+
+}
+
+#endif // !POINT_IO_HPP
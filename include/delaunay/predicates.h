@@ -0,0 +1,66 @@
+#ifndef PREDICATES_HPP
+#define PREDICATES_HPP
+
+#include <cstdint>
+#include <type_traits>
+
+namespace delaunay {
+
+  // Exact predicates for integer coordinates with magnitude below 2^28: the
+  // orientation determinant fits in 64 bits and the in-circle one in 128 bits
+  struct IntegerPredicates {
+    template <typename PointT>
+    static bool isCCW(const PointT &a, const PointT &b, const PointT &c) {
+      const int64_t abx = int64_t(b.x) - a.x, aby = int64_t(b.y) - a.y;
+      const int64_t acx = int64_t(c.x) - a.x, acy = int64_t(c.y) - a.y;
+      return abx * acy - aby * acx > 0;
+    }
+
+    template <typename PointT>
+    static bool inCircle(
+        const PointT &a, const PointT &b, const PointT &c, const PointT &d) {
+      const int64_t adx = int64_t(a.x) - d.x, ady = int64_t(a.y) - d.y;
+      const int64_t bdx = int64_t(b.x) - d.x, bdy = int64_t(b.y) - d.y;
+      const int64_t cdx = int64_t(c.x) - d.x, cdy = int64_t(c.y) - d.y;
+      const __int128 det
+        = __int128(adx * adx + ady * ady) * (bdx * cdy - bdy * cdx)
+        + __int128(bdx * bdx + bdy * bdy) * (cdx * ady - cdy * adx)
+        + __int128(cdx * cdx + cdy * cdy) * (adx * bdy - ady * bdx);
+      return isCCW(a, b, c) ? det > 0 : det < 0;
+    }
+  };
+
+  // Double-precision predicates for sub-pixel (float/double) coordinates,
+  // evaluated relative to the test point to limit cancellation
+  struct FloatingPredicates {
+    template <typename PointT>
+    static bool isCCW(const PointT &a, const PointT &b, const PointT &c) {
+      const double abx = double(b.x) - a.x, aby = double(b.y) - a.y;
+      const double acx = double(c.x) - a.x, acy = double(c.y) - a.y;
+      return abx * acy - aby * acx > 0;
+    }
+
+    template <typename PointT>
+    static bool inCircle(
+        const PointT &a, const PointT &b, const PointT &c, const PointT &d) {
+      const double adx = double(a.x) - d.x, ady = double(a.y) - d.y;
+      const double bdx = double(b.x) - d.x, bdy = double(b.y) - d.y;
+      const double cdx = double(c.x) - d.x, cdy = double(c.y) - d.y;
+      const double det
+        = (adx * adx + ady * ady) * (bdx * cdy - bdy * cdx)
+        + (bdx * bdx + bdy * bdy) * (cdx * ady - cdy * adx)
+        + (cdx * cdx + cdy * cdy) * (adx * bdy - ady * bdx);
+      return isCCW(a, b, c) ? det > 0 : det < 0;
+    }
+  };
+
+  // Predicate policy chosen at compile time from the coordinate type
+  template <typename PointT>
+  using PredicatesFor = std::conditional_t<
+    std::is_integral_v<decltype(PointT::x)>,
+    IntegerPredicates,
+    FloatingPredicates>;
+
+}
+
+#endif // !PREDICATES_HPP
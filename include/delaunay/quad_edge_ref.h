@@ -1,37 +1,85 @@
 #ifndef QUAD_EDGE_REF_HPP
 #define QUAD_EDGE_REF_HPP
 
+#include <cassert>
+#include <cstdint>
 #include <opencv2/core/types.hpp>
-#include <optional>
+#include <utility>
 #include <vector>
 
 namespace quadedge {
 
+  template <typename PointT> struct QuadEdge;
+
+  // One of the four rotations of a quad-edge. Even rotations are primal edges
+  // (between vertices) and odd rotations are dual edges (between faces). Only
+  // primal rotations have coordinates, which live in the owning QuadEdge.
+  template <typename PointT>
   struct QuadEdgeRef {
-    inline QuadEdgeRef(QuadEdgeRef *nextSpoke=nullptr, QuadEdgeRef *rot=nullptr)
-      : onext(nextSpoke), rot(rot), origCoords(std::nullopt) {}
-    QuadEdgeRef* &sym();
-    QuadEdgeRef* &oprev();
-    QuadEdgeRef* &lnext();
-    QuadEdgeRef* &rprev();
-    std::optional<cv::Point> &termCoords();
-    std::pair<cv::Point, cv::Point> points();
+    QuadEdgeRef* &sym() {
+      assert(rot != nullptr);
+      assert(rot->rot != nullptr);
+      return rot->rot;
+    }
+    QuadEdgeRef* &oprev() {
+      assert(rot != nullptr);
+      assert(rot->onext != nullptr);
+      assert(rot->onext->rot != nullptr);
+      return rot->onext->rot;
+    }
+    QuadEdgeRef* &lnext() {
+      QuadEdgeRef *dc = rot->sym();
+      assert(dc->onext != nullptr);
+      assert(dc->onext->rot != nullptr);
+      return dc->onext->rot;
+    }
+    QuadEdgeRef* &rprev() { return sym()->onext; }
+    bool isPrimal() const { return (index & 1) == 0; }
+    QuadEdge<PointT> *quad() {
+      return reinterpret_cast<QuadEdge<PointT>*>(this - index);
+    }
+    PointT &origCoords() {
+      assert(isPrimal());
+      return quad()->coords[index >> 1];
+    }
+    PointT &termCoords() { return sym()->origCoords(); }
+    std::pair<PointT, PointT> points() { return { origCoords(), termCoords() }; }
 
     QuadEdgeRef *onext;
     QuadEdgeRef *rot;
-    std::optional<cv::Point> origCoords;
+    uint8_t index; // rotation within the owning QuadEdge (0-3)
+  };
+
+  // All four rotations plus both endpoints, allocated as one block
+  template <typename PointT>
+  struct QuadEdge {
+    QuadEdgeRef<PointT> refs[4];
+    PointT coords[2]; // origins of refs[0] and refs[2]
   };
 
-  void printEndpoints(QuadEdgeRef *edge, const char *label);
-  QuadEdgeRef *makeQuadEdge(cv::Point tail, cv::Point head);
-  void splice(QuadEdgeRef *a, QuadEdgeRef *b);
-  QuadEdgeRef *makeTriangle(cv::Point a, cv::Point b, cv::Point c);
-  QuadEdgeRef *makePolygon(std::vector<cv::Point> points);
-  QuadEdgeRef *connect(QuadEdgeRef *a, QuadEdgeRef *b);
-  void sever(QuadEdgeRef *edge);
-  QuadEdgeRef *insertPoint(QuadEdgeRef *polygonEdge, cv::Point point);
-  void flip(QuadEdgeRef *edge);
-  void freeGraph(QuadEdgeRef *edge);
+  // Definitions are explicitly instantiated for cv::Point, cv::Point2f and
+  // cv::Point2d in quad_edge_ref.cpp
+  template <typename PointT>
+  void printEndpoints(QuadEdgeRef<PointT> *edge, const char *label);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *makeQuadEdge(PointT tail, PointT head);
+  template <typename PointT>
+  void splice(QuadEdgeRef<PointT> *a, QuadEdgeRef<PointT> *b);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *makeTriangle(PointT a, PointT b, PointT c);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *makePolygon(std::vector<PointT> points);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *connect(QuadEdgeRef<PointT> *a, QuadEdgeRef<PointT> *b);
+  template <typename PointT>
+  void sever(QuadEdgeRef<PointT> *edge);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *insertPoint(
+      QuadEdgeRef<PointT> *polygonEdge, PointT point);
+  template <typename PointT>
+  void flip(QuadEdgeRef<PointT> *edge);
+  template <typename PointT>
+  void freeGraph(QuadEdgeRef<PointT> *edge);
 
 }
 
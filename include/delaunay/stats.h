@@ -0,0 +1,30 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <cstdint>
+#include <vector>
+
+namespace delaunay {
+
+  // Hot-path counters, only collected when the library is built with
+  // DELAUNAY_STATS (otherwise stats() returns zeros with enabled == false)
+  struct Stats {
+    static constexpr int MAX_LEVELS = 64;
+    bool enabled = false;
+    uint64_t inCircleCalls = 0;
+    uint64_t isCCWCalls = 0;
+    uint64_t edgesConnected = 0;
+    uint64_t edgesSevered = 0;
+    uint64_t peakLiveEdges = 0;
+    uint64_t colinearBaseCases = 0;
+    uint64_t longestSeverWalk = 0;
+    uint64_t maxDepth = 0;
+    std::vector<uint64_t> mergeIterations; // indexed by recursion depth
+  };
+
+  Stats stats();
+  void resetStats();
+
+}
+
+#endif // !STATS_HPP
@@ -0,0 +1,32 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <cstddef>
+#include <functional>
+
+// One work-stealing pool shared by the delaunay library, imgutil and the
+// pipeline. The calling thread always takes part, so a pool of size 1 runs
+// everything inline. Work is split at boundaries that depend only on the
+// grain, never on the thread count, so results are identical for any size.
+namespace threadpool {
+
+  // Resize the pool (0 = hardware concurrency), optionally pinning worker i
+  // to core i + 1 (the calling thread keeps its affinity). Not safe while
+  // work is running; call before processing.
+  void configure(unsigned nThreads, bool pinThreads = false);
+  // Threads that run work, the caller included
+  unsigned size();
+
+  // Run body(begin, end) over [first, last) in chunks of grain, returning
+  // once every chunk is done. The first exception thrown is rethrown here.
+  void parallelFor(
+      size_t first,
+      size_t last,
+      size_t grain,
+      const std::function<void(size_t, size_t)> &body);
+  // Run a and b, possibly in parallel, returning once both are done
+  void invoke(const std::function<void()> &a, const std::function<void()> &b);
+
+}
+
+#endif // !THREAD_POOL_HPP
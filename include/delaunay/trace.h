@@ -0,0 +1,59 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Timeline of what every thread was doing, written as Chrome trace-event
+// JSON (chrome://tracing, Perfetto). Each thread appends to its own buffer,
+// so recording takes no locks, and while tracing is off a Span costs one
+// relaxed load.
+namespace tracing {
+
+  extern std::atomic<bool> active;
+
+  inline bool enabled() { return active.load(std::memory_order_relaxed); }
+  // Start recording, dropping anything recorded before. Not safe while
+  // traced work is running; call before processing.
+  void start();
+  // Stop recording and write every thread's spans to path, once all traced
+  // work has returned. Throws std::runtime_error if path can't be written.
+  void write(const std::string &path);
+  // Label the calling thread in the timeline
+  void nameThread(const std::string &name);
+  // A copy of name that lives as long as the process, for names built at
+  // run time
+  const char *intern(const std::string &name);
+  // Nanoseconds since start()
+  int64_t now();
+  // Record a finished span on the calling thread (no argument if arg < 0)
+  void record(
+      const char *name,
+      const char *category,
+      int64_t begin,
+      int64_t end,
+      int64_t arg = -1);
+
+  // Records its lifetime as a span on the calling thread, unless name is
+  // null. name and category must outlive the trace (literals or intern()).
+  class Span {
+  public:
+    Span(const char *name, const char *category, int64_t arg = -1)
+      : name(name), category(category), arg(arg),
+        begin(name && enabled() ? now() : -1) {}
+    ~Span() {
+      if (begin >= 0)
+        record(name, category, begin, now(), arg);
+    }
+    Span(const Span&) = delete;
+    Span &operator=(const Span&) = delete;
+
+  private:
+    const char *name, *category;
+    int64_t arg, begin;
+  };
+
+}
+
+#endif // !TRACE_HPP
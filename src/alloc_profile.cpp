@@ -0,0 +1,156 @@
+#include "alloc_profile.h"
+
+#ifdef LOWPOLY_ALLOC_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> allocatedBytes{0};
+  std::atomic<int64_t> liveBytes{0};
+  std::atomic<int64_t> peakLiveBytes{0};
+
+  // Stored just before every block so delete knows what it frees
+  struct Header {
+    size_t size;
+    size_t offset; // from the start of the underlying allocation
+  };
+
+  void *allocate(size_t size, size_t align) noexcept {
+    const size_t offset = std::max(align, sizeof(Header));
+    void *raw = align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+      ? std::malloc(size + offset)
+      : std::aligned_alloc(align, (size + offset + align - 1) / align * align);
+    if (!raw)
+      return nullptr;
+    char *block = static_cast<char*>(raw) + offset;
+    reinterpret_cast<Header*>(block)[-1] = { size, offset };
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    const int64_t live
+      = liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+    int64_t peak = peakLiveBytes.load(std::memory_order_relaxed);
+    while (peak < live && !peakLiveBytes.compare_exchange_weak(
+          peak, live, std::memory_order_relaxed)) {}
+    return block;
+  }
+
+  void *allocateOrThrow(size_t size, size_t align) {
+    while (true) {
+      if (void *block = allocate(size, align))
+        return block;
+      std::new_handler handler = std::get_new_handler();
+      if (!handler)
+        throw std::bad_alloc();
+      handler();
+    }
+  }
+
+  void deallocate(void *block) noexcept {
+    if (!block)
+      return;
+    const Header header = reinterpret_cast<Header*>(block)[-1];
+    liveBytes.fetch_sub(header.size, std::memory_order_relaxed);
+    std::free(static_cast<char*>(block) - header.offset);
+  }
+
+  constexpr size_t DEFAULT_ALIGN = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+}
+
+// Replacements for every global allocation function, so the delaunay library
+// and OpenCV's C++ containers are counted along with lowpoly itself
+void *operator new(size_t size) {
+  return allocateOrThrow(size, DEFAULT_ALIGN);
+}
+void *operator new[](size_t size) {
+  return allocateOrThrow(size, DEFAULT_ALIGN);
+}
+void *operator new(size_t size, std::align_val_t align) {
+  return allocateOrThrow(size, static_cast<size_t>(align));
+}
+void *operator new[](size_t size, std::align_val_t align) {
+  return allocateOrThrow(size, static_cast<size_t>(align));
+}
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, DEFAULT_ALIGN);
+}
+void *operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, DEFAULT_ALIGN);
+}
+void *operator new(
+    size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return allocate(size, static_cast<size_t>(align));
+}
+void *operator new[](
+    size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return allocate(size, static_cast<size_t>(align));
+}
+void operator delete(void *block) noexcept { deallocate(block); }
+void operator delete[](void *block) noexcept { deallocate(block); }
+void operator delete(void *block, size_t) noexcept { deallocate(block); }
+void operator delete[](void *block, size_t) noexcept { deallocate(block); }
+void operator delete(void *block, std::align_val_t) noexcept {
+  deallocate(block);
+}
+void operator delete[](void *block, std::align_val_t) noexcept {
+  deallocate(block);
+}
+void operator delete(void *block, size_t, std::align_val_t) noexcept {
+  deallocate(block);
+}
+void operator delete[](void *block, size_t, std::align_val_t) noexcept {
+  deallocate(block);
+}
+void operator delete(void *block, const std::nothrow_t&) noexcept {
+  deallocate(block);
+}
+void operator delete[](void *block, const std::nothrow_t&) noexcept {
+  deallocate(block);
+}
+void operator delete(
+    void *block, std::align_val_t, const std::nothrow_t&) noexcept {
+  deallocate(block);
+}
+void operator delete[](
+    void *block, std::align_val_t, const std::nothrow_t&) noexcept {
+  deallocate(block);
+}
+
+namespace allocprofile {
+
+  bool enabled() { return true; }
+
+  Counters counters() {
+    Counters c;
+    c.allocations = allocations.load(std::memory_order_relaxed);
+    c.allocatedBytes = allocatedBytes.load(std::memory_order_relaxed);
+    c.liveBytes = std::max<int64_t>(0, liveBytes.load(std::memory_order_relaxed));
+    c.peakLiveBytes
+      = std::max<int64_t>(0, peakLiveBytes.load(std::memory_order_relaxed));
+    return c;
+  }
+
+  void resetPeak() {
+    peakLiveBytes.store(
+        liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+}
+
+#else
+
+namespace allocprofile {
+
+  bool enabled() { return false; }
+  Counters counters() { return Counters(); }
+  void resetPeak() {}
+
+}
+
+#endif // LOWPOLY_ALLOC_PROFILE
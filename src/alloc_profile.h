@@ -0,0 +1,26 @@
+#ifndef ALLOC_PROFILE_H
+#define ALLOC_PROFILE_H
+
+#include <cstdint>
+
+// Heap traffic through operator new/delete, only collected when lowpoly is
+// built with LOWPOLY_ALLOC_PROFILE (otherwise enabled() is false and the
+// counters stay zero). cv::Mat buffers come from OpenCV's own allocator and
+// are not counted; they show up in the peak RSS instead.
+namespace allocprofile {
+
+  struct Counters {
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+    uint64_t liveBytes = 0;
+    uint64_t peakLiveBytes = 0; // since the last resetPeak()
+  };
+
+  bool enabled();
+  Counters counters();
+  // Start a new high-water mark from the bytes live right now
+  void resetPeak();
+
+}
+
+#endif // !ALLOC_PROFILE_H
@@ -1,5 +1,6 @@
 #include "cli_parser.h"
 #include "argparse/argparse.hpp"
+#include "row_writer.h"
 #include <cstdio>
 #include <exception>
 #include <fstream>
@@ -23,12 +24,18 @@ void CliOptions::parse(int argc, char* argv[]) {
 
   parser.add_usage_newline();
   parser.add_argument("input")
-    .help("Path to input image")
+    .help("Path to input image (or point file with -P), \"-\" for a PGM/PPM"
+        " (or --raw pixels) on standard input")
     .metavar("FILE");
   parser.add_argument("-o", "--output")
-    .help("Output image path")
+    .help("Output image path, \"-\" for a PPM on standard output (the default"
+        " for standard input)")
     .metavar("PATH")
     .nargs(1);
+  parser.add_argument("--raw")
+    .help("Read the input as raw 8-bit BGR pixels of this size")
+    .metavar("WxH")
+    .nargs(1);
   parser.add_usage_newline();
   parser.add_argument("-s", "--preproc-scale")
     .help("Initial preprocessing scale factor")
@@ -49,9 +56,20 @@ void CliOptions::parse(int argc, char* argv[]) {
     .scan<'g', float>()
     .nargs(1);
   parser.add_argument("-W", "--target-output-width")
-    .help("Scale the output image to this size after processing (overrides -S)")
-    .metavar("WIDTH")
-    .scan<'i', int>()
+    .help("Scale the output image to this size after processing (overrides -S);"
+        " a comma-separated list renders every width from one mesh")
+    .metavar("WIDTH[,...]")
+    .nargs(1);
+  parser.add_usage_newline();
+  parser.add_argument("--roi")
+    .help("Only lowpoly this rectangle of the original image, composited over"
+        " the untouched rest")
+    .metavar("X,Y,W,H")
+    .nargs(1);
+  parser.add_argument("--mask")
+    .help("Only lowpoly the nonzero pixels of this image (the input's size),"
+        " composited over the untouched rest")
+    .metavar("PATH")
     .nargs(1);
   parser.add_usage_newline();
   parser.add_argument("-t", "--edge-threshold")
@@ -68,6 +86,46 @@ void CliOptions::parse(int argc, char* argv[]) {
         + '-' + to_string(anmsKernelRange.second))
     .nargs(1);
   parser.add_usage_newline();
+  parser.add_argument("-V", "--vertex-selector")
+    .help("Vertex selection engine: \"anms\", \"grid\" (top-k per cell) or"
+        " \"refine\" (greedy color-error refinement, no salt)")
+    .metavar("ENGINE")
+    .default_value(string("anms"))
+    .choices("anms", "grid", "refine")
+    .nargs(1);
+  parser.add_argument("-K", "--grid-top-k")
+    .help("Maxima kept per cell by the grid vertex selector")
+    .metavar("K")
+    .default_value(static_cast<int>(gridTopK))
+    .scan<'i', int>()
+    .nargs(1);
+  parser.add_argument("-E", "--refine-error")
+    .help("RMS color error (0-255 scale) refined triangles are split down to")
+    .metavar("RMS")
+    .default_value(refineError)
+    .scan<'g', float>()
+    .nargs(1);
+  parser.add_argument("-N", "--refine-triangles")
+    .help("Stop refining at this many triangles (0 for no limit)")
+    .metavar("N")
+    .default_value(static_cast<int>(refineTriangles))
+    .scan<'i', int>()
+    .nargs(1);
+  parser.add_argument("-c", "--constrain")
+    .help("Force contours stronger than the edge threshold into the mesh as"
+        " edges, simplified to within this many pixels (0 disables)")
+    .metavar("EPSILON")
+    .default_value(constrainEpsilon)
+    .scan<'g', float>()
+    .nargs(1);
+  parser.add_argument("-p", "--pyramid")
+    .help("Find edge regions this many pyrDown levels below the input and run"
+        " full-resolution aNMS only inside them (0 disables)")
+    .metavar("LEVELS")
+    .default_value(static_cast<int>(pyramidLevels))
+    .scan<'i', int>()
+    .nargs(1);
+  parser.add_usage_newline();
   parser.add_argument("-r", "--salt")
     .help("Proportion (expressed as decimal) of random salt added")
     .metavar("RATIO")
@@ -75,6 +133,36 @@ void CliOptions::parse(int argc, char* argv[]) {
     .scan<'g', float>()
     .nargs(1);
   parser.add_usage_newline();
+  parser.add_argument("-y", "--voronoi")
+    .help("Color the Voronoi cells of the vertices instead of the triangles")
+    .flag();
+  parser.add_argument("-e", "--color-tolerance")
+    .help("Estimate each color from stratified samples, adding more until its"
+        " standard error (0-255 scale) is within this (0 averages every pixel)")
+    .metavar("RMS")
+    .default_value(colorTolerance)
+    .scan<'g', float>()
+    .nargs(1);
+  parser.add_argument("-d", "--decimate")
+    .help("Merge neighbouring triangles whose colors are all within this"
+        " distance (0-255 scale) of their merged color (0 disables)")
+    .metavar("RMS")
+    .default_value(decimateTolerance)
+    .scan<'g', float>()
+    .nargs(1);
+  parser.add_argument("--triangle-order")
+    .help("Mesh triangle order: \"traversal\" (as the triangulation is"
+        " walked) or \"hilbert\" (along a Hilbert curve, cache friendly)")
+    .metavar("ORDER")
+    .default_value(string("traversal"))
+    .choices("traversal", "hilbert")
+    .nargs(1);
+  parser.add_usage_newline();
+  parser.add_argument("-C", "--cache")
+    .help("Reuse Sobel, vertex and mesh results stored in this directory")
+    .metavar("DIR")
+    .nargs(1);
+  parser.add_usage_newline();
   parser.add_argument("-q", "--silent")
     .help("Suppress normal output")
     .flag();
@@ -84,6 +172,41 @@ void CliOptions::parse(int argc, char* argv[]) {
   parser.add_argument("-a", "--all")
     .help("Write all intermediate outputs to files")
     .flag();
+  parser.add_argument("-m", "--metrics")
+    .help("Print per-stage timings and Delaunay counters")
+    .flag();
+  parser.add_argument("--trace")
+    .help("Write a Chrome trace-event timeline of every thread to this path")
+    .metavar("PATH")
+    .nargs(1);
+  parser.add_argument("-M", "--max-memory")
+    .help("Free intermediates as early as possible to minimize peak memory"
+        " (not with -i or -a)")
+    .flag();
+  parser.add_argument("-O", "--stream-output")
+    .help("Rasterize the output (and triangulation with -a) in strips encoded"
+        " straight to a .png/.ppm file (not with -i)")
+    .flag();
+  parser.add_argument("-P", "--points")
+    .help("Triangulate the points of a .i32/.f64 (raw x, y pairs) or text file"
+        " and write the index mesh (.off text, else binary) instead")
+    .flag();
+  parser.add_argument("-j", "--threads")
+    .help("Threads shared by every stage, OpenCV included (0 for all cores)")
+    .metavar("N")
+    .default_value(static_cast<int>(threads))
+    .scan<'i', int>()
+    .nargs(1);
+  parser.add_argument("--pin-threads")
+    .help("Pin each worker thread to its own core")
+    .flag();
+  parser.add_argument("--isa")
+    .help("Instruction set of the image kernels: \"auto\" (the best this CPU"
+        " supports), \"scalar\", \"avx2\" or \"avx512\"")
+    .metavar("LEVEL")
+    .default_value(string("auto"))
+    .choices("auto", "scalar", "avx2", "avx512")
+    .nargs(1);
 
   try {
     parser.parse_args(argc, argv);
@@ -93,17 +216,43 @@ void CliOptions::parse(int argc, char* argv[]) {
   }
   // input path
   string inPath = parser.get("input");
-  if (!ifstream(inPath).good())
+  if (inPath != "-" && !ifstream(inPath).good())
     throw invalid_argument(inPath + " is not a readable file");
   inputPath = inPath; 
-  // output path (default to same directory as input but with _lowpoly suffix)
-  if (parser.present("--output")) {
+  // raw input: parse string in the form "WxH"
+  if (parser.present("--raw")) {
+    string raw = parser.get("--raw");
+    invalid_argument rawExcp("Must supply a raw size as WxH (e.g. 1920x1080)");
+    size_t xPos = raw.find('x');
+    if (xPos == string::npos)
+      throw rawExcp;
+    int size[2];
+    string sizeStrs[2] = { raw.substr(0, xPos), raw.substr(xPos + 1) };
+    for (int i = 0; i < 2; i++) {
+      size_t lastParsed = 0;
+      try {
+        size[i] = stoi(sizeStrs[i], &lastParsed);
+      } catch (const exception &) {
+        throw rawExcp;
+      }
+      if (lastParsed != sizeStrs[i].length() || size[i] < 1)
+        throw rawExcp;
+    }
+    rawSize = cv::Size(size[0], size[1]);
+  }
+  // output path (default to same directory as input but with _lowpoly suffix,
+  // standard output for standard input)
+  if ((parser.present("--output") ? parser.get("--output") : inputPath)
+      == "-") {
+    outputPath = triangulatedPath = vertexPath = sobelPath = "-";
+  } else if (parser.present("--output")) {
     outputPath = triangulatedPath = vertexPath = sobelPath
       = parser.get("--output");
     size_t lastSlash = outputPath.find_last_of('/');
     if (lastSlash == string::npos)
       lastSlash = 0;
-    size_t insertPos = outputPath.find('.', lastSlash);
+    size_t insertPos
+      = min(outputPath.find('.', lastSlash), outputPath.length());
     sobelPath.insert(insertPos, "_sobel");
     vertexPath.insert(insertPos, "_vertices");
     triangulatedPath.insert(insertPos, "_triangulated");
@@ -112,12 +261,22 @@ void CliOptions::parse(int argc, char* argv[]) {
     size_t lastSlash = outputPath.find_last_of('/');
     if (lastSlash == string::npos)
       lastSlash = 0;
-    size_t insertPos = outputPath.find('.', lastSlash);
+    size_t insertPos
+      = min(outputPath.find('.', lastSlash), outputPath.length());
     sobelPath.insert(insertPos, "_sobel");
     vertexPath.insert(insertPos, "_vertices");
     triangulatedPath.insert(insertPos, "_triangulated");
     outputPath.insert(insertPos, "_lowpoly");
   }
+  // points mode (a point file in, an index mesh out)
+  points = parser.get<bool>("--points");
+  if (points && !parser.present("--output")) {
+    size_t lastSlash = inputPath.find_last_of('/');
+    if (lastSlash == string::npos)
+      lastSlash = 0;
+    outputPath = inputPath.substr(0, inputPath.find('.', lastSlash))
+      + "_mesh.bin";
+  }
   // specify either target-input-width or preproc-scale, priority to former
   if (parser.present<int>("--target-input-width")) {
     int tiw = parser.get<int>("--target-input-width");
@@ -131,17 +290,65 @@ void CliOptions::parse(int argc, char* argv[]) {
     preprocScale = scale;
   }
   // specify either target-output-width or postproc-scale, priority to former
-  if (parser.present<int>("--target-output-width")) {
-    int tow = parser.get<int>("--target-output-width");
-    if (tow < 1)
-      throw invalid_argument("Must supply a positive integer width for output");
-    targetOutputWidth = tow;
+  if (parser.present("--target-output-width")) {
+    string tows = parser.get("--target-output-width");
+    invalid_argument towExcp(
+        "Must supply positive integer widths for output (e.g. 256,1024)");
+    size_t start = 0, comma;
+    do {
+      comma = tows.find(',', start);
+      string towStr = tows.substr(start, comma - start);
+      size_t lastParsed = 0;
+      int tow = 0;
+      try {
+        tow = stoi(towStr, &lastParsed);
+      } catch (const exception &) {
+        throw towExcp;
+      }
+      if (lastParsed != towStr.length() || tow < 1)
+        throw towExcp;
+      for (uint width : targetOutputWidths)
+        if (width == static_cast<uint>(tow))
+          throw invalid_argument("Output widths must be distinct");
+      targetOutputWidths.push_back(tow);
+      start = comma + 1;
+    } while (comma != string::npos);
   } else {
     float scale = parser.get<float>("--postproc-scale");
     if (scale <= 0.0f)
       throw invalid_argument("Must supply a positive float for scale");
     postprocScale = scale;
   }
+  // region of interest: parse string in the form "x,y,w,h"
+  if (parser.present("--roi")) {
+    string roiStr = parser.get("--roi");
+    invalid_argument roiExcp(
+        "Must supply a rectangle as x,y,w,h (e.g. 0,0,640,480)");
+    int values[4];
+    size_t start = 0;
+    for (int i = 0; i < 4; i++) {
+      size_t comma = roiStr.find(',', start);
+      if ((comma == string::npos) != (i == 3))
+        throw roiExcp;
+      string valueStr = roiStr.substr(start, comma - start);
+      size_t lastParsed = 0;
+      try {
+        values[i] = stoi(valueStr, &lastParsed);
+      } catch (const exception &) {
+        throw roiExcp;
+      }
+      if (lastParsed != valueStr.length() || values[i] < (i < 2 ? 0 : 1))
+        throw roiExcp;
+      start = comma + 1;
+    }
+    roi = cv::Rect(values[0], values[1], values[2], values[3]);
+  }
+  // mask (checked against the image size once it is read)
+  if (parser.present("--mask")) {
+    maskPath = parser.get("--mask");
+    if (!ifstream(maskPath).good())
+      throw invalid_argument(maskPath + " is not a readable file");
+  }
   // edge threshold
   float et = parser.get<float>("--edge-threshold");
   if (et < 0.0f || et > 1.0f)
@@ -166,16 +373,143 @@ void CliOptions::parse(int argc, char* argv[]) {
   if (start < 1 || end < 1 || start > end)
     throw anmsExcp;
   anmsKernelRange = {start, end};
+  // vertex selector
+  string vs = parser.get("--vertex-selector");
+  if (vs == "grid")
+    vertexSelector = VertexSelector::Grid;
+  else if (vs == "refine")
+    vertexSelector = VertexSelector::Refine;
+  else
+    vertexSelector = VertexSelector::ANMS;
+  int k = parser.get<int>("--grid-top-k");
+  if (k < 1)
+    throw invalid_argument("Must supply a positive integer for grid top-k");
+  gridTopK = k;
+  // refinement budgets
+  float re = parser.get<float>("--refine-error");
+  if (re <= 0.0f)
+    throw invalid_argument("Must supply a positive float for refine error");
+  refineError = re;
+  int rt = parser.get<int>("--refine-triangles");
+  if (rt < 0)
+    throw invalid_argument("Refine triangle budget must not be negative");
+  refineTriangles = rt;
+  // contour constraints
+  float ce = parser.get<float>("--constrain");
+  if (ce < 0.0f)
+    throw invalid_argument("Contour tolerance must not be negative");
+  constrainEpsilon = ce;
+  // pyramid levels
+  int pl = parser.get<int>("--pyramid");
+  if (pl < 0 || pl > 8)
+    throw invalid_argument("Pyramid levels must be within [0, 8]");
+  pyramidLevels = pl;
+  // the pyramid is a faster aNMS, other selectors have none
+  if (pyramidLevels > 0 && vertexSelector != VertexSelector::ANMS)
+    throw invalid_argument("--pyramid needs --vertex-selector anms");
   // salt percent
   float sr = parser.get<float>("--salt");
   if (sr < 0.0f || sr > 1.0f)
     throw invalid_argument("Salt percent value must be within [0.0, 1.0]");
   saltRatio = sr;
+  // cache directory (created on first use)
+  if (parser.present("--cache"))
+    cacheDir = parser.get("--cache");
   // silent
   silent = parser.get<bool>("--silent");
   // interactive
   interactive = parser.get<bool>("--interactive");
   // all
   all = parser.get<bool>("--all");
+  // metrics
+  metrics = parser.get<bool>("--metrics");
+  // trace (written once processing ends, which interactive sessions don't)
+  if (parser.present("--trace"))
+    tracePath = parser.get("--trace");
+  if (!tracePath.empty() && interactive)
+    throw invalid_argument("--trace cannot be combined with --interactive");
+  // max memory (intermediate images are never kept, so nothing to show/write)
+  maxMemory = parser.get<bool>("--max-memory");
+  if (maxMemory && (interactive || all))
+    throw invalid_argument(
+        "--max-memory cannot be combined with --interactive or --all");
+  // several output widths (one mesh, so nothing to re-run interactively)
+  if (targetOutputWidths.size() > 1 && interactive)
+    throw invalid_argument(
+        "Several output widths cannot be combined with --interactive");
+  // stream output (full-size images are never built, so nothing to preview)
+  streamOutput = parser.get<bool>("--stream-output");
+  if (streamOutput && interactive)
+    throw invalid_argument(
+        "--stream-output cannot be combined with --interactive");
+  // standard output (a single image, everything printed goes to stderr)
+  if (outputPath == "-" && (all || interactive
+        || targetOutputWidths.size() > 1))
+    throw invalid_argument("Standard output takes one image, so it cannot be"
+        " combined with --all, --interactive or several output widths");
+  if (streamOutput && (roi || !maskPath.empty()))
+    throw invalid_argument(
+        "--stream-output cannot be combined with --roi or --mask");
+  if (streamOutput && !isStreamableFormat(outputPath))
+    throw invalid_argument("--stream-output needs a .png or .ppm output path");
+  // threads (the output does not depend on the count)
+  int nThreads = parser.get<int>("--threads");
+  if (nThreads < 0)
+    throw invalid_argument("Thread count must not be negative");
+  threads = nThreads;
+  pinThreads = parser.get<bool>("--pin-threads");
+  // kernel instruction set (forcing one this CPU lacks would crash later)
+  if (parser.get("--isa") != "auto") {
+    isaLevel = isa::parse(parser.get("--isa"));
+    if (*isaLevel > isa::detected())
+      throw invalid_argument(string("This CPU does not support --isa ")
+          + isa::name(*isaLevel));
+  }
+  // triangle order
+  if (parser.get("--triangle-order") == "hilbert")
+    triangleOrder = delaunay::TriangleOrder::Hilbert;
+  else
+    triangleOrder = delaunay::TriangleOrder::Traversal;
+  // sampled colors
+  float ct = parser.get<float>("--color-tolerance");
+  if (ct < 0.0f)
+    throw invalid_argument("Color tolerance must not be negative");
+  colorTolerance = ct;
+  // decimation
+  float dt = parser.get<float>("--decimate");
+  if (dt < 0.0f)
+    throw invalid_argument("Decimation tolerance must not be negative");
+  decimateTolerance = dt;
+  // voronoi (cells are not rendered in strips)
+  voronoi = parser.get<bool>("--voronoi");
+  if (voronoi && streamOutput)
+    throw invalid_argument("--voronoi cannot be combined with --stream-output");
+  // constrained edges (the cells of a constrained mesh are not Voronoi)
+  if (constrainEpsilon > 0.0f && (voronoi || points))
+    throw invalid_argument(
+        "--constrain cannot be combined with --voronoi or --points");
+  // decimation merges colored triangles
+  if (decimateTolerance > 0.0f && (voronoi || points))
+    throw invalid_argument(
+        "--decimate cannot be combined with --voronoi or --points");
+  // points mode (no image, so nothing to preview, render or stream)
+  if (points && (interactive || all || streamOutput || voronoi || roi
+        || !maskPath.empty() || rawSize || inputPath == "-"
+        || outputPath == "-"))
+    throw invalid_argument("--points cannot be combined with --interactive,"
+        " --all, --stream-output, --voronoi, --roi, --mask, --raw or standard"
+        " input/output");
 }
 
+string CliOptions::outputPathFor(size_t i) const {
+  if (targetOutputWidths.size() <= 1)
+    return outputPath;
+  // Insert the width before the extension, like the _lowpoly suffix
+  string path = outputPath;
+  size_t lastSlash = path.find_last_of('/');
+  if (lastSlash == string::npos)
+    lastSlash = 0;
+  size_t insertPos = min(path.find('.', lastSlash), path.length());
+  path.insert(insertPos, "_" + to_string(targetOutputWidths[i]));
+  return path;
+}
@@ -1,26 +1,56 @@
 #ifndef CLI_PARSER_HPP
 #define CLI_PARSER_HPP
 
+#include "delaunay/mesh.h"
+#include "isa.h"
+#include <opencv2/core/types.hpp>
 #include <optional>
 #include <string>
+#include <vector>
+
+enum class VertexSelector { ANMS, Grid, Refine };
 
 struct CliOptions {
   void parse(int argc, char *argv[]);
-  std::string inputPath;
+  // Path of the i-th output size (outputPath unless several widths are given)
+  std::string outputPathFor(size_t i) const;
+  std::string inputPath; // "-" for standard input
+  std::optional<cv::Size> rawSize; // raw BGR input of this size
   std::string sobelPath;
   std::string vertexPath;
   std::string triangulatedPath;
-  std::string outputPath;
+  std::string outputPath; // "-" for standard output
   float preprocScale = 1.0f;
   float postprocScale = 1.0f;
   std::optional<uint> targetInputWidth;
-  std::optional<uint> targetOutputWidth;
+  std::vector<uint> targetOutputWidths; // the first sets the main output
+  std::optional<cv::Rect> roi; // original pixels, unset for the whole image
+  std::string maskPath;
   float edgeThreshold = 0.4f;
   std::pair<uint, uint> anmsKernelRange {2, 7};
+  VertexSelector vertexSelector = VertexSelector::ANMS;
+  uint gridTopK = 1;
+  uint pyramidLevels = 0;
+  float refineError = 12.0f;
+  uint refineTriangles = 0;
+  float constrainEpsilon = 0.0f; // 0 leaves the mesh unconstrained
   float saltRatio = 0.001f;
+  bool voronoi = false;
+  float colorTolerance = 0.0f; // 0 averages every pixel
+  float decimateTolerance = 0.0f; // 0 keeps every triangle
+  delaunay::TriangleOrder triangleOrder = delaunay::TriangleOrder::Traversal;
+  std::string cacheDir;
   bool silent = false;
   bool interactive = false;
   bool all = false;
+  bool metrics = false;
+  std::string tracePath;
+  bool maxMemory = false;
+  bool streamOutput = false;
+  bool points = false;
+  uint threads = 0;
+  bool pinThreads = false;
+  std::optional<isa::Level> isaLevel; // unset runs the best the CPU has
 };
 
 #endif // !CLI_PARSER_HPP
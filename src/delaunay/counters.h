@@ -0,0 +1,70 @@
+#ifndef COUNTERS_HPP
+#define COUNTERS_HPP
+
+#include "delaunay/stats.h"
+
+#ifdef DELAUNAY_STATS
+
+#include <atomic>
+#include <cstdint>
+
+namespace delaunay::counters {
+
+  struct Counters {
+    std::atomic<uint64_t> inCircleCalls{0};
+    std::atomic<uint64_t> isCCWCalls{0};
+    std::atomic<uint64_t> edgesConnected{0};
+    std::atomic<uint64_t> edgesSevered{0};
+    std::atomic<uint64_t> colinearBaseCases{0};
+    std::atomic<uint64_t> longestSeverWalk{0};
+    std::atomic<uint64_t> maxDepth{0};
+    std::atomic<int64_t> liveEdges{0};
+    std::atomic<int64_t> peakLiveEdges{0};
+    std::atomic<uint64_t> mergeIterations[Stats::MAX_LEVELS] = {};
+  };
+
+  extern Counters global;
+
+  template <typename T>
+  inline void add(std::atomic<T> &counter, T n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  template <typename T>
+  inline void raise(std::atomic<T> &counter, T value) {
+    T current = counter.load(std::memory_order_relaxed);
+    while (current < value && !counter.compare_exchange_weak(
+          current, value, std::memory_order_relaxed)) {}
+  }
+
+  inline void addLiveEdges(int64_t n) {
+    int64_t live = global.liveEdges.fetch_add(n, std::memory_order_relaxed) + n;
+    raise(global.peakLiveEdges, live);
+  }
+
+  inline uint64_t level(unsigned depth) {
+    return depth < Stats::MAX_LEVELS ? depth : Stats::MAX_LEVELS - 1;
+  }
+
+}
+
+#define DELAUNAY_COUNT(counter) \
+  ::delaunay::counters::add(::delaunay::counters::global.counter, uint64_t(1))
+#define DELAUNAY_MAX(counter, value) \
+  ::delaunay::counters::raise( \
+      ::delaunay::counters::global.counter, uint64_t(value))
+#define DELAUNAY_LIVE_EDGES(n) \
+  ::delaunay::counters::addLiveEdges(int64_t(n))
+#define DELAUNAY_COUNT_MERGE(depth) \
+  DELAUNAY_COUNT(mergeIterations[::delaunay::counters::level(depth)])
+
+#else
+
+#define DELAUNAY_COUNT(counter) ((void)0)
+#define DELAUNAY_MAX(counter, value) ((void)(value))
+#define DELAUNAY_LIVE_EDGES(n) ((void)0)
+#define DELAUNAY_COUNT_MERGE(depth) ((void)(depth))
+
+#endif // DELAUNAY_STATS
+
+#endif // !COUNTERS_HPP
@@ -1,17 +1,23 @@
 #include "delaunay/delaunay.h"
 #include "delaunay/quad_edge_ref.h"
+#include "delaunay/thread_pool.h"
+#include "delaunay/trace.h"
+#include "counters.h"
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <functional>
-#include <opencv2/core.hpp>
-#include <opencv2/core/hal/interface.h>
-#include <opencv2/core/mat.hpp>
 #include <opencv2/core/types.hpp>
-#include <set>
 #include <stdexcept>
-#include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace delaunay {
@@ -20,147 +26,167 @@ namespace delaunay {
   using namespace cv;
   using namespace quadedge;
 
-  struct comparePoints {
-    bool operator()(const Point &a, const Point &b) const {
-      return (a.x == b.x) ? (a.y < b.y) : (a.x < b.x);
-    }
-  };
+  // Counted forwards to the predicate policy used throughout this file
+  template <typename Predicates, typename PointT>
+  inline bool ccw(const PointT &a, const PointT &b, const PointT &c) {
+    DELAUNAY_COUNT(isCCWCalls);
+    return Predicates::isCCW(a, b, c);
+  }
 
-  bool isCCW(Point a, Point b, Point c) {
-    double xa = a.x, ya = a.y;
-    double xb = b.x, yb = b.y;
-    double xc = c.x, yc = c.y;
-    double data[3][3] = {
-      { xa, ya, 1 },
-      { xb, yb, 1 },
-      { xc, yc, 1 },
-    };
-    Mat ccwTest(3, 3, CV_64F, data);
-    return determinant(ccwTest) > 0;
+  template <typename Predicates, typename PointT>
+  inline bool circle(
+      const PointT &a, const PointT &b, const PointT &c, const PointT &d) {
+    DELAUNAY_COUNT(inCircleCalls);
+    return Predicates::inCircle(a, b, c, d);
   }
 
-  bool isLeftOf(Point test, QuadEdgeRef *edge) {
-    if (!edge->origCoords.has_value() || !edge->termCoords().has_value())
-      throw logic_error("Edge not between vertices.");
-    return isCCW(test, edge->origCoords.value(), edge->termCoords().value());
+  template <typename PointT, typename Predicates>
+  bool isCCW(PointT a, PointT b, PointT c) {
+    return ccw<Predicates>(a, b, c);
   }
 
-  bool isRightOf(Point test, QuadEdgeRef *edge) {
-    if (!edge->origCoords.has_value() || !edge->termCoords().has_value())
-      throw logic_error("Edge not between vertices.");
-    return isCCW(test, edge->termCoords().value(), edge->origCoords.value());
+  template <typename PointT, typename Predicates>
+  bool isLeftOf(PointT test, QuadEdgeRef<PointT> *edge) {
+    assert(edge->isPrimal());
+    return ccw<Predicates>(test, edge->origCoords(), edge->termCoords());
   }
 
-  bool isAbove(QuadEdgeRef *test, QuadEdgeRef *baseL) {
-    if (!baseL->origCoords.has_value() || !baseL->termCoords().has_value())
-      throw logic_error("Edge (baseL) not between vertices.");
-    if (!test->origCoords.has_value() || !test->termCoords().has_value())
-      throw logic_error("Edge (test) not between vertices.");
-    return isRightOf(test->termCoords().value(), baseL);
+  template <typename PointT, typename Predicates>
+  bool isRightOf(PointT test, QuadEdgeRef<PointT> *edge) {
+    assert(edge->isPrimal());
+    return ccw<Predicates>(test, edge->termCoords(), edge->origCoords());
   }
 
-  bool inCircle(Point a, Point b, Point c, Point test) {
-    double xa = a.x, ya = a.y, a2 = a.dot(a);
-    double xb = b.x, yb = b.y, b2 = b.dot(b);
-    double xc = c.x, yc = c.y, c2 = c.dot(c);
-    double xt = test.x, yt = test.y, t2 = test.dot(test);
-    double data[4][4] = {
-      { xa, ya, a2, 1 },
-      { xb, yb, b2, 1 },
-      { xc, yc, c2, 1 },
-      { xt, yt, t2, 1 },
-    };
-    Mat inCircleMat(4, 4, CV_64F, data);
-    double inCircleDet = determinant(inCircleMat);
-    return isCCW(a, b, c) ? inCircleDet > 0 : inCircleDet < 0;
+  template <typename PointT, typename Predicates>
+  bool isAbove(QuadEdgeRef<PointT> *test, QuadEdgeRef<PointT> *baseL) {
+    assert(test->isPrimal());
+    return isRightOf<PointT, Predicates>(test->termCoords(), baseL);
+  }
+
+  template <typename PointT, typename Predicates>
+  bool inCircle(PointT a, PointT b, PointT c, PointT test) {
+    return circle<Predicates>(a, b, c, test);
   }
 
-  pair<QuadEdgeRef*, QuadEdgeRef*> triangulate_recurse(
-      const vector<Point> &points, uint first, uint last) {
+  // Halves at least this large are triangulated in parallel (they share no
+  // edges until the merge)
+  const uint PARALLEL_POINTS = 1 << 12;
+
+  template <typename PointT, typename Predicates>
+  pair<QuadEdgeRef<PointT>*, QuadEdgeRef<PointT>*> triangulate_recurse(
+      const vector<PointT> &points, uint first, uint last, uint depth) {
+    using Edge = QuadEdgeRef<PointT>;
+    DELAUNAY_MAX(maxDepth, depth);
     // Base case: 2 points => single quad-edge
     const uint N = last - first + 1, i = first, j = last;
     if (N < 2) {
       throw logic_error("Should never get here! Fewer than 2 points to "
           "triangulate.");
     } else if (N == 2) {
-      QuadEdgeRef *edge = makeQuadEdge(points[i], points[j]);
+      Edge *edge = makeQuadEdge(points[i], points[j]);
       return { edge, edge->sym() };
     // Base case: 3 points => single triangle
     } else if (N == 3) {
-      QuadEdgeRef *ab = makeQuadEdge(points[i], points[i+1]);
-      QuadEdgeRef *bc = makeQuadEdge(points[i+1], points[i+2]);
+      Edge *ab = makeQuadEdge(points[i], points[i+1]);
+      Edge *bc = makeQuadEdge(points[i+1], points[i+2]);
       splice(ab->sym(), bc);
-      if (isCCW(points[i], points[i+1], points[i+2])) {
+      if (ccw<Predicates>(points[i], points[i+1], points[i+2])) {
         connect(bc, ab);
         return { ab, bc->sym() };
-      } else if (isCCW(points[i], points[i+2], points[i+1])){
-        QuadEdgeRef *ca = connect(bc, ab);
+      } else if (ccw<Predicates>(points[i], points[i+2], points[i+1])) {
+        Edge *ca = connect(bc, ab);
         return { ca->sym(), ca };
       } else {
         // Colinear (do not connect into a triangle)
+        DELAUNAY_COUNT(colinearBaseCases);
         return { ab, bc->sym() };
       }
     // General case: 4+ points => recurse + merge
     } else {
+      // Subtrees large enough to matter show up in traces, merge included
+      tracing::Span span(N >= PARALLEL_POINTS ? "triangulate" : nullptr,
+          "delaunay", N);
       // Recurse on L and R -> left + right bounds
       uint middle = (first + last) / 2;
-      auto [ldo, ldi] = triangulate_recurse(points, first, middle);
-      auto [rdi, rdo] = triangulate_recurse(points, middle+1, last);
+      pair<Edge*, Edge*> left, right;
+      auto recurseLeft = [&]() {
+        left = triangulate_recurse<PointT, Predicates>(
+            points, first, middle, depth+1);
+      };
+      auto recurseRight = [&]() {
+        right = triangulate_recurse<PointT, Predicates>(
+            points, middle+1, last, depth+1);
+      };
+      if (N >= 2 * PARALLEL_POINTS) {
+        threadpool::invoke(recurseLeft, recurseRight);
+      } else {
+        recurseLeft();
+        recurseRight();
+      }
+      auto [ldo, ldi] = left;
+      auto [rdi, rdo] = right;
       // Create the base cross edge (lower common tangent)
       while(true) {
-        if (isLeftOf(rdi->origCoords.value(), ldi))
+        if (isLeftOf<PointT, Predicates>(rdi->origCoords(), ldi))
           ldi = ldi->lnext();
-        else if (isRightOf(ldi->origCoords.value(), rdi))
+        else if (isRightOf<PointT, Predicates>(ldi->origCoords(), rdi))
           rdi = rdi->rprev();
         else
           break;
       }
-      QuadEdgeRef *baseL = connect(rdi->sym(), ldi);
-      if (ldi->origCoords.value() == ldo->origCoords.value())
+      Edge *baseL = connect(rdi->sym(), ldi);
+      if (ldi->origCoords() == ldo->origCoords())
         ldo = baseL->sym();
-      if (rdi->origCoords.value() == rdo->origCoords.value())
+      if (rdi->origCoords() == rdo->origCoords())
         rdo = baseL;
       // Merge L and R
       while (true) {
+        DELAUNAY_COUNT_MERGE(depth);
         // Determine the best L candidate
-        QuadEdgeRef *lcand = baseL->sym()->onext;
-        if (isAbove(lcand, baseL)) {
+        Edge *lcand = baseL->sym()->onext;
+        if (isAbove<PointT, Predicates>(lcand, baseL)) {
           // Walk CCW around convex hull of L until we find a point not inCircle
-          while (inCircle(
-                baseL->termCoords().value(),
-                baseL->origCoords.value(),
-                lcand->termCoords().value(),
-                lcand->onext->termCoords().value())) {
-            QuadEdgeRef *next = lcand->onext;
+          [[maybe_unused]] uint64_t walk = 0;
+          while (circle<Predicates>(
+                baseL->termCoords(),
+                baseL->origCoords(),
+                lcand->termCoords(),
+                lcand->onext->termCoords())) {
+            Edge *next = lcand->onext;
             sever(lcand);
             lcand = next;
+            walk++;
           }
+          DELAUNAY_MAX(longestSeverWalk, walk);
         }
         // Determine the best R candidate
-        QuadEdgeRef *rcand = baseL->oprev();
-        if (isAbove(rcand, baseL)) {
+        Edge *rcand = baseL->oprev();
+        if (isAbove<PointT, Predicates>(rcand, baseL)) {
           // Walk CW around convex hull of R until we find a point not inCircle
-          while (inCircle(
-                baseL->termCoords().value(),
-                baseL->origCoords.value(),
-                rcand->termCoords().value(),
-                rcand->oprev()->termCoords().value())) {
-            QuadEdgeRef *next = rcand->oprev();
+          [[maybe_unused]] uint64_t walk = 0;
+          while (circle<Predicates>(
+                baseL->termCoords(),
+                baseL->origCoords(),
+                rcand->termCoords(),
+                rcand->oprev()->termCoords())) {
+            Edge *next = rcand->oprev();
             sever(rcand);
             rcand = next;
+            walk++;
           }
+          DELAUNAY_MAX(longestSeverWalk, walk);
         }
         // If neither candidate was valid, done (baseL is upper common tangent)
-        bool lCandValid = isAbove(lcand, baseL);
-        bool rCandValid = isAbove(rcand, baseL);
+        bool lCandValid = isAbove<PointT, Predicates>(lcand, baseL);
+        bool rCandValid = isAbove<PointT, Predicates>(rcand, baseL);
         if (!lCandValid && !rCandValid) {
           break;
         }
         // Choose the next cross edge to connect
-        bool test = inCircle(lcand->termCoords().value(),
-                             lcand->origCoords.value(),
-                             rcand->origCoords.value(),
-                             rcand->termCoords().value());
+        bool test = circle<Predicates>(lcand->termCoords(),
+                                       lcand->origCoords(),
+                                       rcand->origCoords(),
+                                       rcand->termCoords());
         if (!lCandValid || (rCandValid && test))
           baseL = connect(rcand, baseL->sym());
         else
@@ -170,99 +196,747 @@ namespace delaunay {
     }
   }
 
+  template <typename PointT, typename Predicates>
+  QuadEdgeRef<PointT>* triangulate(const vector<PointT> &points) {
+    return triangulate<PointT, Predicates>(points.data(), points.size());
+  }
 
-  QuadEdgeRef* triangulate(const vector<Point> &points) {
-    auto comparePoints = [](const Point &a, const Point &b) {
+  template <typename PointT, typename Predicates>
+  QuadEdgeRef<PointT>* triangulate(const PointT *points, size_t nPoints) {
+    auto comparePoints = [](const PointT &a, const PointT &b) {
       return (a.x == b.x) ? (a.y < b.y) : (a.x < b.x);
     };
-    set<Point, decltype(comparePoints)>
-      pointSet(points.begin(), points.end(), comparePoints);
-    vector<Point> uniqueSorted(pointSet.begin(), pointSet.end());
-    return triangulate_recurse(uniqueSorted, 0, uniqueSorted.size()-1).first;
+    vector<PointT> uniqueSorted(points, points + nPoints);
+    sort(uniqueSorted.begin(), uniqueSorted.end(), comparePoints);
+    uniqueSorted.erase(
+        unique(uniqueSorted.begin(), uniqueSorted.end()), uniqueSorted.end());
+    if (uniqueSorted.size() < 2)
+      throw invalid_argument("Need at least 2 distinct points to triangulate.");
+    // Recursion bounds and mesh indices are 32 bits wide
+    if (uniqueSorted.size() > UINT32_MAX)
+      throw length_error("Too many points to triangulate.");
+    return triangulate_recurse<PointT, Predicates>(
+        uniqueSorted, 0, uniqueSorted.size()-1, 0).first;
   }
 
-  struct EdgeHash {
-    size_t operator() (const pair<Point, Point> &edge) const {
-      string concat
-        = to_string(edge.first.x)
-        + to_string(edge.first.y)
-        + to_string(edge.second.x)
-        + to_string(edge.second.y);
-      hash<string> hasher;
-      return hasher(concat);
+  template <typename PointT, typename Predicates>
+  QuadEdgeRef<PointT>* insertSite(
+      QuadEdgeRef<PointT> *triangleEdge,
+      PointT point) {
+    using Edge = QuadEdgeRef<PointT>;
+    // The triangle's own edges are the first suspects: each keeps the new
+    // point on its left once the spokes are in
+    vector<Edge*> suspects = {
+      triangleEdge, triangleEdge->lnext(), triangleEdge->lnext()->lnext() };
+    Edge *spoke = insertPoint(triangleEdge, point);
+    // Lawson flips: an edge whose opposite vertex lies in the circumcircle of
+    // (edge, point) is flipped to the point, exposing the two far edges
+    while (!suspects.empty()) {
+      Edge *suspect = suspects.back();
+      suspects.pop_back();
+      Edge *farA = suspect->sym()->lnext(), *farB = farA->lnext();
+      if (farB->lnext() != suspect->sym())
+        continue; // outside face (convex hull)
+      const PointT opposite = farA->termCoords();
+      if (!ccw<Predicates>(suspect->termCoords(), suspect->origCoords(), opposite)
+          || !circle<Predicates>(suspect->origCoords(), suspect->termCoords(),
+                                 point, opposite))
+        continue;
+      flip(suspect);
+      suspects.push_back(farA);
+      suspects.push_back(farB);
+    }
+    return spoke->sym();
+  }
+
+  template <typename PointT>
+  struct PointHash {
+    size_t operator() (const PointT &p) const {
+      using Coord = decltype(PointT::x);
+      size_t hx = hash<Coord>()(p.x), hy = hash<Coord>()(p.y);
+      return hx ^ (hy + 0x9e3779b97f4a7c15ULL + (hx << 6) + (hx >> 2));
     }
   };
 
-  bool isEdgeMarked(
-      QuadEdgeRef *edge,
-      const unordered_set<pair<Point, Point>, EdgeHash> &seen) {
-    return seen.count(edge->points()) > 0;
-  }
+  template <typename PointT, typename Predicates>
+  size_t insertConstraints(
+      QuadEdgeRef<PointT> *edge,
+      const vector<pair<PointT, PointT>> &segments) {
+    using Edge = QuadEdgeRef<PointT>;
+    // Which side of ab c is on: 1 left, -1 right, 0 on the line
+    auto side = [](const PointT &a, const PointT &b, const PointT &c) {
+      return ccw<Predicates>(a, b, c) ? 1 : (ccw<Predicates>(a, c, b) ? -1 : 0);
+    };
+    auto collinear = [&](const PointT &a, const PointT &b, const PointT &c) {
+      return side(a, b, c) == 0;
+    };
+    // Whether pq and ab cross at a point interior to both
+    auto crosses = [&](const PointT &p, const PointT &q,
+                       const PointT &a, const PointT &b) {
+      return side(a, b, p) * side(a, b, q) < 0
+        && side(p, q, a) * side(p, q, b) < 0;
+    };
+    auto isTriangle = [](Edge *e) { return e->lnext()->lnext()->lnext() == e; };
+
+    // One edge leaving each vertex, kept valid across flips
+    unordered_map<PointT, Edge*, PointHash<PointT>> vertexEdge;
+    unordered_set<Edge*> seen;
+    vector<Edge*> stack = { edge, edge->sym() };
+    while (!stack.empty()) {
+      Edge *e = stack.back();
+      stack.pop_back();
+      if (!seen.insert(e).second)
+        continue;
+      vertexEdge.try_emplace(e->origCoords(), e);
+      stack.push_back(e->sym());
+      stack.push_back(e->onext);
+    }
+    auto flipEdge = [&](Edge *e) {
+      vertexEdge[e->origCoords()] = e->oprev();
+      vertexEdge[e->termCoords()] = e->sym()->oprev();
+      flip(e);
+    };
+
+    unordered_set<QuadEdge<PointT>*> constrained;
+    vector<Edge*> created;
+    vector<pair<PointT, PointT>> pending(segments.rbegin(), segments.rend());
+    while (!pending.empty()) {
+      const auto [a, b] = pending.back();
+      pending.pop_back();
+      if (a == b)
+        continue;
+      auto found = vertexEdge.find(a);
+      if (found == vertexEdge.end() || vertexEdge.count(b) == 0)
+        throw invalid_argument("Constraint endpoints must be vertices.");
+      // Turn around a to the edge along ab, or the triangle ab leaves a by
+      Edge *along = nullptr, *crossing = nullptr;
+      Edge *e = found->second;
+      do {
+        const PointT p = e->termCoords(), r = e->onext->termCoords();
+        if (collinear(a, p, b) && (double(p.x) - a.x) * (double(b.x) - a.x)
+            + (double(p.y) - a.y) * (double(b.y) - a.y) > 0) {
+          along = e;
+          break;
+        }
+        if (isTriangle(e) && ccw<Predicates>(a, p, b)
+            && ccw<Predicates>(a, b, r)) {
+          crossing = e->lnext();
+          break;
+        }
+        e = e->onext;
+      } while (e != found->second);
+      if (along) {
+        // Already an edge, up to a vertex on the way to b
+        constrained.insert(along->quad());
+        if (along->termCoords() != b)
+          pending.push_back({ along->termCoords(), b });
+        continue;
+      }
+      if (!crossing)
+        throw logic_error("Should never get here! Constraint leaves the "
+            "triangulation.");
+
+      // Every edge crossed on the way to b (or a vertex on ab), each directed
+      // from the right of ab to its left
+      PointT end = b;
+      vector<Edge*> crossed;
+      bool blocked = false;
+      for (Edge *c = crossing; ; ) {
+        if (constrained.count(c->quad()) > 0) {
+          blocked = true;
+          break;
+        }
+        crossed.push_back(c);
+        Edge *far = c->sym()->lnext();
+        const PointT s = far->termCoords();
+        if (s == b)
+          break;
+        if (collinear(a, b, s)) {
+          end = s;
+          pending.push_back({ s, b });
+          break;
+        }
+        c = ccw<Predicates>(a, b, s) ? far : far->lnext();
+      }
+      if (blocked)
+        continue; // would cross an earlier segment
 
-  void markEdge(
-      QuadEdgeRef *edge,
-      unordered_set<pair<Point, Point>, EdgeHash> &seen) {
-    seen.insert(edge->points());
-    seen.insert(edge->sym()->points());
+      // Flip crossing edges whose quadrilateral is convex until none cross
+      // (some always is); the new edges are checked for Delaunay at the end
+      deque<Edge*> queue(crossed.begin(), crossed.end());
+      while (!queue.empty()) {
+        Edge *c = queue.front();
+        queue.pop_front();
+        const PointT u = c->origCoords(), v = c->termCoords();
+        const PointT w = c->lnext()->termCoords();
+        const PointT z = c->sym()->lnext()->termCoords();
+        if (!ccw<Predicates>(z, w, u) || !ccw<Predicates>(z, v, w)) {
+          queue.push_back(c);
+          continue;
+        }
+        flipEdge(c);
+        const PointT p = c->origCoords(), q = c->termCoords();
+        if (crosses(p, q, a, end)) {
+          queue.push_back(c);
+        } else if ((p == a && q == end) || (p == end && q == a)) {
+          constrained.insert(c->quad());
+        } else {
+          created.push_back(c);
+        }
+      }
+    }
+
+    // Lawson flips as in insertSite, never across a constrained edge
+    while (!created.empty()) {
+      Edge *c = created.back();
+      created.pop_back();
+      if (constrained.count(c->quad()) > 0 || !isTriangle(c)
+          || !isTriangle(c->sym()))
+        continue;
+      const PointT u = c->origCoords(), v = c->termCoords();
+      const PointT w = c->lnext()->termCoords();
+      const PointT z = c->sym()->lnext()->termCoords();
+      if (!circle<Predicates>(u, v, w, z) || !ccw<Predicates>(z, w, u)
+          || !ccw<Predicates>(z, v, w))
+        continue;
+      Edge *outer[4] = { c->lnext(), c->lnext()->lnext(),
+                         c->sym()->lnext(), c->sym()->lnext()->lnext() };
+      flipEdge(c);
+      created.insert(created.end(), outer, outer + 4);
+    }
+    return constrained.size();
   }
 
-  bool isEdgeMapped(
-      QuadEdgeRef *edge,
-      const unordered_map<pair<Point, Point>, vector<Point>, EdgeHash> &map) {
-    return map.count(edge->points()) > 0;
+  // Distance along a Hilbert curve filling a 2^16 x 2^16 grid
+  inline uint64_t hilbertIndex(uint32_t x, uint32_t y) {
+    const uint32_t n = 1u << 16;
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+      const uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+      d += uint64_t(s) * s * ((3 * rx) ^ ry);
+      // Rotate the quadrant so the curve stays continuous
+      if (ry == 0) {
+        if (rx == 1) {
+          x = n - 1 - x;
+          y = n - 1 - y;
+        }
+        swap(x, y);
+      }
+    }
+    return d;
   }
 
-  void extractTriangles_recurse(
-      QuadEdgeRef *edge,
-      vector<vector<Point>> &triangles,
-      unordered_set<pair<Point, Point>, EdgeHash> &seen,
-      unordered_map<pair<Point, Point>, vector<Point>*, EdgeHash> &triangulated) {
-    // Skip seen edges
-    if (isEdgeMarked(edge, seen))
-      return;
-    // Traverse CCW until back at start
-    const QuadEdgeRef *firstEdge = edge;
-    vector<QuadEdgeRef*> polyEdges;
-    do {
-      polyEdges.push_back(edge);
-      edge = edge->lnext();
-    } while (edge != firstEdge);
-    if (polyEdges.size() != 3) // Ignore the outside face (convex hull)
+  template <typename PointT>
+  void sortTriangles(Mesh<PointT> &mesh, TriangleOrder order) {
+    if (order == TriangleOrder::Traversal || mesh.size() == 0)
       return;
-    // Extract triangle vertices, recurse along neighbors along the way
-    vector<Point> triangle;
-    for (const auto &e : polyEdges) {
-      triangle.push_back(e->origCoords.value());
-      markEdge(e, seen);
-      extractTriangles_recurse(e->oprev(), triangles, seen, triangulated);
+    // Centroids on a square 16-bit grid over the vertices' bounding box
+    double xMin = mesh.vertices[0].x, xMax = xMin;
+    double yMin = mesh.vertices[0].y, yMax = yMin;
+    for (const PointT &v : mesh.vertices) {
+      xMin = min<double>(xMin, v.x);
+      xMax = max<double>(xMax, v.x);
+      yMin = min<double>(yMin, v.y);
+      yMax = max<double>(yMax, v.y);
+    }
+    const double extent = max(xMax - xMin, yMax - yMin);
+    const double scale = extent > 0.0 ? 65535.0 / extent : 0.0;
+    vector<pair<uint64_t, uint32_t>> keys(mesh.size());
+    for (size_t t = 0; t < mesh.size(); t++) {
+      double x = 0.0, y = 0.0;
+      for (int j = 0; j < 3; j++) {
+        x += mesh.vertex(t, j).x;
+        y += mesh.vertex(t, j).y;
+      }
+      keys[t] = { hilbertIndex((x / 3 - xMin) * scale, (y / 3 - yMin) * scale),
+                  t };
+    }
+    sort(keys.begin(), keys.end());
+
+    // Vertices are renumbered as the sorted triangles first use them
+    const uint32_t UNUSED = UINT32_MAX;
+    const bool colored = mesh.colors.size() == mesh.size();
+    vector<uint32_t> newIndex(mesh.vertices.size(), UNUSED);
+    Mesh<PointT> sorted;
+    sorted.vertices.reserve(mesh.vertices.size());
+    sorted.indices.reserve(mesh.indices.size());
+    if (colored)
+      sorted.colors.reserve(mesh.size());
+    for (const auto &[key, t] : keys) {
+      for (int j = 0; j < 3; j++) {
+        const uint32_t old = mesh.indices[3 * t + j];
+        if (newIndex[old] == UNUSED) {
+          newIndex[old] = sorted.vertices.size();
+          sorted.vertices.push_back(mesh.vertices[old]);
+        }
+        sorted.indices.push_back(newIndex[old]);
+      }
+      if (colored)
+        sorted.colors.push_back(mesh.colors[t]);
+    }
+    for (size_t v = 0; v < mesh.vertices.size(); v++)
+      if (newIndex[v] == UNUSED)
+        sorted.vertices.push_back(mesh.vertices[v]);
+    mesh = move(sorted);
+  }
+
+  template <typename PointT, typename Predicates>
+  Mesh<PointT> extractTriangles(
+      QuadEdgeRef<PointT> *edge,
+      TriangleOrder order) {
+    using Edge = QuadEdgeRef<PointT>;
+    Mesh<PointT> mesh;
+    unordered_map<PointT, uint32_t, PointHash<PointT>> vertexIndex;
+    unordered_set<Edge*> seen;
+    // Depth-first walk over faces: each face is traversed CCW via lnext, and
+    // the sym of each of its edges leads into the neighboring face
+    vector<Edge*> stack = { edge, edge->sym() };
+    while (!stack.empty()) {
+      Edge *first = stack.back();
+      stack.pop_back();
+      if (seen.count(first) > 0)
+        continue;
+      Edge *face[3];
+      uint nEdges = 0;
+      Edge *e = first;
+      do {
+        seen.insert(e);
+        if (nEdges < 3)
+          face[nEdges] = e;
+        nEdges++;
+        stack.push_back(e->sym());
+        e = e->lnext();
+      } while (e != first);
+      // Ignore the outside face (convex hull, traversed CW) and slivers
+      if (nEdges != 3 || !ccw<Predicates>(face[0]->origCoords(),
+                                          face[1]->origCoords(),
+                                          face[2]->origCoords()))
+        continue;
+      for (const auto &fe : face) {
+        auto [it, inserted] = vertexIndex.try_emplace(
+            fe->origCoords(), mesh.vertices.size());
+        if (inserted)
+          mesh.vertices.push_back(fe->origCoords());
+        mesh.indices.push_back(it->second);
+      }
+    }
+    sortTriangles(mesh, order);
+    return mesh;
+  }
+
+  // A triangle's corners rotated to start at the smallest, so each face has
+  // one key however it is reached
+  template <typename PointT>
+  struct TriangleKey {
+    TriangleKey(const PointT &a, const PointT &b, const PointT &c)
+      : corners{ a, b, c } {
+      auto less = [](const PointT &p, const PointT &q) {
+        return (p.x == q.x) ? (p.y < q.y) : (p.x < q.x);
+      };
+      const int first
+        = less(b, a) ? (less(c, b) ? 2 : 1) : (less(c, a) ? 2 : 0);
+      rotate(corners, corners + first, corners + 3);
+    }
+    bool operator==(const TriangleKey &other) const {
+      return equal(corners, corners + 3, other.corners);
+    }
+    PointT corners[3];
+  };
+
+  template <typename PointT>
+  struct TriangleKeyHash {
+    size_t operator() (const TriangleKey<PointT> &key) const {
+      size_t h = 0;
+      for (const PointT &p : key.corners)
+        h = h * 0x100000001b3ULL ^ PointHash<PointT>()(p);
+      return h;
     }
-    // Check if all edges along path are already in the same triangle
-    bool sameTriangle = true;
-    vector<Point> *existingTriangle = nullptr;
-    for (const auto &e : polyEdges) {
-      const auto found = triangulated.find(e->points());
-      if (found == triangulated.end()
-          || (existingTriangle && found->second != existingTriangle)) {
-        sameTriangle = false;
-        break;
+  };
+
+  template <typename PointT, typename Predicates>
+  Mesh<PointT> decimate(
+      QuadEdgeRef<PointT> *&edge,
+      const Mesh<PointT> &mesh,
+      double tolerance,
+      TriangleOrder order,
+      const vector<pair<PointT, PointT>> &constraints) {
+    using Edge = QuadEdgeRef<PointT>;
+    if (mesh.colors.size() != mesh.size())
+      throw invalid_argument("Decimation needs a color per triangle.");
+    // Each face's color, and the per-channel range of the input colors it
+    // stands for
+    struct FaceColor {
+      Scalar color, lo, hi;
+    };
+    unordered_map<TriangleKey<PointT>, FaceColor, TriangleKeyHash<PointT>>
+      faces;
+    for (size_t t = 0; t < mesh.size(); t++)
+      faces.emplace(TriangleKey<PointT>(mesh.vertex(t, 0), mesh.vertex(t, 1),
+            mesh.vertex(t, 2)),
+          FaceColor{ mesh.colors[t], mesh.colors[t], mesh.colors[t] });
+    auto faceLeftOf = [&](Edge *e) {
+      return faces.find(TriangleKey<PointT>(e->origCoords(), e->termCoords(),
+            e->lnext()->termCoords()));
+    };
+    auto area = [](const PointT &a, const PointT &b, const PointT &c) {
+      return abs((double(b.x) - a.x) * (double(c.y) - a.y)
+          - (double(b.y) - a.y) * (double(c.x) - a.x)) / 2;
+    };
+
+    // One edge leaving each vertex, kept valid across removals
+    unordered_map<PointT, Edge*, PointHash<PointT>> vertexEdge;
+    unordered_set<Edge*> seen;
+    vector<Edge*> stack = { edge, edge->sym() };
+    while (!stack.empty()) {
+      Edge *e = stack.back();
+      stack.pop_back();
+      if (!seen.insert(e).second)
+        continue;
+      vertexEdge.try_emplace(e->origCoords(), e);
+      stack.push_back(e->sym());
+      stack.push_back(e->onext);
+    }
+
+    // Constrained edges only go with their vertices, so every vertex along
+    // each segment stays: its ends, and those insertConstraints split it at,
+    // found by walking the edges along it
+    unordered_set<PointT, PointHash<PointT>> pinned;
+    for (const auto &[a, b] : constraints) {
+      pinned.insert(a);
+      pinned.insert(b);
+      PointT p = a;
+      while (p != b) {
+        auto found = vertexEdge.find(p);
+        if (found == vertexEdge.end())
+          break;
+        Edge *e = found->second, *along = nullptr;
+        do {
+          const PointT q = e->termCoords();
+          if (!ccw<Predicates>(p, q, b) && !ccw<Predicates>(p, b, q)
+              && (double(q.x) - p.x) * (double(b.x) - p.x)
+              + (double(q.y) - p.y) * (double(b.y) - p.y) > 0) {
+            along = e;
+            break;
+          }
+          e = e->onext;
+        } while (e != found->second);
+        if (!along)
+          break; // dropped for crossing an earlier segment
+        p = along->termCoords();
+        pinned.insert(p);
+      }
+    }
+
+    // Vertices are visited in mesh order, and the neighbours of a removed
+    // vertex again, since their surroundings just merged
+    deque<PointT> queue(mesh.vertices.begin(), mesh.vertices.end());
+    unordered_set<PointT, PointHash<PointT>> queued(
+        mesh.vertices.begin(), mesh.vertices.end());
+    vector<Edge*> spokes, ring, diagonals;
+    vector<PointT> polygon;
+    vector<int> ears;
+    while (!queue.empty()) {
+      const PointT v = queue.front();
+      queue.pop_front();
+      queued.erase(v);
+      auto found = vertexEdge.find(v);
+      if (found == vertexEdge.end() || pinned.count(v) > 0)
+        continue;
+
+      // Every face around v must be a colored triangle (hull vertices touch
+      // the outside face), all within tolerance of their merged color
+      spokes.clear();
+      Scalar sum, lo = Scalar::all(DBL_MAX), hi = Scalar::all(-DBL_MAX);
+      double totalArea = 0.0;
+      bool interior = true;
+      Edge *e = found->second;
+      do {
+        spokes.push_back(e);
+        auto face = faceLeftOf(e);
+        if (face == faces.end()) {
+          interior = false;
+          break;
+        }
+        const double a
+          = area(v, e->termCoords(), e->lnext()->termCoords());
+        sum += face->second.color * a;
+        totalArea += a;
+        for (int ch = 0; ch < 4; ch++) {
+          lo[ch] = min(lo[ch], face->second.lo[ch]);
+          hi[ch] = max(hi[ch], face->second.hi[ch]);
+        }
+        e = e->onext;
+      } while (e != found->second);
+      if (!interior || spokes.size() < 3 || totalArea <= 0.0)
+        continue;
+      const Scalar mean = sum * (1.0 / totalArea);
+      double spread = 0.0;
+      for (int ch = 0; ch < 4; ch++) {
+        const double d = max(hi[ch] - mean[ch], mean[ch] - lo[ch]);
+        spread += d * d;
+      }
+      if (spread > tolerance * tolerance)
+        continue;
+
+      // The hole v leaves, CCW: the far edge of each face, in face order
+      ring.clear();
+      for (Edge *s : spokes)
+        ring.push_back(s->lnext());
+      polygon.clear();
+      for (size_t i = 0; i < ring.size(); i++) {
+        polygon.push_back(ring[i]->origCoords());
+        auto next = find_if(ring.begin() + i + 1, ring.end(), [&](Edge *r) {
+          return r->origCoords() == ring[i]->termCoords();
+        });
+        if (next != ring.end())
+          swap(ring[i + 1], *next);
       }
-      if (found->second)
-        existingTriangle = found->second;
+      // Clip ears on the coordinates first, so a hole that can't be filled
+      // (never for a simple polygon) leaves v alone
+      ears.clear();
+      vector<PointT> left = polygon;
+      while (left.size() > 3) {
+        const size_t n = left.size();
+        size_t ear = n;
+        for (size_t i = 0; i < n && ear == n; i++) {
+          const PointT &a = left[i], &b = left[(i + 1) % n];
+          const PointT &c = left[(i + 2) % n];
+          if (!ccw<Predicates>(a, b, c))
+            continue;
+          bool empty = true;
+          for (size_t j = 0; j < n - 3 && empty; j++) {
+            const PointT &p = left[(i + 3 + j) % n];
+            empty = ccw<Predicates>(b, a, p) || ccw<Predicates>(c, b, p)
+              || ccw<Predicates>(a, c, p);
+          }
+          if (empty)
+            ear = i;
+        }
+        if (ear == n)
+          break;
+        ears.push_back(ear);
+        left.erase(left.begin() + (ear + 1) % n);
+      }
+      if (left.size() > 3)
+        continue;
+
+      // Faces merge as spokes go, so all are forgotten first
+      for (Edge *s : spokes)
+        faces.erase(faceLeftOf(s));
+      for (Edge *s : spokes)
+        sever(s);
+      vertexEdge.erase(found);
+      diagonals.clear();
+      vector<Edge*> hole = ring;
+      for (int ear : ears) {
+        const size_t n = hole.size();
+        Edge *diagonal = connect(hole[(ear + 1) % n], hole[ear]);
+        diagonals.push_back(diagonal);
+        hole[ear] = diagonal->sym();
+        hole.erase(hole.begin() + (ear + 1) % n);
+      }
+      // Lawson flips as in insertSite, only across the new diagonals
+      unordered_set<QuadEdge<PointT>*> inside;
+      for (Edge *d : diagonals)
+        inside.insert(d->quad());
+      vector<Edge*> suspects = diagonals;
+      while (!suspects.empty()) {
+        Edge *c = suspects.back();
+        suspects.pop_back();
+        if (inside.count(c->quad()) == 0)
+          continue;
+        const PointT u = c->origCoords(), w = c->termCoords();
+        const PointT x = c->lnext()->termCoords();
+        const PointT z = c->sym()->lnext()->termCoords();
+        if (!circle<Predicates>(u, w, x, z) || !ccw<Predicates>(z, x, u)
+            || !ccw<Predicates>(z, w, x))
+          continue;
+        Edge *outer[4] = { c->lnext(), c->lnext()->lnext(),
+                           c->sym()->lnext(), c->sym()->lnext()->lnext() };
+        flip(c);
+        suspects.insert(suspects.end(), outer, outer + 4);
+      }
+      // Every face of the filled hole touches the ring or a diagonal
+      const FaceColor merged{ mean, lo, hi };
+      auto color = [&](Edge *f) {
+        faces[TriangleKey<PointT>(f->origCoords(), f->termCoords(),
+            f->lnext()->termCoords())] = merged;
+      };
+      for (Edge *r : ring) {
+        color(r);
+        vertexEdge[r->origCoords()] = r;
+        if (queued.insert(r->origCoords()).second)
+          queue.push_back(r->origCoords());
+      }
+      for (Edge *d : diagonals) {
+        color(d);
+        color(d->sym());
+      }
+      edge = ring.front();
     }
-    // If any edge is not triangulated or not in the same triangle, add it
-    if (!sameTriangle) {
-      triangles.push_back(triangle);
-      for (const auto &e : polyEdges)
-        triangulated[e->points()] = &triangle;
+
+    Mesh<PointT> decimated = extractTriangles<PointT, Predicates>(edge, order);
+    decimated.colors.reserve(decimated.size());
+    for (size_t t = 0; t < decimated.size(); t++) {
+      auto face = faces.find(TriangleKey<PointT>(decimated.vertex(t, 0),
+            decimated.vertex(t, 1), decimated.vertex(t, 2)));
+      if (face == faces.end())
+        throw invalid_argument("Mesh was not extracted from this graph.");
+      decimated.colors.push_back(face->second.color);
     }
+    return decimated;
   }
 
-  vector<vector<Point>> extractTriangles(QuadEdgeRef *edge) {
-    vector<vector<Point>> simplices;
-    unordered_set<pair<Point, Point>, EdgeHash> seen;
-    unordered_map< pair<Point, Point>, vector<Point>*, EdgeHash> triangulated;
-    extractTriangles_recurse(edge, simplices, seen, triangulated);
-    return simplices;
+  // Circumcenter of abc, computed relative to a to limit cancellation
+  template <typename PointT>
+  Point2d circumcenter(const PointT &a, const PointT &b, const PointT &c) {
+    const double bx = double(b.x) - a.x, by = double(b.y) - a.y;
+    const double cx = double(c.x) - a.x, cy = double(c.y) - a.y;
+    const double d = 2.0 * (bx * cy - by * cx);
+    const double b2 = bx * bx + by * by, c2 = cx * cx + cy * cy;
+    return { a.x + (cy * b2 - by * c2) / d, a.y + (bx * c2 - cx * b2) / d };
   }
 
+  // A point far out along the perpendicular bisector of edge, on its left
+  // (or right) side: stands in for the missing corner of an unbounded cell
+  template <typename PointT>
+  Point2d farBisectorPoint(QuadEdgeRef<PointT> *edge, bool left, double far) {
+    const Point2d o(edge->origCoords().x, edge->origCoords().y);
+    const Point2d t(edge->termCoords().x, edge->termCoords().y);
+    const Point2d d = (t - o) * (1.0 / hypot(t.x - o.x, t.y - o.y));
+    const Point2d normal = left ? Point2d(-d.y, d.x) : Point2d(d.y, -d.x);
+    return (o + t) * 0.5 + normal * far;
+  }
+
+  // Sutherland-Hodgman clipping of a convex polygon to an axis-aligned box
+  void clipToBounds(vector<Point2d> &polygon, const Rect2d &bounds) {
+    const double limits[4] = { bounds.x, bounds.x + bounds.width,
+                               bounds.y, bounds.y + bounds.height };
+    vector<Point2d> input;
+    for (int side = 0; side < 4 && !polygon.empty(); side++) {
+      const bool yAxis = side >= 2, keepAbove = side % 2 == 0;
+      auto coord = [&](const Point2d &p) { return yAxis ? p.y : p.x; };
+      auto inside = [&](const Point2d &p) {
+        return keepAbove ? coord(p) >= limits[side] : coord(p) <= limits[side];
+      };
+      input.swap(polygon);
+      polygon.clear();
+      for (size_t i = 0; i < input.size(); i++) {
+        const Point2d &p = input[i], &q = input[(i + 1) % input.size()];
+        if (inside(p))
+          polygon.push_back(p);
+        if (inside(p) != inside(q)) {
+          const double t = (limits[side] - coord(p)) / (coord(q) - coord(p));
+          polygon.push_back(p + (q - p) * t);
+        }
+      }
+    }
+  }
+
+  template <typename PointT, typename Predicates>
+  Cells<PointT> extractCells(QuadEdgeRef<PointT> *edge, const Rect2d &bounds) {
+    using Edge = QuadEdgeRef<PointT>;
+    const uint32_t OUTSIDE = UINT32_MAX;
+    // Number the faces with the same walk as extractTriangles, computing each
+    // triangle's circumcenter (its Voronoi vertex) once. Every directed edge
+    // records its left face, i.e. the origin of its inverse-rot dual.
+    unordered_map<Edge*, uint32_t> leftFace;
+    vector<Point2d> centers;
+    vector<Edge*> edges;
+    vector<Edge*> stack = { edge, edge->sym() };
+    while (!stack.empty()) {
+      Edge *first = stack.back();
+      stack.pop_back();
+      if (leftFace.count(first) > 0)
+        continue;
+      Edge *face[3];
+      uint nEdges = 0;
+      Edge *e = first;
+      do {
+        if (nEdges < 3)
+          face[nEdges] = e;
+        nEdges++;
+        e = e->lnext();
+      } while (e != first);
+      uint32_t id = OUTSIDE;
+      if (nEdges == 3 && ccw<Predicates>(face[0]->origCoords(),
+                                         face[1]->origCoords(),
+                                         face[2]->origCoords())) {
+        id = centers.size();
+        centers.push_back(circumcenter(face[0]->origCoords(),
+                                       face[1]->origCoords(),
+                                       face[2]->origCoords()));
+      }
+      do {
+        leftFace[e] = id;
+        edges.push_back(e);
+        stack.push_back(e->sym());
+        e = e->lnext();
+      } while (e != first);
+    }
+
+    // Each cell is the ring of faces around its site: walking onext (CCW)
+    // visits the left faces in order, so the corners come out CCW
+    const double far = 1e4 * (bounds.width + bounds.height + 1.0);
+    Cells<PointT> cells;
+    unordered_set<Edge*> visited;
+    vector<Point2d> polygon;
+    for (Edge *start : edges) {
+      if (visited.count(start) > 0)
+        continue;
+      polygon.clear();
+      Edge *e = start;
+      do {
+        visited.insert(e);
+        const uint32_t face = leftFace.at(e);
+        if (face != OUTSIDE) {
+          polygon.push_back(centers[face]);
+        } else {
+          // Hull gap: out along this edge's bisector, back along the next's
+          polygon.push_back(farBisectorPoint(e, true, far));
+          polygon.push_back(farBisectorPoint(e->onext, false, far));
+        }
+        e = e->onext;
+      } while (e != start);
+      clipToBounds(polygon, bounds);
+      cells.sites.push_back(start->origCoords());
+      cells.corners.insert(cells.corners.end(), polygon.begin(), polygon.end());
+      cells.offsets.push_back(cells.corners.size());
+    }
+    return cells;
+  }
+
+#define INSTANTIATE_DELAUNAY(PointT) \
+  template bool inCircle<PointT, PredicatesFor<PointT>>( \
+      PointT, PointT, PointT, PointT); \
+  template bool isCCW<PointT, PredicatesFor<PointT>>(PointT, PointT, PointT); \
+  template bool isLeftOf<PointT, PredicatesFor<PointT>>( \
+      PointT, QuadEdgeRef<PointT>*); \
+  template bool isRightOf<PointT, PredicatesFor<PointT>>( \
+      PointT, QuadEdgeRef<PointT>*); \
+  template bool isAbove<PointT, PredicatesFor<PointT>>( \
+      QuadEdgeRef<PointT>*, QuadEdgeRef<PointT>*); \
+  template QuadEdgeRef<PointT>* triangulate<PointT, PredicatesFor<PointT>>( \
+      const vector<PointT>&); \
+  template QuadEdgeRef<PointT>* triangulate<PointT, PredicatesFor<PointT>>( \
+      const PointT*, size_t); \
+  template size_t insertConstraints<PointT, PredicatesFor<PointT>>( \
+      QuadEdgeRef<PointT>*, const vector<pair<PointT, PointT>>&); \
+  template Mesh<PointT> extractTriangles<PointT, PredicatesFor<PointT>>( \
+      QuadEdgeRef<PointT>*, TriangleOrder); \
+  template void sortTriangles(Mesh<PointT>&, TriangleOrder); \
+  template QuadEdgeRef<PointT>* insertSite<PointT, PredicatesFor<PointT>>( \
+      QuadEdgeRef<PointT>*, PointT); \
+  template Mesh<PointT> decimate<PointT, PredicatesFor<PointT>>( \
+      QuadEdgeRef<PointT>*&, const Mesh<PointT>&, double, TriangleOrder, \
+      const vector<pair<PointT, PointT>>&); \
+  template Cells<PointT> extractCells<PointT, PredicatesFor<PointT>>( \
+      QuadEdgeRef<PointT>*, const Rect2d&);
+
+  INSTANTIATE_DELAUNAY(cv::Point)
+  INSTANTIATE_DELAUNAY(cv::Point2f)
+  INSTANTIATE_DELAUNAY(cv::Point2d)
+
+#undef INSTANTIATE_DELAUNAY
+
 }
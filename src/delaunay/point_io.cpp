@@ -0,0 +1,166 @@
+#include "delaunay/point_io.h"
+#include <cctype>
+#include <charconv>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <opencv2/core/types.hpp>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+namespace delaunay {
+
+  using namespace std;
+
+  static bool hasExtension(const string &path, const string &extension) {
+    return path.size() >= extension.size()
+      && path.compare(path.size() - extension.size(), string::npos,
+          extension) == 0;
+  }
+
+  PointFormat pointFormat(const string &path) {
+    if (hasExtension(path, ".i32"))
+      return PointFormat::Int32;
+    if (hasExtension(path, ".f64"))
+      return PointFormat::Float64;
+    return PointFormat::Text;
+  }
+
+  // Parses "x y" pairs separated by whitespace or commas, skipping comments
+  template <typename PointT>
+  static void parsePoints(
+      const char *text,
+      size_t length,
+      vector<PointT> &points) {
+    using Coord = decltype(PointT::x);
+    const char *p = text, *end = text + length;
+    auto skip = [&]() {
+      while (p < end && (isspace(static_cast<unsigned char>(*p)) || *p == ','
+            || *p == '#')) {
+        if (*p == '#')
+          while (p < end && *p != '\n')
+            p++;
+        else
+          p++;
+      }
+    };
+    auto parse = [&](Coord &value) {
+      auto [next, error] = from_chars(p, end, value);
+      if (error != errc())
+        throw runtime_error("Malformed point at byte "
+            + to_string(p - text) + " of the point file");
+      p = next;
+    };
+    while (true) {
+      skip();
+      if (p == end)
+        break;
+      PointT point;
+      parse(point.x);
+      skip();
+      parse(point.y);
+      points.push_back(point);
+    }
+  }
+
+  template <typename PointT>
+  PointFile<PointT>::PointFile(const string &path) {
+    const PointFormat format = pointFormat(path);
+    const bool binary = format != PointFormat::Text;
+    if ((format == PointFormat::Int32 && !is_same_v<PointT, cv::Point>)
+        || (format == PointFormat::Float64 && !is_same_v<PointT, cv::Point2d>))
+      throw runtime_error(path + " does not hold this point type");
+    // Binary pairs are used as they lie, so only a little-endian host can
+    if (binary && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+      throw runtime_error(path + " is little-endian, this host is not");
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw runtime_error("Cannot open " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      throw runtime_error("Cannot stat " + path);
+    }
+    mappedBytes = info.st_size;
+    if (binary && mappedBytes % sizeof(PointT) != 0) {
+      close(fd);
+      throw runtime_error(path + " is not a whole number of x, y pairs");
+    }
+    if (mappedBytes > 0) {
+      mapped = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        mapped = nullptr;
+        close(fd);
+        throw runtime_error("Cannot map " + path);
+      }
+      // Read front to back exactly once
+      madvise(mapped, mappedBytes, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (binary) {
+      points = static_cast<const PointT*>(mapped);
+      nPoints = mappedBytes / sizeof(PointT);
+      return;
+    }
+    // Text is parsed once, then the mapping is no longer needed
+    try {
+      parsePoints(static_cast<const char*>(mapped), mappedBytes, parsed);
+    } catch (...) {
+      if (mapped)
+        munmap(mapped, mappedBytes);
+      throw;
+    }
+    if (mapped)
+      munmap(mapped, mappedBytes);
+    mapped = nullptr;
+    points = parsed.data();
+    nPoints = parsed.size();
+  }
+
+  template <typename PointT>
+  PointFile<PointT>::~PointFile() {
+    if (mapped)
+      munmap(mapped, mappedBytes);
+  }
+
+  template <typename PointT>
+  void writeMesh(const string &path, const Mesh<PointT> &mesh) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+      throw runtime_error("Cannot write " + path);
+    bool ok;
+    if (hasExtension(path, ".off")) {
+      ok = fprintf(file, "OFF\n%zu %zu 0\n",
+          mesh.vertices.size(), mesh.size()) > 0;
+      for (const PointT &v : mesh.vertices)
+        ok = ok && fprintf(file, "%.17g %.17g 0\n",
+            static_cast<double>(v.x), static_cast<double>(v.y)) > 0;
+      for (size_t i = 0; i < mesh.indices.size(); i += 3)
+        ok = ok && fprintf(file, "3 %" PRIu32 " %" PRIu32 " %" PRIu32 "\n",
+            mesh.indices[i], mesh.indices[i+1], mesh.indices[i+2]) > 0;
+    } else {
+      const uint64_t counts[2] = { mesh.vertices.size(), mesh.size() };
+      ok = fwrite(counts, sizeof(counts), 1, file) == 1
+        && fwrite(mesh.vertices.data(), sizeof(PointT),
+            mesh.vertices.size(), file) == mesh.vertices.size()
+        && fwrite(mesh.indices.data(), sizeof(uint32_t),
+            mesh.indices.size(), file) == mesh.indices.size();
+    }
+    if (fclose(file) != 0 || !ok)
+      throw runtime_error("Failed writing " + path);
+  }
+
+#define INSTANTIATE_POINT_IO(PointT) \
+  template class PointFile<PointT>; \
+  template void writeMesh(const string&, const Mesh<PointT>&);
+
+  INSTANTIATE_POINT_IO(cv::Point)
+  INSTANTIATE_POINT_IO(cv::Point2d)
+
+#undef INSTANTIATE_POINT_IO
+
+}
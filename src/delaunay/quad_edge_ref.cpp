@@ -1,66 +1,38 @@
 #include "delaunay/quad_edge_ref.h"
+#include "counters.h"
 #include <cassert>
-#include <optional>
+#include <cstdio>
 #include <stdexcept>
 #include <unordered_set>
 
 namespace quadedge {
 
-  void printEndpoints(QuadEdgeRef *edge, const char *label) {
-    assert(edge->origCoords.has_value());
-    assert(edge->termCoords().has_value());
-    printf("%s: tailCoords (%d, %d), headCoords (%d, %d)\n",
+  template <typename PointT>
+  void printEndpoints(QuadEdgeRef<PointT> *edge, const char *label) {
+    assert(edge->isPrimal());
+    printf("%s: tailCoords (%g, %g), headCoords (%g, %g)\n",
         label,
-        edge->origCoords->x,
-        edge->origCoords->y,
-        edge->termCoords()->x,
-        edge->termCoords()->y);
-  }
-
-  QuadEdgeRef* &QuadEdgeRef::sym() {
-    assert(rot != nullptr);
-    assert(rot->rot != nullptr);
-    return rot->rot;
-  }
-
-  QuadEdgeRef* &QuadEdgeRef::oprev() {
-    assert(rot != nullptr);
-    assert(rot->onext != nullptr);
-    assert(rot->onext->rot != nullptr);
-    return rot->onext->rot;
-  }
-
-  QuadEdgeRef* &QuadEdgeRef::lnext() {
-    QuadEdgeRef *dc = rot->sym();
-    assert(dc->onext != nullptr);
-    assert(dc->onext->rot != nullptr);
-    return dc->onext->rot;
-  }
-
-  QuadEdgeRef* &QuadEdgeRef::rprev() {
-    return sym()->onext;
-  }
-
-  std::optional<cv::Point> &QuadEdgeRef::termCoords() {
-    return sym()->origCoords;
-  }
-
-  std::pair<cv::Point, cv::Point> QuadEdgeRef::points() {
-    assert(origCoords.has_value());
-    assert(termCoords().has_value());
-    return { origCoords.value(), termCoords().value() };
-  }
-
-  QuadEdgeRef* makeQuadEdge(cv::Point tail, cv::Point head) {
-    // Create four refs
-    QuadEdgeRef *self = new QuadEdgeRef();
-    QuadEdgeRef *selfRot = new QuadEdgeRef();
-    QuadEdgeRef *selfRot2 = new QuadEdgeRef();
-    QuadEdgeRef *selfRot3 = new QuadEdgeRef();
+        static_cast<double>(edge->origCoords().x),
+        static_cast<double>(edge->origCoords().y),
+        static_cast<double>(edge->termCoords().x),
+        static_cast<double>(edge->termCoords().y));
+  }
+
+  template <typename PointT>
+  QuadEdgeRef<PointT>* makeQuadEdge(PointT tail, PointT head) {
+    // Create all four refs in one allocation
+    QuadEdge<PointT> *quad = new QuadEdge<PointT>;
+    QuadEdgeRef<PointT> *self = &quad->refs[0];
+    QuadEdgeRef<PointT> *selfRot = &quad->refs[1];
+    QuadEdgeRef<PointT> *selfRot2 = &quad->refs[2];
+    QuadEdgeRef<PointT> *selfRot3 = &quad->refs[3];
+    for (uint8_t i = 0; i < 4; i++)
+      quad->refs[i].index = i;
+    DELAUNAY_LIVE_EDGES(1);
 
     // Save the payload coordinate data
-    self->origCoords = tail;
-    selfRot2->origCoords = head;
+    self->origCoords() = tail;
+    selfRot2->origCoords() = head;
 
     // Arrange the four edges into a cycle
     self->rot = selfRot;
@@ -79,35 +51,30 @@ namespace quadedge {
     return self;
   }
 
-  void swapONexts(QuadEdgeRef* &a, QuadEdgeRef* &b) {
+  template <typename PointT>
+  void splice(QuadEdgeRef<PointT> *a, QuadEdgeRef<PointT> *b) {
+    assert(a->isPrimal() == b->isPrimal());
+    std::swap(a->onext->rot->onext, b->onext->rot->onext);
     std::swap(a->onext, b->onext);
   }
-  void splice(QuadEdgeRef *a, QuadEdgeRef *b) {
-    assert(
-      (a->origCoords.has_value() && a->termCoords().has_value() &&
-       b->origCoords.has_value() && b->termCoords().has_value()) ||
-      (!a->origCoords.has_value() && !a->termCoords().has_value() &&
-       !b->origCoords.has_value() && !b->termCoords().has_value())
-    );
-    swapONexts(a->onext->rot, b->onext->rot);
-    swapONexts(a, b);
-  }
 
-  QuadEdgeRef *makeTriangle(cv::Point a, cv::Point b, cv::Point c) {
-    QuadEdgeRef *ab = makeQuadEdge(a, b);
-    QuadEdgeRef *bc = makeQuadEdge(b, c);
-    QuadEdgeRef *ca = makeQuadEdge(c, a);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *makeTriangle(PointT a, PointT b, PointT c) {
+    QuadEdgeRef<PointT> *ab = makeQuadEdge(a, b);
+    QuadEdgeRef<PointT> *bc = makeQuadEdge(b, c);
+    QuadEdgeRef<PointT> *ca = makeQuadEdge(c, a);
     splice(ab->sym(), bc);
     splice(bc->sym(), ca);
     splice(ca->sym(), ab);
     return ab;
   }
 
-  QuadEdgeRef *makePolygon(std::vector<cv::Point> points) {
+  template <typename PointT>
+  QuadEdgeRef<PointT> *makePolygon(std::vector<PointT> points) {
     if (points.size() < 3)
       throw std::logic_error("Polygons must have at least three vertices.");
-    QuadEdgeRef *firstEdge = makeQuadEdge(points[0], points[1]);
-    QuadEdgeRef *edge = firstEdge, *lastEdge = nullptr;
+    QuadEdgeRef<PointT> *firstEdge = makeQuadEdge(points[0], points[1]);
+    QuadEdgeRef<PointT> *edge = firstEdge, *lastEdge = nullptr;
     for (uint i = 2; i < points.size(); i++) {
       lastEdge = makeQuadEdge(points[i-1], points[i]);
       splice(edge->sym(), lastEdge);
@@ -119,64 +86,89 @@ namespace quadedge {
     return firstEdge;
   }
 
-  QuadEdgeRef *connect(QuadEdgeRef *a, QuadEdgeRef *b) {
-    assert(a->origCoords.has_value());
-    assert(b->termCoords().has_value());
-    assert(b->origCoords.has_value());
-    assert(b->termCoords().has_value());
-    QuadEdgeRef *newEdge
-      = makeQuadEdge(a->termCoords().value(), b->origCoords.value());
+  template <typename PointT>
+  QuadEdgeRef<PointT> *connect(QuadEdgeRef<PointT> *a, QuadEdgeRef<PointT> *b) {
+    assert(a->isPrimal());
+    assert(b->isPrimal());
+    DELAUNAY_COUNT(edgesConnected);
+    QuadEdgeRef<PointT> *newEdge
+      = makeQuadEdge(a->termCoords(), b->origCoords());
     splice(newEdge, a->lnext());
     splice(newEdge->sym(), b);
     return newEdge;
   }
 
-  void sever(QuadEdgeRef *edge) {
+  template <typename PointT>
+  void sever(QuadEdgeRef<PointT> *edge) {
     splice(edge, edge->oprev());
     splice(edge->sym(), edge->sym()->oprev());
-    delete edge;
+    delete edge->quad();
+    DELAUNAY_COUNT(edgesSevered);
+    DELAUNAY_LIVE_EDGES(-1);
   }
 
-  QuadEdgeRef *insertPoint(QuadEdgeRef *polygonEdge, cv::Point point) {
-    assert(polygonEdge->origCoords.has_value());
-    QuadEdgeRef *firstSpoke
-      = makeQuadEdge(polygonEdge->origCoords.value(), point);
+  template <typename PointT>
+  QuadEdgeRef<PointT> *insertPoint(
+      QuadEdgeRef<PointT> *polygonEdge, PointT point) {
+    assert(polygonEdge->isPrimal());
+    QuadEdgeRef<PointT> *firstSpoke
+      = makeQuadEdge(polygonEdge->origCoords(), point);
     splice(firstSpoke, polygonEdge);
-    QuadEdgeRef *spoke = firstSpoke;
+    QuadEdgeRef<PointT> *spoke = firstSpoke;
     do {
       spoke = connect(polygonEdge, spoke->sym());
-      spoke->rot->origCoords.reset();
-      spoke->rot->sym()->origCoords.reset();
       polygonEdge = spoke->oprev();
-    } while (polygonEdge->onext != firstSpoke);
+    } while (polygonEdge->lnext() != firstSpoke);
     return firstSpoke;
   }
 
-  void flip(QuadEdgeRef *edge) {
-    QuadEdgeRef *prev = edge->oprev();
-    QuadEdgeRef *symPrev = edge->sym()->oprev();
+  template <typename PointT>
+  void flip(QuadEdgeRef<PointT> *edge) {
+    QuadEdgeRef<PointT> *prev = edge->oprev();
+    QuadEdgeRef<PointT> *symPrev = edge->sym()->oprev();
     splice(edge, prev);
     splice(edge->sym(), symPrev);
     splice(edge, prev->lnext());
     splice(edge->sym(), symPrev->lnext());
-    edge->origCoords = prev->termCoords();
+    edge->origCoords() = prev->termCoords();
     edge->termCoords() = symPrev->termCoords();
   }
 
-  void freeGraph_recurse(QuadEdgeRef *edge,
-      std::unordered_set<QuadEdgeRef*> &marked) {
-    if (marked.find(edge) != marked.end())
-      return;
-    marked.insert(edge);
-    freeGraph_recurse(edge->rot, marked);
-    freeGraph_recurse(edge->onext, marked);
-    delete edge;
-  }
-
-  void freeGraph(QuadEdgeRef *edge) {
-    std::unordered_set<QuadEdgeRef*> marked;
-    freeGraph_recurse(edge, marked);
-  }
+  template <typename PointT>
+  void freeGraph(QuadEdgeRef<PointT> *edge) {
+    // Walk every ref reachable through rot/onext, then free each block once
+    std::unordered_set<QuadEdge<PointT>*> quads;
+    std::vector<QuadEdgeRef<PointT>*> stack = { edge };
+    while (!stack.empty()) {
+      QuadEdgeRef<PointT> *ref = stack.back();
+      stack.pop_back();
+      if (!quads.insert(ref->quad()).second)
+        continue;
+      for (QuadEdgeRef<PointT> &r : ref->quad()->refs)
+        stack.push_back(r.onext);
+    }
+    for (QuadEdge<PointT> *quad : quads)
+      delete quad;
+    DELAUNAY_LIVE_EDGES(-static_cast<int64_t>(quads.size()));
+  }
+
+#define INSTANTIATE_QUADEDGE(PointT) \
+  template void printEndpoints(QuadEdgeRef<PointT>*, const char*); \
+  template QuadEdgeRef<PointT> *makeQuadEdge(PointT, PointT); \
+  template void splice(QuadEdgeRef<PointT>*, QuadEdgeRef<PointT>*); \
+  template QuadEdgeRef<PointT> *makeTriangle(PointT, PointT, PointT); \
+  template QuadEdgeRef<PointT> *makePolygon(std::vector<PointT>); \
+  template QuadEdgeRef<PointT> *connect( \
+      QuadEdgeRef<PointT>*, QuadEdgeRef<PointT>*); \
+  template void sever(QuadEdgeRef<PointT>*); \
+  template QuadEdgeRef<PointT> *insertPoint(QuadEdgeRef<PointT>*, PointT); \
+  template void flip(QuadEdgeRef<PointT>*); \
+  template void freeGraph(QuadEdgeRef<PointT>*);
+
+  INSTANTIATE_QUADEDGE(cv::Point)
+  INSTANTIATE_QUADEDGE(cv::Point2f)
+  INSTANTIATE_QUADEDGE(cv::Point2d)
+
+#undef INSTANTIATE_QUADEDGE
 
 }
-
@@ -0,0 +1,51 @@
+#include "delaunay/stats.h"
+#include "counters.h"
+
+namespace delaunay {
+
+#ifdef DELAUNAY_STATS
+
+  counters::Counters counters::global;
+
+  Stats stats() {
+    const auto &g = counters::global;
+    const auto load = [](const auto &counter) {
+      return static_cast<uint64_t>(counter.load(std::memory_order_relaxed));
+    };
+    Stats s;
+    s.enabled = true;
+    s.inCircleCalls = load(g.inCircleCalls);
+    s.isCCWCalls = load(g.isCCWCalls);
+    s.edgesConnected = load(g.edgesConnected);
+    s.edgesSevered = load(g.edgesSevered);
+    s.peakLiveEdges = load(g.peakLiveEdges);
+    s.colinearBaseCases = load(g.colinearBaseCases);
+    s.longestSeverWalk = load(g.longestSeverWalk);
+    s.maxDepth = load(g.maxDepth);
+    for (int i = 0; i <= static_cast<int>(s.maxDepth) && i < Stats::MAX_LEVELS;
+        i++)
+      s.mergeIterations.push_back(load(g.mergeIterations[i]));
+    return s;
+  }
+
+  void resetStats() {
+    auto &g = counters::global;
+    for (auto *counter : { &g.inCircleCalls, &g.isCCWCalls, &g.edgesConnected,
+        &g.edgesSevered, &g.colinearBaseCases, &g.longestSeverWalk,
+        &g.maxDepth })
+      counter->store(0, std::memory_order_relaxed);
+    for (auto &counter : g.mergeIterations)
+      counter.store(0, std::memory_order_relaxed);
+    // Edges still alive carry over, so the peak restarts from them
+    g.peakLiveEdges.store(
+        g.liveEdges.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+#else
+
+  Stats stats() { return Stats(); }
+  void resetStats() {}
+
+#endif // DELAUNAY_STATS
+
+}
@@ -0,0 +1,247 @@
+#include "delaunay/thread_pool.h"
+#include "delaunay/trace.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace threadpool {
+
+  namespace {
+
+    // Chunks spawned by one parallelFor/invoke call
+    struct Group {
+      std::atomic<size_t> pending{0};
+      std::mutex errorMutex;
+      std::exception_ptr error;
+    };
+
+    struct Task {
+      const std::function<void(size_t, size_t)> *body;
+      size_t begin, end;
+      Group *group;
+    };
+
+    // The owner pushes and pops at the back, thieves take from the front
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    struct Pool {
+      ~Pool() { stop(); }
+      void stop() {
+        {
+          std::lock_guard<std::mutex> lock(sleepMutex);
+          stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers)
+          worker.join();
+        workers.clear();
+        stopping = false;
+      }
+
+      std::vector<std::thread> workers;
+      // One queue per worker, plus one shared by threads outside the pool
+      std::vector<std::unique_ptr<Queue>> queues;
+      std::atomic<size_t> queued{0};
+      std::atomic<bool> stopping{false};
+      std::mutex sleepMutex;
+      std::condition_variable wake;
+      std::mutex configMutex;
+      bool configured = false;
+    };
+
+    Pool pool;
+    thread_local int workerIndex = -1;
+
+    size_t homeQueue() {
+      return workerIndex >= 0 ? workerIndex : pool.queues.size() - 1;
+    }
+
+    void pinToCore(unsigned core) {
+#ifdef __linux__
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(core % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+      (void)core;
+#endif
+    }
+
+    void run(const Task &task) {
+      try {
+        tracing::Span span("task", "pool", task.end - task.begin);
+        (*task.body)(task.begin, task.end);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(task.group->errorMutex);
+        if (!task.group->error)
+          task.group->error = std::current_exception();
+      }
+      // The group may be gone as soon as pending reaches zero
+      if (task.group->pending.fetch_sub(1) == 1) {
+        { std::lock_guard<std::mutex> lock(pool.sleepMutex); }
+        pool.wake.notify_all();
+      }
+    }
+
+    // Pop from our own queue, otherwise steal the oldest task of another
+    bool tryRun(size_t home) {
+      const size_t nQueues = pool.queues.size();
+      for (size_t i = 0; i < nQueues; i++) {
+        Queue &queue = *pool.queues[(home + i) % nQueues];
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+          continue;
+        Task task;
+        if (i == 0) {
+          task = queue.tasks.back();
+          queue.tasks.pop_back();
+        } else {
+          task = queue.tasks.front();
+          queue.tasks.pop_front();
+        }
+        lock.unlock();
+        pool.queued--;
+        run(task);
+        return true;
+      }
+      return false;
+    }
+
+    void submit(const std::vector<Task> &tasks) {
+      Queue &queue = *pool.queues[homeQueue()];
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.insert(queue.tasks.end(), tasks.begin(), tasks.end());
+      }
+      pool.queued += tasks.size();
+      { std::lock_guard<std::mutex> lock(pool.sleepMutex); }
+      pool.wake.notify_all();
+    }
+
+    // Run queued tasks (anyone's) until the group is done
+    void help(Group &group) {
+      const size_t home = homeQueue();
+      while (group.pending > 0) {
+        if (tryRun(home))
+          continue;
+        // Blocked on chunks that other threads are still running
+        tracing::Span span("wait", "pool");
+        std::unique_lock<std::mutex> lock(pool.sleepMutex);
+        pool.wake.wait(lock, [&] {
+          return group.pending == 0 || pool.queued > 0;
+        });
+      }
+      if (group.error)
+        std::rethrow_exception(group.error);
+    }
+
+    void workerLoop(int index, bool pinThreads) {
+      workerIndex = index;
+      tracing::nameThread("worker " + std::to_string(index + 1));
+      if (pinThreads)
+        pinToCore(index + 1);
+      while (true) {
+        if (tryRun(index))
+          continue;
+        std::unique_lock<std::mutex> lock(pool.sleepMutex);
+        pool.wake.wait(lock, [] { return pool.stopping || pool.queued > 0; });
+        if (pool.stopping && pool.queued == 0)
+          return;
+      }
+    }
+
+    void start(unsigned nThreads, bool pinThreads) {
+      pool.stop();
+      if (nThreads == 0)
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+      pool.queues.clear();
+      for (unsigned i = 0; i < nThreads; i++)
+        pool.queues.emplace_back(new Queue);
+      // The calling thread makes up the last of nThreads. It is never pinned:
+      // threads it starts later (encoders, previews, OpenCV's) would inherit
+      // the mask, so core 0 is simply left to it
+      for (unsigned i = 0; i + 1 < nThreads; i++)
+        pool.workers.emplace_back(workerLoop, i, pinThreads);
+      pool.configured = true;
+    }
+
+    void ensureStarted() {
+      std::lock_guard<std::mutex> lock(pool.configMutex);
+      if (!pool.configured)
+        start(0, false);
+    }
+
+  }
+
+  void configure(unsigned nThreads, bool pinThreads) {
+    std::lock_guard<std::mutex> lock(pool.configMutex);
+    start(nThreads, pinThreads);
+  }
+
+  unsigned size() {
+    ensureStarted();
+    return pool.queues.size();
+  }
+
+  void parallelFor(
+      size_t first,
+      size_t last,
+      size_t grain,
+      const std::function<void(size_t, size_t)> &body) {
+    if (last <= first)
+      return;
+    grain = std::max<size_t>(grain, 1);
+    ensureStarted();
+    if (pool.workers.empty() || last - first <= grain) {
+      for (size_t begin = first; begin < last; begin += grain)
+        body(begin, std::min(last, begin + grain));
+      return;
+    }
+    Group group;
+    std::vector<Task> tasks;
+    for (size_t begin = first; begin < last; begin += grain)
+      tasks.push_back({ &body, begin, std::min(last, begin + grain), &group });
+    group.pending = tasks.size();
+    submit(tasks);
+    help(group);
+  }
+
+  void invoke(const std::function<void()> &a, const std::function<void()> &b) {
+    ensureStarted();
+    if (pool.workers.empty()) {
+      a();
+      b();
+      return;
+    }
+    Group group;
+    group.pending = 1;
+    const std::function<void(size_t, size_t)> runB
+      = [&b](size_t, size_t) { b(); };
+    submit({ { &runB, 0, 0, &group } });
+    // b must finish before returning either way, it refers to this frame
+    std::exception_ptr error;
+    try {
+      a();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    help(group);
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+}
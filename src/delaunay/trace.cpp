@@ -0,0 +1,138 @@
+#include "delaunay/trace.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+
+namespace tracing {
+
+  std::atomic<bool> active{false};
+
+  namespace {
+
+    struct Event {
+      const char *name, *category;
+      int64_t begin, end, arg;
+    };
+
+    // Only its own thread appends; write() reads it after that thread's
+    // traced work has been joined
+    struct Buffer {
+      int id;
+      std::string name;
+      std::vector<Event> events;
+    };
+
+    std::mutex registryMutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::unordered_set<std::string> interned;
+    std::atomic<int64_t> epoch{0};
+    thread_local Buffer *local = nullptr;
+
+    int64_t clockNs() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Registering is the only locked step, once per thread
+    Buffer &localBuffer() {
+      if (!local) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        buffers.emplace_back(new Buffer);
+        local = buffers.back().get();
+        local->id = buffers.size();
+      }
+      return *local;
+    }
+
+    void writeString(FILE *file, const char *text) {
+      fputc('"', file);
+      for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\')
+          fprintf(file, "\\%c", *c);
+        else if (static_cast<unsigned char>(*c) < 0x20)
+          fprintf(file, "\\u%04x", *c);
+        else
+          fputc(*c, file);
+      }
+      fputc('"', file);
+    }
+
+  }
+
+  void start() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (auto &buffer : buffers)
+      buffer->events.clear();
+    epoch = clockNs();
+    active = true;
+  }
+
+  void write(const std::string &path) {
+    active = false;
+    std::lock_guard<std::mutex> lock(registryMutex);
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+      throw std::runtime_error("Cannot write " + path);
+    bool first = true;
+    auto separate = [&]() {
+      fputs(first ? "\n" : ",\n", file);
+      first = false;
+    };
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    for (const auto &buffer : buffers) {
+      if (buffer->events.empty())
+        continue;
+      const std::string name = buffer->name.empty()
+        ? "thread " + std::to_string(buffer->id) : buffer->name;
+      separate();
+      fprintf(file, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"name\":\"thread_name\",\"args\":{\"name\":", buffer->id);
+      writeString(file, name.c_str());
+      fputs("}}", file);
+      for (const Event &event : buffer->events) {
+        separate();
+        fprintf(file, "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+            "\"dur\":%.3f,\"cat\":", buffer->id, event.begin / 1e3,
+            (event.end - event.begin) / 1e3);
+        writeString(file, event.category);
+        fputs(",\"name\":", file);
+        writeString(file, event.name);
+        if (event.arg >= 0)
+          fprintf(file, ",\"args\":{\"n\":%lld}",
+              static_cast<long long>(event.arg));
+        fputc('}', file);
+      }
+    }
+    fputs("\n]}\n", file);
+    const bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok)
+      throw std::runtime_error("Failed writing " + path);
+  }
+
+  void nameThread(const std::string &name) {
+    localBuffer().name = name;
+  }
+
+  const char *intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    return interned.insert(name).first->c_str();
+  }
+
+  int64_t now() {
+    return clockNs() - epoch.load(std::memory_order_relaxed);
+  }
+
+  void record(
+      const char *name,
+      const char *category,
+      int64_t begin,
+      int64_t end,
+      int64_t arg) {
+    localBuffer().events.push_back({ name, category, begin, end, arg });
+  }
+
+}
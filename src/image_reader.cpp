@@ -0,0 +1,230 @@
+#include "image_reader.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <opencv2/imgcodecs.hpp>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+using namespace std;
+
+optional<JpegInfo> readJpegInfo(const string &path) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return nullopt;
+  auto byte = [file]() { return fgetc(file); };
+  auto word = [&]() {
+    const int high = byte();
+    const int low = byte();
+    return high < 0 || low < 0 ? -1 : (high << 8) | low;
+  };
+  optional<JpegInfo> info;
+  if (byte() == 0xFF && byte() == 0xD8) {
+    // Walk the marker segments up to the first frame header
+    while (true) {
+      int marker = byte();
+      if (marker != 0xFF)
+        break;
+      while (marker == 0xFF) // fill bytes
+        marker = byte();
+      if (marker < 0 || marker == 0xD9 || marker == 0xDA)
+        break;
+      if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        continue; // no payload
+      const int length = word();
+      if (length < 2)
+        break;
+      // SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+      if (marker >= 0xC0 && marker <= 0xCF
+          && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+        byte(); // sample precision
+        const int height = word(), width = word(), channels = byte();
+        // A zero height is only given later (DNL), so give up on those
+        if (height > 0 && width > 0 && channels > 0)
+          info = JpegInfo{ cv::Size(width, height), channels };
+        break;
+      }
+      if (fseek(file, length - 2, SEEK_CUR) != 0)
+        break;
+    }
+  }
+  fclose(file);
+  return info;
+}
+
+cv::Mat readReducedJpeg(
+    const string &path,
+    const JpegInfo &info,
+    int reduction) {
+  const bool gray = info.channels == 1;
+  int flags;
+  switch (reduction) {
+    case 2:
+      flags = gray
+        ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+      break;
+    case 4:
+      flags = gray
+        ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+      break;
+    case 8:
+      flags = gray
+        ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+      break;
+    default:
+      throw invalid_argument("JPEGs decode reduced by 2, 4 or 8 only");
+  }
+  return cv::imread(path, flags);
+}
+
+bool isMappableImage(const string &path) {
+  if (path == "-")
+    return true;
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  char magic[2] = {};
+  const bool read = fread(magic, 1, 2, file) == 2;
+  fclose(file);
+  return read && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6');
+}
+
+// Parses a binary PGM/PPM header, returning the offset of the samples
+static size_t parsePnmHeader(
+    const uchar *data,
+    size_t length,
+    int &channels,
+    int &width,
+    int &height,
+    int &maxValue) {
+  if (length < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+    throw runtime_error("Input is not a binary PGM/PPM");
+  channels = data[1] == '5' ? 1 : 3;
+  size_t p = 2;
+  int *fields[3] = { &width, &height, &maxValue };
+  for (int *field : fields) {
+    // Whitespace and comment lines separate the fields
+    while (p < length && (isspace(data[p]) || data[p] == '#')) {
+      if (data[p] == '#')
+        while (p < length && data[p] != '\n')
+          p++;
+      else
+        p++;
+    }
+    if (p == length || !isdigit(data[p]))
+      throw runtime_error("Malformed PGM/PPM header");
+    long value = 0;
+    while (p < length && isdigit(data[p]) && value <= 1 << 20)
+      value = value * 10 + (data[p++] - '0');
+    if (value < 1 || value > 1 << 20)
+      throw runtime_error("Unsupported PGM/PPM dimensions or depth");
+    *field = value;
+  }
+  // Exactly one whitespace byte before the samples
+  if (p == length || !isspace(data[p]) || maxValue > 65535)
+    throw runtime_error("Malformed PGM/PPM header");
+  return p + 1;
+}
+
+// Wraps raw BGR or PGM/PPM samples where they lie, converting them in place
+static cv::Mat wrapPixels(
+    uchar *data,
+    size_t length,
+    const cv::Size &rawSize,
+    const string &path) {
+  if (!rawSize.empty()) {
+    if (length != 3 * size_t(rawSize.area()))
+      throw runtime_error("Raw input holds " + to_string(length)
+          + " bytes, not " + to_string(rawSize.width) + "x"
+          + to_string(rawSize.height) + " BGR pixels");
+    return cv::Mat(rawSize, CV_8UC3, data);
+  }
+  int channels, width, height, maxValue;
+  const size_t offset
+    = parsePnmHeader(data, length, channels, width, height, maxValue);
+  const int depth = maxValue > 255 ? CV_16U : CV_8U;
+  const size_t sampleBytes = depth == CV_16U ? 2 : 1;
+  if (length - offset < sampleBytes * channels * width * height)
+    throw runtime_error(path + " ends before its last pixel");
+  cv::Mat image(height, width, CV_MAKETYPE(depth, channels), data + offset);
+  // Samples are big-endian and RGB, the pipeline wants native BGR. Both are
+  // swapped by hand, since cvtColor in place works through a temporary copy.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (depth == CV_16U) {
+    uchar *sample = image.data;
+    for (size_t i = 0; i < image.total() * channels; i++, sample += 2)
+      std::swap(sample[0], sample[1]);
+  }
+#endif
+  if (channels == 3) {
+    uchar *pixel = image.data;
+    for (size_t i = 0; i < image.total(); i++, pixel += 3 * sampleBytes)
+      std::swap_ranges(pixel, pixel + sampleBytes, pixel + 2 * sampleBytes);
+  }
+  // Samples run up to maxval (e.g. 1023 for 10-bit), while the pipeline's
+  // thresholds assume the depth's full range
+  const double fullScale = depth == CV_16U ? 65535.0 : 255.0;
+  if (maxValue != fullScale)
+    image.convertTo(image, image.type(), fullScale / maxValue);
+  return image;
+}
+
+MappedImage::MappedImage(const string &path, const cv::Size &rawSize) {
+  const bool stdIn = path == "-";
+  int fd = stdIn ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("Cannot open " + path);
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    if (!stdIn)
+      close(fd);
+    throw runtime_error("Cannot stat " + path);
+  }
+  uchar *data;
+  size_t length;
+  if (S_ISREG(info.st_mode) && info.st_size > 0) {
+    // Private and writable so samples can be reordered in place; pages that
+    // are never written stay shared with the page cache
+    mappedBytes = info.st_size;
+    mapped = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fd, 0);
+    if (!stdIn)
+      close(fd);
+    if (mapped == MAP_FAILED) {
+      mapped = nullptr;
+      throw runtime_error("Cannot map " + path);
+    }
+    data = static_cast<uchar*>(mapped);
+    length = mappedBytes;
+  } else {
+    // Pipes can't be mapped, so they are read once
+    uchar chunk[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+      buffer.insert(buffer.end(), chunk, chunk + n);
+    if (!stdIn)
+      close(fd);
+    if (n < 0)
+      throw runtime_error("Failed reading " + path);
+    data = buffer.data();
+    length = buffer.size();
+  }
+
+  try {
+    image = wrapPixels(data, length, rawSize, path);
+  } catch (...) {
+    if (mapped)
+      munmap(mapped, mappedBytes);
+    throw;
+  }
+}
+
+MappedImage::~MappedImage() {
+  if (mapped)
+    munmap(mapped, mappedBytes);
+}
@@ -0,0 +1,56 @@
+#ifndef IMAGE_READER_H
+#define IMAGE_READER_H
+
+#include <opencv2/core/mat.hpp>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Size and channel count of a JPEG, read from its frame header without
+// decoding any pixels (nullopt for other formats or a malformed header)
+struct JpegInfo {
+  cv::Size size;
+  int channels;
+};
+std::optional<JpegInfo> readJpegInfo(const std::string &path);
+
+// Decodes a JPEG at 1/2, 1/4 or 1/8 of its size (reduction) by scaling its
+// DCT blocks, much faster than a full decode followed by a resize. The result
+// is 8-bit gray for single-channel files, 8-bit BGR otherwise.
+cv::Mat readReducedJpeg(
+    const std::string &path,
+    const JpegInfo &info,
+    int reduction);
+
+// Whether path is "-" (standard input) or starts like a binary PGM/PPM, the
+// inputs MappedImage reads
+bool isMappableImage(const std::string &path);
+
+// The pixels of raw 8-bit BGR (rawSize given) or binary PGM (P5) / PPM (P6)
+// input, wrapped in a cv::Mat where they lie. Files, and standard input
+// redirected from one, are memory-mapped; a pipe on standard input ("-") is
+// read into memory once. Raw BGR and 8-bit PGM with a maxval of 255 are used
+// without a copy. Anything converted in place (PPM's RGB order, 16-bit
+// big-endian samples, a maxval below the full depth range) writes every page
+// of the private mapping, so costs one copy of the pixels, still without a
+// decode buffer. Throws std::runtime_error if
+// the input can't be read or is malformed.
+class MappedImage {
+public:
+  explicit MappedImage(
+      const std::string &path,
+      const cv::Size &rawSize = cv::Size());
+  ~MappedImage();
+  MappedImage(const MappedImage&) = delete;
+  MappedImage &operator=(const MappedImage&) = delete;
+  // Valid as long as this object is
+  const cv::Mat &mat() const { return image; }
+
+private:
+  void *mapped = nullptr;
+  size_t mappedBytes = 0;
+  std::vector<uchar> buffer;
+  cv::Mat image;
+};
+
+#endif // !IMAGE_READER_H
@@ -1,14 +1,30 @@
 #include "img_util.h"
+#include "delaunay/delaunay.h"
+#include "delaunay/thread_pool.h"
+#include "delaunay/trace.h"
+#include "isa.h"
+#include "row_writer.h"
 #include <opencv2/core.hpp>
 #include <opencv2/core/base.hpp>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/core/types.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <type_traits>
+#include <unordered_set>
 #include <vector>
 
 namespace imgutil {
 
+  uchar *ScratchBuffer::reserve(size_t bytes) {
+    if (data.size() < bytes)
+      data.resize(bytes);
+    return data.data();
+  }
+
   std::pair<double, double> getImageRange(int type) {
     switch (CV_MAT_DEPTH(type)) {
       case CV_8U:  return {0.0, 255.0};
@@ -22,32 +38,89 @@ namespace imgutil {
     }
   }
 
-  void sobelMagnitude(cv::InputArray src, cv::OutputArray dst) {
-    // Run a horizontal and vertical filter
-    cv::Mat dstX, dstY;
-    // Build the horizontal Sobel kernel
-    const uint KERNEL_SIZE = 3;
-    float kernelData[KERNEL_SIZE][KERNEL_SIZE] = {
+  // Sobel kernels scaled so full intensity steps give unit gradients
+  template <typename Pixel>
+  void sobelKernels(cv::Mat &sobX, cv::Mat &sobY) {
+    float kernelData[3][3] = {
       {-1, 0, 1},
       {-2, 0, 2},
       {-1, 0, 1},
     };
-    // Normalize based on image type
-    cv::Mat sobX(KERNEL_SIZE, KERNEL_SIZE, CV_32F, kernelData);
-    float max = getImageRange(src.type()).second;
-    sobX /= max;
+    cv::Mat(3, 3, CV_32F, kernelData)
+      .convertTo(sobX, CV_32F, 1.0 / PixelTraits<Pixel>::max);
     // Generate the vertical Sobel kernel by simply transposing the horizontal
-    cv::Mat sobY;
     cv::transpose(sobX, sobY);
+  }
+
+  // Flatten the channels of a gradient (weighted average), in place when
+  // there is only one
+  template <typename Pixel>
+  inline const cv::Mat &flatten(const cv::Mat &gradient, cv::Mat &gray) {
+    if constexpr (PixelTraits<Pixel>::channels == 1) {
+      return gradient;
+    } else {
+      cv::cvtColor(gradient, gray, cv::COLOR_BGR2GRAY);
+      return gray;
+    }
+  }
+
+  template <typename Pixel>
+  void sobelMagnitude(
+      cv::InputArray src,
+      cv::OutputArray dst,
+      const bool normalize) {
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
+    // Run a horizontal and vertical filter
+    cv::Mat dstX, dstY, grayX, grayY;
+    cv::Mat sobX, sobY;
+    sobelKernels<Pixel>(sobX, sobY);
     // Convolve the kernels with src
     cv::filter2D(src, dstX, CV_32F, sobX);
     cv::filter2D(src, dstY, CV_32F, sobY);
-    // Flatten the channels (weighted average)
-    cv::cvtColor(dstX, dstX, cv::COLOR_BGR2GRAY);
-    cv::cvtColor(dstY, dstY, cv::COLOR_BGR2GRAY);
     // Calculate Euclidean 2-Norm at each pixel
-    cv::magnitude(dstX, dstY, dst);
-    cv::normalize(dst, dst.getMatRef(), 0.0, 1.0, cv::NORM_MINMAX);
+    cv::magnitude(flatten<Pixel>(dstX, grayX), flatten<Pixel>(dstY, grayY),
+        dst);
+    if (normalize)
+      cv::normalize(dst, dst.getMatRef(), 0.0, 1.0, cv::NORM_MINMAX);
+  }
+
+  template <typename Pixel>
+  void sobelMagnitude(
+      cv::InputArray src,
+      cv::OutputArray dst,
+      ScratchBuffer &scratch,
+      const int stripRows) {
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
+    cv::Mat srcMat = src.getMat();
+    const int nRows = srcMat.rows, nCols = srcMat.cols;
+    dst.create(srcMat.size(), CV_32F);
+    cv::Mat dstMat = dst.getMatRef();
+    // Same kernels as above
+    cv::Mat sobX, sobY;
+    sobelKernels<Pixel>(sobX, sobY);
+    // Only one strip of gradients is alive at a time: both color gradients
+    // and both flattened ones share the scratch buffer
+    const int nChannels = PixelTraits<Pixel>::channels;
+    const size_t colorBytes = sizeof(float) * stripRows * nCols * nChannels;
+    const size_t grayBytes = sizeof(float) * stripRows * nCols;
+    uchar *buffer = scratch.reserve(2 * colorBytes + 2 * grayBytes);
+    const int colorType = CV_32FC(nChannels);
+    for (int r = 0; r < nRows; r += stripRows) {
+      const int n = std::min(stripRows, nRows - r);
+      cv::Mat dstX(n, nCols, colorType, buffer);
+      cv::Mat dstY(n, nCols, colorType, buffer + colorBytes);
+      cv::Mat grayX(n, nCols, CV_32F, buffer + 2 * colorBytes);
+      cv::Mat grayY(n, nCols, CV_32F, buffer + 2 * colorBytes + grayBytes);
+      // A row range is not isolated, so the filters still read the rows
+      // above and below it and the strips match the whole-image result
+      cv::Mat strip = srcMat.rowRange(r, r + n);
+      cv::filter2D(strip, dstX, CV_32F, sobX);
+      cv::filter2D(strip, dstY, CV_32F, sobY);
+      cv::Mat dstStrip = dstMat.rowRange(r, r + n);
+      cv::magnitude(flatten<Pixel>(dstX, grayX), flatten<Pixel>(dstY, grayY),
+          dstStrip);
+    }
+    cv::normalize(dstMat, dstMat, 0.0, 1.0, cv::NORM_MINMAX);
   }
 
   inline int linearMap(int toMap, int inMin, int inMax, int outMin, int outMax) {
@@ -55,54 +128,170 @@ namespace imgutil {
     return outMin + ((toMap - inMin) * (outMax - outMin)) / (inMax - inMin);
   }
 
+  // Rows per parallel aNMS chunk
+  const int ANMS_GRAIN_ROWS = 16;
+
+  // Number of values in [begin, end) above value (or not below it), counted
+  // without branches so each variant vectorizes the scan
+  template <typename Pixel>
+  ISA_INLINE int countAbove(
+      const Pixel *row,
+      int begin,
+      int end,
+      const Pixel value,
+      bool orEqual) {
+    int n = 0;
+    if (orEqual)
+      for (int i = begin; i < end; i++)
+        n += row[i] >= value;
+    else
+      for (int i = begin; i < end; i++)
+        n += row[i] > value;
+    return n;
+  }
+
+  // Whether (r, c) is above threshold and the max of the window of the given
+  // radius around it (ties go to the first pixel in row-major order)
+  template <typename Pixel>
+  ISA_INLINE bool isWindowMax(
+      const cv::Mat &srcMat,
+      int r,
+      int c,
+      int kRadius,
+      const float threshold) {
+    const Pixel value = srcMat.ptr<Pixel>(r)[c];
+    if (!(value > threshold))
+      return false;
+    const int rMin = std::max(0, r - kRadius);
+    const int rMax = std::min(srcMat.rows - 1, r + kRadius);
+    const int cMin = std::max(0, c - kRadius);
+    const int cEnd = std::min(srcMat.cols, c + kRadius + 1);
+    // Equal values before (r, c) beat it, equal values after it don't
+    for (int wr = rMin; wr <= rMax; wr++) {
+      const Pixel *row = srcMat.ptr<Pixel>(wr);
+      const int n = wr == r
+        ? countAbove(row, cMin, c, value, true)
+          + countAbove(row, c + 1, cEnd, value, false)
+        : countAbove(row, cMin, cEnd, value, wr < r);
+      if (n > 0)
+        return false;
+    }
+    return true;
+  }
+
+  // Whether (r, c) survives adaptive non-max suppression: the stronger the
+  // edge, the smaller the window it has to dominate
+  template <typename Pixel>
+  ISA_INLINE bool isAdaptiveMax(
+      const cv::Mat &srcMat,
+      int r,
+      int c,
+      const std::pair<int, int> &kernelRange,
+      const float threshold) {
+    const Pixel value = srcMat.ptr<Pixel>(r)[c];
+    const int strength = cvRound(value * (255.0 / PixelTraits<Pixel>::max));
+    const int kRadius = linearMap(
+        strength,
+        255, 0, // invert the input!
+        kernelRange.first , kernelRange.second);
+    return isWindowMax<Pixel>(srcMat, r, c, kRadius, threshold);
+  }
+
+  // Flags the adaptive maxima of row r (a fixed window when both radii are
+  // equal)
+  template <typename Pixel>
+  ISA_INLINE void windowMaxRowKernel(
+      const cv::Mat &srcMat,
+      int r,
+      const std::pair<int, int> &kernelRange,
+      const float threshold,
+      uchar *isMax) {
+    for (int c = 0; c < srcMat.cols; c++)
+      isMax[c] = isAdaptiveMax<Pixel>(srcMat, r, c, kernelRange, threshold);
+  }
+
+  ISA_DISPATCH(Pixel, windowMaxRow, windowMaxRowKernel,
+      (const cv::Mat &srcMat, int r, const std::pair<int, int> &kernelRange,
+       const float threshold, uchar *isMax),
+      (srcMat, r, kernelRange, threshold, isMax))
+
+  template <typename Pixel>
   void adaptiveNonMaxSuppress(
       cv::InputArray src,
       cv::OutputArray dst,
       const std::pair<int, int> &kernelRange,
       const double threshold) {
+    static_assert(PixelTraits<Pixel>::channels == 1);
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
 
     cv::Mat srcMat = src.getMat();
     dst.create(src.size(), src.type());
     cv::Mat dstMat = dst.getMatRef();
     // Make a temp output buffer
-    cv::Mat output = cv::Mat::zeros(src.size(), src.type());
+    cv::Mat output(src.size(), src.type());
 
-    const int nRows = src.rows(), nCols = src.cols();
-    const auto [min, max] = getImageRange(src.type());
+    const int nCols = src.cols();
+    const float thresh = threshold * PixelTraits<Pixel>::max;
+    const Pixel max = PixelTraits<Pixel>::max;
 
-    for (int r = 0; r < nRows; r++) {
-      for (int c = 0; c < nCols; c++) {
-        int kRadius = linearMap(
-            srcMat.at<uchar>(r, c),
-            255, 0, // invert the input!
-            kernelRange.first , kernelRange.second);
-        int rMin = std::max(0, r - kRadius);
-        int rMax = std::min(nRows - 1, r + kRadius);
-        int cMin = std::max(0, c - kRadius);
-        int cMax = std::min(nCols - 1, c + kRadius);
-        // Look at the submatrix around the current pixel
-        cv::Mat view = srcMat(cv::Range(rMin, rMax), cv::Range(cMin, cMax));
-        // Find the max and its location
-        double maxValue;
-        cv::Point maxLoc;
-        cv::minMaxLoc(view, nullptr, &maxValue, nullptr, &maxLoc);
-        // If the current pixel is the max -> set to 1.0, else -> set to 0.0
-        if (maxLoc.x == kRadius && maxLoc.y == kRadius && maxValue > threshold)
-          output.at<float>(r, c) = max;
-        else
-          output.at<float>(r, c) = min;
+    // Every pixel is decided independently, so rows split freely
+    threadpool::parallelFor(0, src.rows(), ANMS_GRAIN_ROWS,
+        [&](size_t rBegin, size_t rEnd) {
+      std::vector<uchar> isMax(nCols);
+      for (int r = rBegin; r < int(rEnd); r++) {
+        windowMaxRow<Pixel>(srcMat, r, kernelRange, thresh, isMax.data());
+        Pixel *row = output.ptr<Pixel>(r);
+        for (int c = 0; c < nCols; c++)
+          row[c] = isMax[c] ? max : Pixel(0);
       }
-    }
+    });
 
     // Copy temporary buffer to dst
     output.copyTo(dstMat);
   }
 
+  template <typename Pixel>
+  void adaptiveNonMaxSuppress(
+      cv::InputArray src,
+      std::vector<cv::Point> &dst,
+      const std::pair<int, int> &kernelRange,
+      const double threshold,
+      const std::atomic<bool> *cancel) {
+    static_assert(PixelTraits<Pixel>::channels == 1);
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
+    // Same selection as above, collected as points (no output image)
+    cv::Mat srcMat = src.getMat();
+    const float thresh = threshold * PixelTraits<Pixel>::max;
+    // Per-chunk lists joined in row order, the same for any thread count
+    const size_t nChunks
+      = (srcMat.rows + ANMS_GRAIN_ROWS - 1) / ANMS_GRAIN_ROWS;
+    std::vector<std::vector<cv::Point>> chunkPoints(nChunks);
+    threadpool::parallelFor(0, srcMat.rows, ANMS_GRAIN_ROWS,
+        [&](size_t rBegin, size_t rEnd) {
+      if (cancel && cancel->load(std::memory_order_relaxed))
+        return;
+      std::vector<cv::Point> &points = chunkPoints[rBegin / ANMS_GRAIN_ROWS];
+      std::vector<uchar> isMax(srcMat.cols);
+      for (int r = rBegin; r < int(rEnd); r++) {
+        windowMaxRow<Pixel>(srcMat, r, kernelRange, thresh, isMax.data());
+        for (int c = 0; c < srcMat.cols; c++)
+          if (isMax[c])
+            points.push_back({ c, r });
+      }
+    });
+    dst.clear();
+    for (const auto &points : chunkPoints)
+      dst.insert(dst.end(), points.begin(), points.end());
+  }
+
+  template <typename Pixel>
   void nonMaxSuppress(
       cv::InputArray src,
       cv::OutputArray dst,
       const uint kSize,
       const double threshold) {
+    static_assert(PixelTraits<Pixel>::channels == 1);
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
     // Enforce odd kernel size
     if (kSize % 2 != 1)
       CV_Error(cv::Error::StsBadArg, "kSize: kernel must be odd size");
@@ -115,37 +304,530 @@ namespace imgutil {
 
     const int nRows = src.rows(), nCols = src.cols();
     const int kRadius = kSize / 2;
-    const auto [min, max] = getImageRange(src.type());
+    const float thresh = threshold * PixelTraits<Pixel>::max;
+    const Pixel max = PixelTraits<Pixel>::max;
 
+    // If the current pixel is the max -> set to full intensity, else -> 0
+    std::vector<uchar> isMax(nCols);
     for (int r = 0; r < nRows; r++) {
-      for (int c = 0; c < nCols; c++) {
-        int rMin = std::max(0, r - kRadius);
-        int rMax = std::min(nRows - 1, r + kRadius);
-        int cMin = std::max(0, c - kRadius);
-        int cMax = std::min(nCols - 1, c + kRadius);
-        // Look at the submatrix around the current pixel
-        cv::Mat view = srcMat(cv::Range(rMin, rMax), cv::Range(cMin, cMax));
-        // Find the max and its location
-        double maxValue;
-        cv::Point maxLoc;
-        cv::minMaxLoc(view, nullptr, &maxValue, nullptr, &maxLoc);
-        // If the current pixel is the max -> set to 1.0, else -> set to 0.0
-        if (maxLoc.x == kRadius && maxLoc.y == kRadius && maxValue > threshold)
-          output.at<float>(r, c) = max;
-        else
-          output.at<float>(r, c) = min;
-      }
+      windowMaxRow<Pixel>(srcMat, r, { kRadius, kRadius }, thresh,
+          isMax.data());
+      Pixel *row = output.ptr<Pixel>(r);
+      for (int c = 0; c < nCols; c++)
+        row[c] = isMax[c] ? max : Pixel(0);
     }
 
     // Copy temporary buffer to dst
     output.copyTo(dstMat);
   }
 
-  void salt(cv::Mat img, const float percent) {
+  template <typename Pixel>
+  void pyramidVertices(
+      cv::InputArray src,
+      cv::OutputArray sobelDst,
+      cv::OutputArray vertexDst,
+      const std::pair<int, int> &kernelRange,
+      const double threshold,
+      const uint levels) {
+
+    cv::Mat srcMat = src.getMat();
+    const cv::Rect full(cv::Point(0, 0), srcMat.size());
+    const int factor = 1 << levels;
+    // Edges and vertices on the coarse level (kernel radii shrink with it)
+    cv::Mat coarse = srcMat;
+    for (uint i = 0; i < levels; i++)
+      cv::pyrDown(coarse, coarse);
+    cv::Mat coarseSobel, coarseVertices;
+    sobelMagnitude<Pixel>(coarse, coarseSobel);
+    const std::pair<int, int> coarseRange = {
+      std::max(1, kernelRange.first / factor),
+      std::max(1, kernelRange.second / factor) };
+    adaptiveNonMaxSuppress<float>(
+        coarseSobel, coarseVertices, coarseRange, threshold);
+
+    // Strong-edge regions (blurring lowers peaks, hence the halved threshold),
+    // grown so the full-resolution kernels near their borders are covered
+    cv::Mat regionMask = coarseSobel > threshold / 2;
+    const int halo = kernelRange.second / factor + 1;
+    cv::dilate(regionMask, regionMask, cv::getStructuringElement(
+          cv::MORPH_RECT, cv::Size(2 * halo + 1, 2 * halo + 1)));
+    cv::Mat labels, stats, centroids;
+    const int nLabels
+      = cv::connectedComponentsWithStats(regionMask, labels, stats, centroids);
+
+    // Outside the regions: upsampled coarse edges + coarse vertices
+    cv::resize(coarseSobel, sobelDst, srcMat.size());
+    cv::Mat sobelMat = sobelDst.getMatRef();
+    vertexDst.create(srcMat.size(), CV_32F);
+    cv::Mat vertexMat = vertexDst.getMatRef();
+    vertexMat.setTo(cv::Scalar(0));
+    for (int r = 0; r < coarseVertices.rows; r++)
+      for (int c = 0; c < coarseVertices.cols; c++)
+        if (coarseVertices.at<float>(r, c) > 0 && !regionMask.at<uchar>(r, c))
+          vertexMat.at<float>(std::min(r * factor, srcMat.rows - 1),
+                              std::min(c * factor, srcMat.cols - 1)) = 1.0f;
+
+    // Inside the regions: full-resolution Sobel on padded crops, normalized
+    // by the maximum over all regions (strong edges all lie inside them)
+    const int pad = kernelRange.second + 1;
+    std::vector<cv::Rect> rects, paddedRects;
+    std::vector<cv::Mat> regionSobel;
+    double globalMax = 0.0;
+    for (int l = 1; l < nLabels; l++) {
+      cv::Rect rect = cv::Rect(
+          stats.at<int>(l, cv::CC_STAT_LEFT) * factor,
+          stats.at<int>(l, cv::CC_STAT_TOP) * factor,
+          stats.at<int>(l, cv::CC_STAT_WIDTH) * factor,
+          stats.at<int>(l, cv::CC_STAT_HEIGHT) * factor) & full;
+      cv::Rect padded = cv::Rect(
+          rect.x - pad, rect.y - pad,
+          rect.width + 2 * pad, rect.height + 2 * pad) & full;
+      cv::Mat magnitude;
+      sobelMagnitude<Pixel>(srcMat(padded), magnitude, false);
+      double regionMax;
+      cv::minMaxLoc(magnitude, nullptr, &regionMax);
+      globalMax = std::max(globalMax, regionMax);
+      rects.push_back(rect);
+      paddedRects.push_back(padded);
+      regionSobel.push_back(magnitude);
+    }
+    // aNMS on each region, keeping only the pixels of its own component:
+    // bounding boxes can overlap each other and the coarse result, and
+    // either way a pixel has exactly one owner
+    for (size_t i = 0; i < rects.size(); i++) {
+      if (globalMax > 0.0)
+        regionSobel[i] /= globalMax;
+      cv::Mat regionVertices;
+      adaptiveNonMaxSuppress<float>(
+          regionSobel[i], regionVertices, kernelRange, threshold);
+      const cv::Rect interior = rects[i] - paddedRects[i].tl();
+      const int l = i + 1;
+      const cv::Rect coarseRect(
+          stats.at<int>(l, cv::CC_STAT_LEFT), stats.at<int>(l, cv::CC_STAT_TOP),
+          stats.at<int>(l, cv::CC_STAT_WIDTH),
+          stats.at<int>(l, cv::CC_STAT_HEIGHT));
+      cv::Mat owned;
+      cv::resize(labels(coarseRect) == l, owned,
+          coarseRect.size() * factor, 0, 0, cv::INTER_NEAREST);
+      owned = owned(cv::Rect(cv::Point(0, 0), rects[i].size()));
+      regionSobel[i](interior).copyTo(sobelMat(rects[i]), owned);
+      regionVertices(interior).copyTo(vertexMat(rects[i]), owned);
+    }
+  }
+
+  // Insert a candidate into a descending top-k list (no-op if not among best)
+  inline void insertTopK(
+      std::vector<std::pair<float, cv::Point>> &best,
+      const uint k,
+      float value,
+      cv::Point loc) {
+    if (best.size() == k && value <= best.back().first)
+      return;
+    auto it = best.begin();
+    while (it != best.end() && it->first >= value)
+      it++;
+    best.insert(it, { value, loc });
+    if (best.size() > k)
+      best.pop_back();
+  }
+
+  template <typename Pixel>
+  void gridTopK(
+      cv::InputArray src,
+      std::vector<cv::Point> &dst,
+      const std::pair<int, int> &kernelRange,
+      const uint k,
+      const double threshold) {
+    static_assert(PixelTraits<Pixel>::channels == 1);
+
+    cv::Mat srcMat = src.getMat();
+    CV_Assert(srcMat.type() == PixelTraits<Pixel>::type);
+    const int nRows = srcMat.rows, nCols = srcMat.cols;
+    // Blocks are as large as the widest aNMS kernel, then subdivided
+    const int blockSize = 2 * kernelRange.second + 1;
+    const int nBlockRows = (nRows + blockSize - 1) / blockSize;
+    const int nBlockCols = (nCols + blockSize - 1) / blockSize;
+    const float thresh = threshold * PixelTraits<Pixel>::max;
+    std::vector<std::vector<cv::Point>> blockRowPoints(nBlockRows);
+
+    threadpool::parallelFor(0, nBlockRows, 1,
+        [&](size_t brBegin, size_t brEnd) {
+      std::vector<std::pair<float, cv::Point>> best;
+      for (int br = brBegin; br < int(brEnd); br++) {
+        std::vector<cv::Point> &points = blockRowPoints[br];
+        for (int bc = 0; bc < nBlockCols; bc++) {
+          const cv::Rect block = cv::Rect(
+              bc * blockSize, br * blockSize, blockSize, blockSize)
+            & cv::Rect(0, 0, nCols, nRows);
+          // Edge density: edge pixels per block side (~ edges crossing it)
+          int nEdge = 0;
+          for (int r = block.y; r < block.y + block.height; r++) {
+            const Pixel *row = srcMat.ptr<Pixel>(r);
+            for (int c = block.x; c < block.x + block.width; c++)
+              nEdge += row[c] > thresh;
+          }
+          if (nEdge == 0)
+            continue;
+          const double crossings
+            = std::min(1.0, static_cast<double>(nEdge) / blockSize);
+          // Dense blocks get the smallest cells, sparse ones the largest
+          const int radius = kernelRange.second - cvRound(
+              crossings * (kernelRange.second - kernelRange.first));
+          const int cellSize = 2 * radius + 1;
+          for (int cy = block.y; cy < block.y + block.height; cy += cellSize) {
+            for (int cx = block.x; cx < block.x + block.width; cx += cellSize) {
+              const int rEnd = std::min(cy + cellSize, block.y + block.height);
+              const int cEnd = std::min(cx + cellSize, block.x + block.width);
+              best.clear();
+              for (int r = cy; r < rEnd; r++) {
+                const Pixel *row = srcMat.ptr<Pixel>(r);
+                for (int c = cx; c < cEnd; c++) {
+                  const float value = row[c];
+                  if (value <= thresh
+                      || (best.size() == k && value <= best.back().first))
+                    continue;
+                  // Only keep local maxima so k > 1 does not stack on a ridge
+                  bool isMax = true;
+                  for (int dr = -1; dr <= 1 && isMax; dr++) {
+                    if (r + dr < 0 || r + dr >= nRows)
+                      continue;
+                    const Pixel *nRow = srcMat.ptr<Pixel>(r + dr);
+                    for (int dc = -1; dc <= 1; dc++)
+                      if (c + dc >= 0 && c + dc < nCols
+                          && (dr != 0 || dc != 0) && nRow[c + dc] > value)
+                        isMax = false;
+                  }
+                  if (isMax)
+                    insertTopK(best, k, value, { c, r });
+                }
+              }
+              for (const auto &candidate : best)
+                points.push_back(candidate.second);
+            }
+          }
+        }
+      }
+    });
+
+    dst.clear();
+    for (const auto &points : blockRowPoints)
+      dst.insert(dst.end(), points.begin(), points.end());
+    // Sort by x, then y (the order delaunay::triangulate consumes them in)
+    std::sort(dst.begin(), dst.end(), [](const cv::Point &a, const cv::Point &b) {
+      return (a.x == b.x) ? (a.y < b.y) : (a.x < b.x);
+    });
+  }
+
+  template <typename Pixel>
+  void traceContours(
+      cv::InputArray src,
+      std::vector<std::pair<cv::Point, cv::Point>> &dst,
+      const double threshold,
+      const double epsilon,
+      const double minLength) {
+    static_assert(PixelTraits<Pixel>::channels == 1);
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
+    cv::Mat srcMat = src.getMat();
+    const int nRows = srcMat.rows, nCols = srcMat.cols;
+    const float thresh = threshold * PixelTraits<Pixel>::max;
+
+    // Ridge pixels: strong, and a maximum across the edge horizontally or
+    // vertically (ties go to the first), so contours come out one pixel wide
+    cv::Mat ridge = cv::Mat::zeros(srcMat.size(), CV_8U);
+    threadpool::parallelFor(0, nRows, ANMS_GRAIN_ROWS,
+        [&](size_t rBegin, size_t rEnd) {
+      for (int r = rBegin; r < int(rEnd); r++) {
+        const Pixel *row = srcMat.ptr<Pixel>(r);
+        const Pixel *above = srcMat.ptr<Pixel>(std::max(r - 1, 0));
+        const Pixel *below = srcMat.ptr<Pixel>(std::min(r + 1, nRows - 1));
+        uchar *out = ridge.ptr<uchar>(r);
+        for (int c = 0; c < nCols; c++) {
+          const Pixel value = row[c];
+          if (!(value > thresh))
+            continue;
+          const bool across = (c == 0 || value >= row[c - 1])
+            && (c == nCols - 1 || value > row[c + 1]);
+          const bool down = (r == 0 || value >= above[c])
+            && (r == nRows - 1 || value > below[c]);
+          out[c] = across || down;
+        }
+      }
+    });
+
+    // Follow each chain of ridge pixels, starting from the ends of open
+    // chains, then from anywhere on the closed ones that are left
+    const cv::Point steps[8] = {
+      {1, 0}, {0, 1}, {-1, 0}, {0, -1}, {1, 1}, {-1, 1}, {-1, -1}, {1, -1} };
+    auto isRidge = [&](cv::Point p) {
+      return p.x >= 0 && p.y >= 0 && p.x < nCols && p.y < nRows
+        && ridge.at<uchar>(p) != 0;
+    };
+    std::vector<cv::Point> chain, simplified;
+    dst.clear();
+    auto trace = [&](cv::Point p) {
+      chain.clear();
+      while (true) {
+        chain.push_back(p);
+        ridge.at<uchar>(p) = 0;
+        // Straight neighbors first, so corners are not cut
+        bool moved = false;
+        for (const cv::Point &step : steps)
+          if (isRidge(p + step)) {
+            p += step;
+            moved = true;
+            break;
+          }
+        if (!moved)
+          break;
+      }
+      if (static_cast<double>(chain.size()) < minLength)
+        return;
+      cv::approxPolyDP(chain, simplified, epsilon, false);
+      for (size_t i = 1; i < simplified.size(); i++)
+        dst.push_back({ simplified[i - 1], simplified[i] });
+    };
+    for (int pass = 0; pass < 2; pass++)
+      for (int r = 0; r < nRows; r++)
+        for (int c = 0; c < nCols; c++) {
+          const cv::Point p(c, r);
+          if (!isRidge(p))
+            continue;
+          int degree = 0;
+          for (const cv::Point &step : steps)
+            degree += isRidge(p + step);
+          if (pass == 1 || degree <= 1)
+            trace(p);
+        }
+  }
+
+  // Color error of the pixels covered by a CCW triangle (boundary included)
+  struct TriangleError {
+    double error = 0.0; // total squared distance from the mean color
+    size_t nPixels = 0;
+    bool hasInterior = false;
+    cv::Point worst; // farthest from the mean, strictly inside
+  };
+
+  // Channel sums of pixel spans, exact for integer channels
+  template <typename Pixel>
+  struct SpanSums {
+    using Channel = typename PixelTraits<Pixel>::Channel;
+    using Sum = std::conditional_t<std::is_integral_v<Channel>,
+          uint64_t, double>;
+    Sum sum[PixelTraits<Pixel>::channels] = {};
+    Sum sumSq = 0;
+  };
+
+  template <typename Pixel>
+  ISA_INLINE void accumulateSpanKernel(
+      const typename PixelTraits<Pixel>::Channel *span,
+      int nPixels,
+      SpanSums<Pixel> &sums) {
+    using Sum = typename SpanSums<Pixel>::Sum;
+    constexpr int cn = PixelTraits<Pixel>::channels;
+    // Squares over the interleaved channels as one run, sums per channel
+    Sum sumSq = 0;
+    for (int i = 0; i < nPixels * cn; i++)
+      sumSq += Sum(span[i]) * Sum(span[i]);
+    sums.sumSq += sumSq;
+    for (int ch = 0; ch < cn; ch++) {
+      Sum sum = 0;
+      for (int i = 0; i < nPixels; i++)
+        sum += span[i * cn + ch];
+      sums.sum[ch] += sum;
+    }
+  }
+
+  ISA_DISPATCH(Pixel, accumulateSpan, accumulateSpanKernel,
+      (const typename PixelTraits<Pixel>::Channel *span, int nPixels,
+       SpanSums<Pixel> &sums),
+      (span, nPixels, sums))
+
+  inline int64_t floorDiv(int64_t a, int64_t b) {
+    const int64_t q = a / b;
+    return q - ((a % b != 0) && ((a < 0) != (b < 0)));
+  }
+
+  inline int64_t ceilDiv(int64_t a, int64_t b) {
+    return -floorDiv(-a, b);
+  }
+
+  // Columns [first, last] of row y on the left of (or on, unless strict) the
+  // edge p -> q are narrowed to those
+  inline void clipToEdge(
+      const cv::Point &p,
+      const cv::Point &q,
+      int y,
+      bool strict,
+      int64_t &first,
+      int64_t &last) {
+    // The cross product is dx * (y - p.y) - dy * (x - p.x) = a - dy * x
+    const int64_t dy = q.y - p.y;
+    const int64_t a = int64_t(q.x - p.x) * (y - p.y) + dy * p.x;
+    if (dy > 0)
+      last = std::min(last, strict ? ceilDiv(a, dy) - 1 : floorDiv(a, dy));
+    else if (dy < 0)
+      first = std::max(first, strict ? floorDiv(a, dy) + 1 : ceilDiv(a, dy));
+    else if (strict ? a <= 0 : a < 0)
+      last = first - 1;
+  }
+
+  // Errors are measured in 8-bit units whatever the pixel type, so one
+  // maxError means the same for every input
+  template <typename Pixel>
+  TriangleError triangleError(
+      const cv::Mat &img,
+      const cv::Point &a,
+      const cv::Point &b,
+      const cv::Point &c) {
+    using Channel = typename PixelTraits<Pixel>::Channel;
+    constexpr int cn = PixelTraits<Pixel>::channels;
+    constexpr double scale = 255.0 / PixelTraits<Pixel>::max;
+    const int yMin = std::min({a.y, b.y, c.y});
+    const int yMax = std::max({a.y, b.y, c.y});
+    // The covered pixels of a row are one span, found from the edges
+    // directly rather than testing every pixel of the bounding box
+    auto span = [&](int y, bool strict, int &first, int &last) {
+      int64_t lo = std::min({a.x, b.x, c.x}), hi = std::max({a.x, b.x, c.x});
+      clipToEdge(a, b, y, strict, lo, hi);
+      clipToEdge(b, c, y, strict, lo, hi);
+      clipToEdge(c, a, y, strict, lo, hi);
+      first = lo;
+      last = hi;
+      return lo <= hi;
+    };
+    TriangleError result;
+    SpanSums<Pixel> sums;
+    for (int y = yMin; y <= yMax; y++) {
+      int first, last;
+      if (!span(y, false, first, last))
+        continue;
+      accumulateSpan<Pixel>(img.ptr<Channel>(y) + first * cn,
+          last - first + 1, sums);
+      result.nPixels += last - first + 1;
+    }
+    if (result.nPixels == 0)
+      return result;
+    double mean[cn], meanSq = 0.0;
+    for (int ch = 0; ch < cn; ch++) {
+      const double sum = double(sums.sum[ch]) * scale;
+      mean[ch] = sum / result.nPixels;
+      meanSq += sum * mean[ch];
+    }
+    result.error
+      = std::max(0.0, double(sums.sumSq) * scale * scale - meanSq);
+    // The worst pixel strictly inside, the first one in row-major order
+    double worstDistance = -1.0;
+    for (int y = yMin; y <= yMax; y++) {
+      int first, last;
+      if (!span(y, true, first, last))
+        continue;
+      const Channel *row = img.ptr<Channel>(y);
+      for (int x = first; x <= last; x++) {
+        double distance = 0.0;
+        for (int ch = 0; ch < cn; ch++) {
+          const double delta = row[x * cn + ch] * scale - mean[ch];
+          distance += delta * delta;
+        }
+        if (distance > worstDistance) {
+          worstDistance = distance;
+          result.worst = { x, y };
+          result.hasInterior = true;
+        }
+      }
+    }
+    return result;
+  }
+
+  template <typename Pixel>
+  void refineVertices(
+      cv::InputArray src,
+      std::vector<cv::Point> &dst,
+      const double maxError,
+      const size_t maxTriangles) {
+    using Edge = quadedge::QuadEdgeRef<cv::Point>;
+    cv::Mat img = src.getMat();
+    CV_Assert(img.type() == PixelTraits<Pixel>::type);
+    dst = { {0, 0}, {img.cols - 1, 0},
+            {0, img.rows - 1}, {img.cols - 1, img.rows - 1} };
+    if (img.cols < 2 || img.rows < 2)
+      return;
+
+    // Triangles worth splitting, worst (total squared error) first. Entries
+    // are not removed when an insertion destroys their triangle, so each one
+    // is checked against its recorded corners when it comes up.
+    struct Candidate {
+      double error;
+      Edge *edge;
+      cv::Point corners[3];
+      cv::Point worst;
+      bool operator<(const Candidate &other) const {
+        return error < other.error;
+      }
+    };
+    std::priority_queue<Candidate> queue;
+    auto consider = [&](Edge *edge) {
+      Edge *e1 = edge->lnext(), *e2 = e1->lnext();
+      if (e2->lnext() != edge)
+        return;
+      const cv::Point a = edge->origCoords(), b = e1->origCoords();
+      const cv::Point c = e2->origCoords();
+      if (!delaunay::isCCW(a, b, c))
+        return;
+      TriangleError t = triangleError<Pixel>(img, a, b, c);
+      // Stop splitting once the RMS color error is within budget
+      if (t.hasInterior && t.error > maxError * maxError * t.nPixels)
+        queue.push({ t.error, edge, { a, b, c }, t.worst });
+    };
+
+    // Start from the two triangles spanning the image
+    Edge *graph = delaunay::triangulate(dst);
+    std::unordered_set<Edge*> seen;
+    std::vector<Edge*> stack = { graph, graph->sym() };
+    while (!stack.empty()) {
+      Edge *first = stack.back();
+      stack.pop_back();
+      if (seen.count(first) > 0)
+        continue;
+      Edge *e = first;
+      do {
+        seen.insert(e);
+        stack.push_back(e->sym());
+        e = e->lnext();
+      } while (e != first);
+      consider(first);
+    }
+
+    // Each insertion into a triangle adds two triangles, flips add none
+    size_t nTriangles = 2;
+    while (!queue.empty()
+        && (maxTriangles == 0 || nTriangles + 2 <= maxTriangles)) {
+      const Candidate top = queue.top();
+      queue.pop();
+      Edge *e1 = top.edge->lnext(), *e2 = e1->lnext();
+      if (e2->lnext() != top.edge
+          || top.edge->origCoords() != top.corners[0]
+          || e1->origCoords() != top.corners[1]
+          || e2->origCoords() != top.corners[2])
+        continue;
+      Edge *spoke = delaunay::insertSite(top.edge, top.worst);
+      dst.push_back(top.worst);
+      nTriangles += 2;
+      // Every triangle the insertion changed surrounds the new vertex
+      Edge *e = spoke;
+      do {
+        consider(e);
+        e = e->onext;
+      } while (e != spoke);
+    }
+    quadedge::freeGraph(graph);
+  }
+
+  void salt(cv::Mat img, const float percent, uint64_t seed) {
     const int nRows = img.rows, nCols = img.cols;
     const int nGrains = percent * nRows * nCols;
     const int max = getImageRange(img.type()).second;
-    cv::RNG rng(time(nullptr));
+    cv::RNG rng(seed);
     for (int i = 0; i < nGrains; i++) {
       int r = rng.uniform(0, nRows);
       int c = rng.uniform(0, nCols);
@@ -153,15 +835,502 @@ namespace imgutil {
     }
   }
 
-  cv::Scalar avgColorInPoly(cv::Mat img, std::vector<cv::Point> polygon) {
-    cv::Rect boundingBox = cv::boundingRect(polygon);
+  void salt(
+      std::vector<cv::Point> &points,
+      const cv::Size &size,
+      const float percent,
+      uint64_t seed) {
+    const int nGrains = percent * size.height * size.width;
+    cv::RNG rng(seed);
+    for (int i = 0; i < nGrains; i++) {
+      int r = rng.uniform(0, size.height);
+      int c = rng.uniform(0, size.width);
+      points.push_back({ c, r });
+    }
+  }
+
+  template <typename Pixel>
+  cv::Scalar avgColorInPoly(
+      cv::Mat img,
+      const cv::Point *polygon,
+      int nPoints,
+      ScratchBuffer &scratch) {
+    CV_Assert(img.type() == PixelTraits<Pixel>::type);
+    // Bounding box of the polygon (inclusive of its far edges)
+    cv::Point tl = polygon[0], br = polygon[0];
+    for (int i = 1; i < nPoints; i++) {
+      tl.x = std::min(tl.x, polygon[i].x);
+      tl.y = std::min(tl.y, polygon[i].y);
+      br.x = std::max(br.x, polygon[i].x);
+      br.y = std::max(br.y, polygon[i].y);
+    }
+    cv::Rect boundingBox(tl, br + cv::Point(1, 1));
     cv::Mat view(img, boundingBox);
-    cv::Mat mask = cv::Mat::zeros(boundingBox.size(), CV_8UC1);
-    for (auto &point : polygon)
-      point -= boundingBox.tl();
-    cv::fillConvexPoly(mask, polygon, cv::Scalar(255));
+    cv::Mat mask(boundingBox.size(), CV_8UC1,
+        scratch.reserve(boundingBox.area()));
+    mask.setTo(cv::Scalar(0));
+    // Rasterize relative to the bounding box without copying the polygon
+    cv::fillPoly(mask, &polygon, &nPoints, 1, cv::Scalar(255),
+        cv::LINE_8, 0, -tl);
     cv::Scalar avgColor = cv::mean(view, mask);
+    if constexpr (PixelTraits<Pixel>::channels == 1)
+      avgColor = cv::Scalar::all(avgColor[0]);
+    if constexpr (PixelTraits<Pixel>::max != 255.0)
+      avgColor *= 255.0 / PixelTraits<Pixel>::max;
     return avgColor;
   }
 
+  // Sampling starts at one read per SAMPLE_AREA pixels and quadruples while
+  // the mean is less certain than the tolerance; polygons smaller than
+  // MIN_SAMPLED_AREA, or needing a read per MAX_SAMPLED_AREA pixels, are
+  // averaged exactly instead
+  const double SAMPLE_AREA = 256.0;
+  const double MAX_SAMPLED_AREA = 4.0;
+  const double MIN_SAMPLED_AREA = 1024.0;
+
+  // Uniform in [0, 1) from a 64-bit state (xorshift*), so the samples of a
+  // polygon are the same on every run
+  inline double nextUniform(uint64_t &state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545f4914f6cdd1dULL >> 11) * 0x1.0p-53;
+  }
+
+  template <typename Pixel>
+  cv::Scalar sampledColorInPoly(
+      cv::Mat img,
+      const cv::Point *polygon,
+      int nPoints,
+      double tolerance,
+      ScratchBuffer &scratch) {
+    using Channel = typename PixelTraits<Pixel>::Channel;
+    constexpr int cn = PixelTraits<Pixel>::channels;
+    constexpr double scale = 255.0 / PixelTraits<Pixel>::max;
+    CV_Assert(img.type() == PixelTraits<Pixel>::type);
+    // The polygon is convex, so it fans out from its first corner
+    double area = 0.0;
+    for (int k = 1; k + 1 < nPoints; k++)
+      area += std::abs(double(polygon[k].x - polygon[0].x)
+          * (polygon[k + 1].y - polygon[0].y)
+          - double(polygon[k].y - polygon[0].y)
+          * (polygon[k + 1].x - polygon[0].x)) / 2;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for (int k = 0; k < nPoints; k++)
+      seed = (seed ^ (uint64_t(uint32_t(polygon[k].x)) << 32
+            ^ uint32_t(polygon[k].y))) * 0xff51afd7ed558ccdULL;
+    for (double density = 1.0 / SAMPLE_AREA;
+        area >= MIN_SAMPLED_AREA && density < 1.0 / MAX_SAMPLED_AREA;
+        density *= 4) {
+      // Each fan triangle is cut into n^2 equal triangles (n per side) with
+      // one jittered read in each; reads are weighted by the area they
+      // stand for, since n^2 only approximates the triangle's share
+      double sum[cn] = {}, sumSq = 0.0, weight = 0.0;
+      size_t nSamples = 0;
+      uint64_t state = seed | 1;
+      for (int k = 1; k + 1 < nPoints; k++) {
+        const cv::Point2d a = polygon[0];
+        const cv::Point2d ab = cv::Point2d(polygon[k]) - a;
+        const cv::Point2d ac = cv::Point2d(polygon[k + 1]) - a;
+        const double fanArea = std::abs(ab.cross(ac)) / 2;
+        const int n = std::max(2, cvCeil(std::sqrt(fanArea * density)));
+        const double w = fanArea / (n * n);
+        auto read = [&](double s, double t) {
+          const int x = std::clamp(cvRound(a.x + s * ab.x + t * ac.x),
+              0, img.cols - 1);
+          const int y = std::clamp(cvRound(a.y + s * ab.y + t * ac.y),
+              0, img.rows - 1);
+          const Channel *pixel = img.ptr<Channel>(y) + x * cn;
+          for (int ch = 0; ch < cn; ch++) {
+            const double value = pixel[ch] * scale;
+            sum[ch] += w * value;
+            sumSq += w * value * value;
+          }
+        };
+        // Cell (i, j) pointing away from a, or (flipped) the one between it
+        // and its neighbours
+        auto sample = [&](int i, int j, bool flipped) {
+          double u = nextUniform(state), v = nextUniform(state);
+          if (u + v > 1.0) {
+            u = 1.0 - u;
+            v = 1.0 - v;
+          }
+          if (flipped)
+            read((i + 1 - u) / n, (j + 1 - v) / n);
+          else
+            read((i + u) / n, (j + v) / n);
+        };
+        for (int i = 0; i < n; i++) {
+          for (int j = 0; i + j < n; j++) {
+            sample(i, j, false);
+            if (i + j + 1 < n)
+              sample(i, j, true);
+          }
+        }
+        weight += fanArea;
+        nSamples += n * n;
+      }
+      // Standard error of the mean color, as an RMS distance (stratification
+      // only lowers it, so this is conservative)
+      cv::Scalar mean;
+      double meanSq = 0.0;
+      for (int ch = 0; ch < cn; ch++) {
+        mean[ch] = sum[ch] / weight;
+        meanSq += mean[ch] * mean[ch];
+      }
+      const double variance = std::max(0.0, sumSq / weight - meanSq);
+      if (variance <= tolerance * tolerance * nSamples) {
+        if constexpr (cn == 1)
+          mean = cv::Scalar::all(mean[0]);
+        return mean;
+      }
+    }
+    return avgColorInPoly<Pixel>(img, polygon, nPoints, scratch);
+  }
+
+  template <typename Pixel>
+  void toBGR8(cv::InputArray src, cv::OutputArray dst, const cv::Size &size) {
+    CV_Assert(src.type() == PixelTraits<Pixel>::type);
+    cv::Mat resized;
+    if (src.size() == size)
+      resized = src.getMat();
+    else
+      cv::resize(src, resized, size);
+    resized.convertTo(dst, CV_8U, 255.0 / PixelTraits<Pixel>::max);
+    if constexpr (PixelTraits<Pixel>::channels == 1)
+      cv::cvtColor(dst, dst, cv::COLOR_GRAY2BGR);
+  }
+
+  // Sub-pixel bits used when scaling mesh vertices at raster time
+  const int RASTER_SHIFT = 4;
+  // Polygons filled between checks of the cancel flag
+  const size_t CANCEL_POLYGONS = 1024;
+
+  template <typename PointT>
+  inline cv::Point scaleFixed(PointT p, double scale) {
+    const double fixedScale = scale * (1 << RASTER_SHIFT);
+    return { cvRound(p.x * fixedScale), cvRound(p.y * fixedScale) };
+  }
+
+  template <typename PointT>
+  void fillMesh(
+      cv::Mat dst,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const std::atomic<bool> *cancel) {
+    cv::Point triangle[3];
+    for (size_t i = 0; i < mesh.size(); i++) {
+      if (cancel && i % CANCEL_POLYGONS == 0
+          && cancel->load(std::memory_order_relaxed))
+        return;
+      for (int j = 0; j < 3; j++)
+        triangle[j] = scaleFixed(mesh.vertex(i, j), scale);
+      cv::fillConvexPoly(dst, triangle, 3, mesh.colors[i],
+          cv::LINE_AA, RASTER_SHIFT);
+    }
+  }
+
+  template <typename PointT>
+  void drawMesh(
+      cv::Mat dst,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const cv::Scalar &edgeColor,
+      const cv::Scalar &vertexColor) {
+    cv::Point triangle[3];
+    const cv::Point *contour = triangle;
+    const int nPoints = 3;
+    for (size_t i = 0; i < mesh.size(); i++) {
+      for (int j = 0; j < 3; j++)
+        triangle[j] = scaleFixed(mesh.vertex(i, j), scale);
+      cv::polylines(dst, &contour, &nPoints, 1, true, edgeColor,
+          1, cv::LINE_AA, RASTER_SHIFT);
+    }
+    for (const auto &vertex : mesh.vertices)
+      cv::circle(dst, scaleFixed(vertex, scale), 2 << RASTER_SHIFT,
+          vertexColor, cv::FILLED, cv::LINE_AA, RASTER_SHIFT);
+  }
+
+  template <typename PointT>
+  void fillCells(
+      cv::Mat dst,
+      const delaunay::Cells<PointT> &cells,
+      double scale,
+      const std::atomic<bool> *cancel) {
+    std::vector<cv::Point> polygon;
+    for (size_t i = 0; i < cells.size(); i++) {
+      if (cancel && i % CANCEL_POLYGONS == 0
+          && cancel->load(std::memory_order_relaxed))
+        return;
+      if (cells.cellSize(i) < 3)
+        continue;
+      polygon.clear();
+      for (size_t j = 0; j < cells.cellSize(i); j++)
+        polygon.push_back(scaleFixed(cells.cell(i)[j], scale));
+      cv::fillConvexPoly(dst, polygon.data(), polygon.size(), cells.colors[i],
+          cv::LINE_AA, RASTER_SHIFT);
+    }
+  }
+
+  template <typename PointT>
+  void drawCells(
+      cv::Mat dst,
+      const delaunay::Cells<PointT> &cells,
+      double scale,
+      const cv::Scalar &edgeColor,
+      const cv::Scalar &siteColor) {
+    std::vector<cv::Point> polygon;
+    for (size_t i = 0; i < cells.size(); i++) {
+      polygon.clear();
+      for (size_t j = 0; j < cells.cellSize(i); j++)
+        polygon.push_back(scaleFixed(cells.cell(i)[j], scale));
+      const cv::Point *contour = polygon.data();
+      const int nPoints = polygon.size();
+      cv::polylines(dst, &contour, &nPoints, 1, true, edgeColor,
+          1, cv::LINE_AA, RASTER_SHIFT);
+    }
+    for (const auto &site : cells.sites)
+      cv::circle(dst, scaleFixed(site, scale), 2 << RASTER_SHIFT,
+          siteColor, cv::FILLED, cv::LINE_AA, RASTER_SHIFT);
+  }
+
+  // Each strip buffer is kept near this size, so narrow outputs get tall
+  // strips and very wide outputs get short ones
+  const size_t STRIP_BYTES = 4 << 20;
+
+  // Item indices (triangles or vertices) per strip, in their original order
+  // so overlapping anti-aliased edges blend exactly as in a whole-image render
+  struct StripBuckets {
+    std::vector<uint32_t> offsets, items;
+  };
+
+  // rowRange(i) gives the inclusive pixel rows item i may touch
+  template <typename RowRange>
+  StripBuckets bucketByRows(
+      size_t nItems,
+      int height,
+      int stripRows,
+      RowRange rowRange) {
+    const int nStrips = (height + stripRows - 1) / stripRows;
+    StripBuckets buckets;
+    buckets.offsets.assign(nStrips + 1, 0);
+    auto stripSpan = [&](size_t i) {
+      auto [first, last] = rowRange(i);
+      first = std::max(first, 0);
+      last = std::min(last, height - 1);
+      return std::make_pair(first / stripRows, last / stripRows);
+    };
+    // Count, prefix sum, then fill
+    for (size_t i = 0; i < nItems; i++) {
+      auto [s0, s1] = stripSpan(i);
+      for (int s = s0; s <= s1; s++)
+        buckets.offsets[s + 1]++;
+    }
+    for (int s = 0; s < nStrips; s++)
+      buckets.offsets[s + 1] += buckets.offsets[s];
+    buckets.items.resize(buckets.offsets.back());
+    std::vector<uint32_t> next(buckets.offsets.begin(), buckets.offsets.end() - 1);
+    for (size_t i = 0; i < nItems; i++) {
+      auto [s0, s1] = stripSpan(i);
+      for (int s = s0; s <= s1; s++)
+        buckets.items[next[s]++] = i;
+    }
+    return buckets;
+  }
+
+  template <typename PointT>
+  StripBuckets bucketTriangles(
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      int height,
+      int stripRows) {
+    return bucketByRows(mesh.size(), height, stripRows, [&](size_t i) {
+      double yMin = mesh.vertex(i, 0).y, yMax = yMin;
+      for (int j = 1; j < 3; j++) {
+        yMin = std::min<double>(yMin, mesh.vertex(i, j).y);
+        yMax = std::max<double>(yMax, mesh.vertex(i, j).y);
+      }
+      // One extra row either side for anti-aliasing
+      return std::make_pair(static_cast<int>(std::floor(yMin * scale)) - 1,
+                            static_cast<int>(std::ceil(yMax * scale)) + 1);
+    });
+  }
+
+  // Render strip s (rows [y0, y0 + rows.rows)) with render(rows, s, y0), and
+  // encode each strip while the next one renders on another thread
+  template <typename RenderStrip>
+  void streamStrips(
+      RowWriter &writer,
+      const cv::Size &size,
+      int stripRows,
+      RenderStrip render) {
+    const int nStrips = (size.height + stripRows - 1) / stripRows;
+    cv::Mat buffers[2] = {
+      cv::Mat(stripRows, size.width, CV_8UC3),
+      cv::Mat(stripRows, size.width, CV_8UC3) };
+    auto renderInto = [&](int s) {
+      const int y0 = s * stripRows;
+      cv::Mat rows = buffers[s % 2].rowRange(
+          0, std::min(stripRows, size.height - y0));
+      tracing::Span span("raster strip", "raster", s);
+      render(rows, s, y0);
+      return rows;
+    };
+    // The next strip renders on the shared pool while this one is encoded
+    // (inline when the pool has no workers)
+    cv::Mat current = renderInto(0);
+    for (int s = 0; s < nStrips; s++) {
+      cv::Mat next;
+      threadpool::invoke([&]() {
+        tracing::Span span("encode strip", "io", s);
+        writer.writeRows(current);
+      }, [&]() {
+        if (s + 1 < nStrips)
+          next = renderInto(s + 1);
+      });
+      current = next;
+    }
+    tracing::Span span("encode finish", "io");
+    writer.finish();
+  }
+
+  inline int stripRowsFor(const cv::Size &size) {
+    const size_t rowBytes = 3 * static_cast<size_t>(size.width);
+    return std::clamp<int>(STRIP_BYTES / rowBytes, 1, size.height);
+  }
+
+  template <typename PointT>
+  void streamFillMesh(
+      RowWriter &writer,
+      const cv::Size &size,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const cv::Scalar &background) {
+    const int stripRows = stripRowsFor(size);
+    const StripBuckets buckets
+      = bucketTriangles(mesh, scale, size.height, stripRows);
+    streamStrips(writer, size, stripRows, [&](cv::Mat rows, int s, int y0) {
+      rows.setTo(background);
+      const cv::Point origin(0, y0 << RASTER_SHIFT);
+      cv::Point triangle[3];
+      for (uint32_t k = buckets.offsets[s]; k < buckets.offsets[s + 1]; k++) {
+        const uint32_t i = buckets.items[k];
+        for (int j = 0; j < 3; j++)
+          triangle[j] = scaleFixed(mesh.vertex(i, j), scale) - origin;
+        cv::fillConvexPoly(rows, triangle, 3, mesh.colors[i],
+            cv::LINE_AA, RASTER_SHIFT);
+      }
+    });
+  }
+
+  template <typename PointT>
+  void streamDrawMesh(
+      RowWriter &writer,
+      const cv::Size &size,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const cv::Scalar &edgeColor,
+      const cv::Scalar &vertexColor) {
+    const int stripRows = stripRowsFor(size);
+    const StripBuckets triangles
+      = bucketTriangles(mesh, scale, size.height, stripRows);
+    const StripBuckets vertices = bucketByRows(
+        mesh.vertices.size(), size.height, stripRows, [&](size_t i) {
+          // Same radius as drawMesh, plus a row for anti-aliasing
+          const double y = mesh.vertices[i].y * scale;
+          return std::make_pair(static_cast<int>(std::floor(y)) - 3,
+                                static_cast<int>(std::ceil(y)) + 3);
+        });
+    streamStrips(writer, size, stripRows, [&](cv::Mat rows, int s, int y0) {
+      rows.setTo(cv::Scalar(0, 0, 0));
+      const cv::Point origin(0, y0 << RASTER_SHIFT);
+      cv::Point triangle[3];
+      const cv::Point *contour = triangle;
+      const int nPoints = 3;
+      for (uint32_t k = triangles.offsets[s]; k < triangles.offsets[s + 1]; k++) {
+        const uint32_t i = triangles.items[k];
+        for (int j = 0; j < 3; j++)
+          triangle[j] = scaleFixed(mesh.vertex(i, j), scale) - origin;
+        cv::polylines(rows, &contour, &nPoints, 1, true, edgeColor,
+            1, cv::LINE_AA, RASTER_SHIFT);
+      }
+      for (uint32_t k = vertices.offsets[s]; k < vertices.offsets[s + 1]; k++)
+        cv::circle(rows,
+            scaleFixed(mesh.vertices[vertices.items[k]], scale) - origin,
+            2 << RASTER_SHIFT, vertexColor, cv::FILLED, cv::LINE_AA,
+            RASTER_SHIFT);
+    });
+  }
+
+#define INSTANTIATE_PIXEL_KERNELS(Pixel) \
+  template void sobelMagnitude<Pixel>( \
+      cv::InputArray, cv::OutputArray, const bool); \
+  template void sobelMagnitude<Pixel>( \
+      cv::InputArray, cv::OutputArray, ScratchBuffer&, const int); \
+  template void pyramidVertices<Pixel>(cv::InputArray, cv::OutputArray, \
+      cv::OutputArray, const std::pair<int, int>&, const double, const uint); \
+  template void refineVertices<Pixel>( \
+      cv::InputArray, std::vector<cv::Point>&, const double, const size_t); \
+  template cv::Scalar avgColorInPoly<Pixel>( \
+      cv::Mat, const cv::Point*, int, ScratchBuffer&); \
+  template cv::Scalar sampledColorInPoly<Pixel>( \
+      cv::Mat, const cv::Point*, int, double, ScratchBuffer&); \
+  template void toBGR8<Pixel>( \
+      cv::InputArray, cv::OutputArray, const cv::Size&);
+
+#define INSTANTIATE_EDGE_KERNELS(Pixel) \
+  template void nonMaxSuppress<Pixel>( \
+      cv::InputArray, cv::OutputArray, const uint, const double); \
+  template void adaptiveNonMaxSuppress<Pixel>(cv::InputArray, \
+      cv::OutputArray, const std::pair<int, int>&, const double); \
+  template void adaptiveNonMaxSuppress<Pixel>(cv::InputArray, \
+      std::vector<cv::Point>&, const std::pair<int, int>&, const double, \
+      const std::atomic<bool>*); \
+  template void gridTopK<Pixel>(cv::InputArray, std::vector<cv::Point>&, \
+      const std::pair<int, int>&, const uint, const double); \
+  template void traceContours<Pixel>(cv::InputArray, \
+      std::vector<std::pair<cv::Point, cv::Point>>&, const double, \
+      const double, const double);
+
+  INSTANTIATE_PIXEL_KERNELS(uchar)
+  INSTANTIATE_PIXEL_KERNELS(cv::Vec3b)
+  INSTANTIATE_PIXEL_KERNELS(ushort)
+  INSTANTIATE_PIXEL_KERNELS(cv::Vec3w)
+  INSTANTIATE_PIXEL_KERNELS(float)
+  INSTANTIATE_PIXEL_KERNELS(cv::Vec3f)
+  INSTANTIATE_EDGE_KERNELS(uchar)
+  INSTANTIATE_EDGE_KERNELS(ushort)
+  INSTANTIATE_EDGE_KERNELS(float)
+
+#undef INSTANTIATE_PIXEL_KERNELS
+#undef INSTANTIATE_EDGE_KERNELS
+
+  // Integer meshes come from the pipeline, float meshes carry sub-pixel vertices
+  template void fillMesh(cv::Mat, const delaunay::Mesh<cv::Point>&, double,
+      const std::atomic<bool>*);
+  template void fillMesh(cv::Mat, const delaunay::Mesh<cv::Point2f>&, double,
+      const std::atomic<bool>*);
+  template void drawMesh(cv::Mat, const delaunay::Mesh<cv::Point>&, double,
+      const cv::Scalar&, const cv::Scalar&);
+  template void drawMesh(cv::Mat, const delaunay::Mesh<cv::Point2f>&, double,
+      const cv::Scalar&, const cv::Scalar&);
+  template void fillCells(cv::Mat, const delaunay::Cells<cv::Point>&, double,
+      const std::atomic<bool>*);
+  template void fillCells(cv::Mat, const delaunay::Cells<cv::Point2f>&, double,
+      const std::atomic<bool>*);
+  template void drawCells(cv::Mat, const delaunay::Cells<cv::Point>&, double,
+      const cv::Scalar&, const cv::Scalar&);
+  template void drawCells(cv::Mat, const delaunay::Cells<cv::Point2f>&, double,
+      const cv::Scalar&, const cv::Scalar&);
+  template void streamFillMesh(RowWriter&, const cv::Size&,
+      const delaunay::Mesh<cv::Point>&, double, const cv::Scalar&);
+  template void streamFillMesh(RowWriter&, const cv::Size&,
+      const delaunay::Mesh<cv::Point2f>&, double, const cv::Scalar&);
+  template void streamDrawMesh(RowWriter&, const cv::Size&,
+      const delaunay::Mesh<cv::Point>&, double,
+      const cv::Scalar&, const cv::Scalar&);
+  template void streamDrawMesh(RowWriter&, const cv::Size&,
+      const delaunay::Mesh<cv::Point2f>&, double,
+      const cv::Scalar&, const cv::Scalar&);
+
 }
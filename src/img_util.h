@@ -1,21 +1,205 @@
+#ifndef IMG_UTIL_H
+#define IMG_UTIL_H
+
+#include "delaunay/mesh.h"
 #include <opencv2/core.hpp>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/opencv.hpp>
+#include <atomic>
+#include <limits>
+#include <type_traits>
+
+struct RowWriter;
 
 namespace imgutil {
+  // Growable byte buffer for per-strip and per-polygon temporaries, so a run
+  // of calls allocates once instead of once per call
+  struct ScratchBuffer {
+    uchar *reserve(size_t bytes);
+    std::vector<uchar> data;
+  };
+
   std::pair<double, double> getImageRange(int type);
-  void sobelMagnitude(cv::InputArray src, cv::OutputArray dst);
+
+  // What the kernels know about a pixel type at compile time: its channel
+  // type and count, its OpenCV type and full intensity (as getImageRange)
+  template <typename ChannelT, int nChannels, int cvType>
+  struct PixelTraitsBase {
+    using Channel = ChannelT;
+    static constexpr int channels = nChannels;
+    static constexpr int type = cvType;
+    static constexpr double max = std::is_floating_point_v<ChannelT>
+      ? 1.0 : std::numeric_limits<ChannelT>::max();
+  };
+  template <typename Pixel> struct PixelTraits;
+  template <> struct PixelTraits<uchar>
+    : PixelTraitsBase<uchar, 1, CV_8UC1> {};
+  template <> struct PixelTraits<cv::Vec3b>
+    : PixelTraitsBase<uchar, 3, CV_8UC3> {};
+  template <> struct PixelTraits<ushort>
+    : PixelTraitsBase<ushort, 1, CV_16UC1> {};
+  template <> struct PixelTraits<cv::Vec3w>
+    : PixelTraitsBase<ushort, 3, CV_16UC3> {};
+  template <> struct PixelTraits<float>
+    : PixelTraitsBase<float, 1, CV_32FC1> {};
+  template <> struct PixelTraits<cv::Vec3f>
+    : PixelTraitsBase<float, 3, CV_32FC3> {};
+
+  // Calls visit(Pixel()) with the pixel type of an OpenCV type, so callers
+  // branch on the type once and run a kernel instantiation per type
+  template <typename Visitor>
+  void dispatchPixelType(int type, Visitor &&visit) {
+    switch (type) {
+      case CV_8UC1:  visit(uchar()); break;
+      case CV_8UC3:  visit(cv::Vec3b()); break;
+      case CV_16UC1: visit(ushort()); break;
+      case CV_16UC3: visit(cv::Vec3w()); break;
+      case CV_32FC1: visit(float()); break;
+      case CV_32FC3: visit(cv::Vec3f()); break;
+      default: CV_Error(cv::Error::StsUnsupportedFormat, "Unsupported type");
+    }
+  }
+
+  // The kernels below are instantiated in img_util.cpp for every Pixel of
+  // PixelTraits, and src must be of that type. Those reading an edge image
+  // take a single-channel Pixel (uchar, ushort or float) and a threshold
+  // relative to full intensity. Those taking cancel return early once it is
+  // raised, leaving dst incomplete.
+  template <typename Pixel>
+  void sobelMagnitude(
+      cv::InputArray src,
+      cv::OutputArray dst,
+      const bool normalize = true);
+  template <typename Pixel>
+  void sobelMagnitude(
+      cv::InputArray src,
+      cv::OutputArray dst,
+      ScratchBuffer &scratch,
+      const int stripRows = 64);
+  template <typename Pixel>
   void nonMaxSuppress(
       cv::InputArray src,
       cv::OutputArray dst,
       const uint kSize,
       const double threshold);
+  template <typename Pixel>
   void adaptiveNonMaxSuppress(
       cv::InputArray src,
       cv::OutputArray dst,
       const std::pair<int, int> &kernelRange,
       const double threshold);
-  void salt(cv::Mat img, const float percent);
-  cv::Scalar avgColorInPoly(cv::Mat img, std::vector<cv::Point> polygon);
+  template <typename Pixel>
+  void adaptiveNonMaxSuppress(
+      cv::InputArray src,
+      std::vector<cv::Point> &dst,
+      const std::pair<int, int> &kernelRange,
+      const double threshold,
+      const std::atomic<bool> *cancel = nullptr);
+  template <typename Pixel>
+  void pyramidVertices(
+      cv::InputArray src,
+      cv::OutputArray sobelDst,
+      cv::OutputArray vertexDst,
+      const std::pair<int, int> &kernelRange,
+      const double threshold,
+      const uint levels);
+  template <typename Pixel>
+  void gridTopK(
+      cv::InputArray src,
+      std::vector<cv::Point> &dst,
+      const std::pair<int, int> &kernelRange,
+      const uint k,
+      const double threshold);
+  // Ridges of an edge image stronger than threshold, traced into polylines
+  // of at least minLength pixels and simplified to within epsilon pixels
+  // (Douglas-Peucker), as the segments of every polyline
+  template <typename Pixel>
+  void traceContours(
+      cv::InputArray src,
+      std::vector<std::pair<cv::Point, cv::Point>> &dst,
+      const double threshold,
+      const double epsilon,
+      const double minLength);
+  // maxError is an RMS color distance in 8-bit units for any Pixel
+  template <typename Pixel>
+  void refineVertices(
+      cv::InputArray src,
+      std::vector<cv::Point> &dst,
+      const double maxError,
+      const size_t maxTriangles);
+  // Both place the same grains for the same seed
+  void salt(cv::Mat img, const float percent, uint64_t seed);
+  void salt(
+      std::vector<cv::Point> &points,
+      const cv::Size &size,
+      const float percent,
+      uint64_t seed);
+  // The mean as an 8-bit BGR color (gray replicated) for any Pixel
+  template <typename Pixel>
+  cv::Scalar avgColorInPoly(
+      cv::Mat img,
+      const cv::Point *polygon,
+      int nPoints,
+      ScratchBuffer &scratch);
+  // avgColorInPoly estimated from stratified samples of a convex polygon,
+  // their count growing with its area and then fourfold until the standard
+  // error of the mean is within tolerance (RMS, 8-bit units); polygons too
+  // small or too varied to gain from sampling are averaged exactly
+  template <typename Pixel>
+  cv::Scalar sampledColorInPoly(
+      cv::Mat img,
+      const cv::Point *polygon,
+      int nPoints,
+      double tolerance,
+      ScratchBuffer &scratch);
+  // src resized to size as 8-bit BGR (gray replicated), the backdrop a
+  // partial lowpoly is composited over
+  template <typename Pixel>
+  void toBGR8(cv::InputArray src, cv::OutputArray dst, const cv::Size &size);
+  // Both return early once cancel is raised, leaving dst partly drawn
+  template <typename PointT>
+  void fillMesh(
+      cv::Mat dst,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const std::atomic<bool> *cancel = nullptr);
+  template <typename PointT>
+  void drawMesh(
+      cv::Mat dst,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const cv::Scalar &edgeColor,
+      const cv::Scalar &vertexColor);
+  template <typename PointT>
+  void fillCells(
+      cv::Mat dst,
+      const delaunay::Cells<PointT> &cells,
+      double scale,
+      const std::atomic<bool> *cancel = nullptr);
+  template <typename PointT>
+  void drawCells(
+      cv::Mat dst,
+      const delaunay::Cells<PointT> &cells,
+      double scale,
+      const cv::Scalar &edgeColor,
+      const cv::Scalar &siteColor);
+  // Same as fillMesh/drawMesh into an image of the given size, but rendered
+  // in horizontal strips that are encoded as they complete
+  template <typename PointT>
+  void streamFillMesh(
+      RowWriter &writer,
+      const cv::Size &size,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const cv::Scalar &background);
+  template <typename PointT>
+  void streamDrawMesh(
+      RowWriter &writer,
+      const cv::Size &size,
+      const delaunay::Mesh<PointT> &mesh,
+      double scale,
+      const cv::Scalar &edgeColor,
+      const cv::Scalar &vertexColor);
 }
 
+#endif // !IMG_UTIL_H
@@ -0,0 +1,59 @@
+#include "isa.h"
+#include <atomic>
+#include <stdexcept>
+
+namespace isa {
+
+  namespace {
+
+    Level detect() {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")
+          && __builtin_cpu_supports("avx512bw")
+          && __builtin_cpu_supports("avx512vl")
+          && __builtin_cpu_supports("avx512dq"))
+        return Level::AVX512;
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+          && __builtin_cpu_supports("bmi2"))
+        return Level::AVX2;
+#endif
+      return Level::Scalar;
+    }
+
+    std::atomic<Level> selected{detected()};
+
+  }
+
+  Level detected() {
+    static const Level level = detect();
+    return level;
+  }
+
+  Level active() {
+    return selected.load(std::memory_order_relaxed);
+  }
+
+  void select(Level level) {
+    if (level > detected())
+      throw std::invalid_argument(std::string("This CPU does not support ")
+          + name(level) + " (best: " + name(detected()) + ")");
+    selected.store(level, std::memory_order_relaxed);
+  }
+
+  const char *name(Level level) {
+    switch (level) {
+      case Level::AVX512: return "avx512";
+      case Level::AVX2: return "avx2";
+      default: return "scalar";
+    }
+  }
+
+  Level parse(const std::string &text) {
+    for (Level level : { Level::Scalar, Level::AVX2, Level::AVX512 })
+      if (text == name(level))
+        return level;
+    throw std::invalid_argument("Unknown instruction set " + text);
+  }
+
+}
@@ -0,0 +1,55 @@
+#ifndef ISA_H
+#define ISA_H
+
+#include <string>
+
+// Instruction-set variants of the hot image kernels. Each kernel body is
+// compiled once per level and the best level the CPU supports is detected
+// once (CPUID); select() overrides it, e.g. to test every path on one host.
+namespace isa {
+
+  enum class Level { Scalar, AVX2, AVX512 };
+
+  // Best level this CPU (and OS) supports
+  Level detected();
+  // Level the kernels run at, detected() unless selected
+  Level active();
+  // Throws std::invalid_argument if this CPU lacks the level
+  void select(Level level);
+  const char *name(Level level);
+  // "scalar", "avx2" or "avx512"; throws std::invalid_argument otherwise
+  Level parse(const std::string &name);
+
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ISA_TARGET_AVX2 __attribute__((target("avx2,fma,bmi,bmi2")))
+#define ISA_TARGET_AVX512 __attribute__((target( \
+  "avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,bmi,bmi2")))
+#else
+#define ISA_TARGET_AVX2
+#define ISA_TARGET_AVX512
+#endif
+
+// Kernel bodies and everything they call must be inlined into each variant,
+// otherwise they run at the baseline level whatever was selected
+#define ISA_INLINE inline __attribute__((always_inline))
+
+// Defines name<T> params, running body<T> args compiled for the active level
+#define ISA_DISPATCH(T, name, body, params, args) \
+  template <typename T> \
+  void name##Scalar params { body<T> args; } \
+  template <typename T> \
+  ISA_TARGET_AVX2 void name##AVX2 params { body<T> args; } \
+  template <typename T> \
+  ISA_TARGET_AVX512 void name##AVX512 params { body<T> args; } \
+  template <typename T> \
+  void name params { \
+    switch (isa::active()) { \
+      case isa::Level::AVX512: return name##AVX512<T> args; \
+      case isa::Level::AVX2: return name##AVX2<T> args; \
+      default: return name##Scalar<T> args; \
+    } \
+  }
+
+#endif // !ISA_H
@@ -2,6 +2,8 @@
 #include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <opencv2/core.hpp>
 #include <opencv2/core/base.hpp>
 #include <opencv2/core/hal/interface.h>
@@ -23,11 +25,81 @@ inline double elapsed(
 }
 
 #include "cli_parser.h"
+#include "delaunay/thread_pool.h"
+#include "delaunay/trace.h"
+#include "image_reader.h"
 #include "img_util.h"
+#include "isa.h"
 #include "pipeline.h"
+#include "point_mode.h"
+#include "preview_worker.h"
+#include "row_writer.h"
 
 using namespace std;
 
+// Standard output gets a PPM, encoded in memory and written in one go
+void writeImage(const string &path, const cv::Mat &img) {
+  if (path != "-") {
+    cv::imwrite(path, img);
+    return;
+  }
+  vector<uchar> encoded;
+  if (!cv::imencode(".ppm", img, encoded))
+    throw runtime_error("Could not encode the output as PPM");
+  FILE *file = openOutput(path);
+  bool written = fwrite(encoded.data(), 1, encoded.size(), file)
+    == encoded.size();
+  if (fclose(file) != 0 || !written)
+    throw runtime_error("Could not write the output to standard output");
+}
+
+// Streamed outputs were already written by the pipeline as it rendered them
+void writeOutputs(const Pipeline &pipeline, const CliOptions &o) {
+  if (o.all) {
+    if (!o.silent) {
+      printf("Writing Sobel output to %s\n",
+          o.sobelPath.c_str());
+      printf("Writing vertex image to %s\n",
+          o.vertexPath.c_str());
+    }
+    tracing::Span span("write images", "io");
+    cv::imwrite(o.sobelPath, pipeline.sobelImg);
+    cv::imwrite(o.vertexPath, pipeline.vertexImg);
+    if (!o.streamOutput) {
+      if (!o.silent)
+        printf("Writing triangulation to %s\n",
+            o.triangulatedPath.c_str());
+      cv::imwrite(o.triangulatedPath, pipeline.triangulatedImg);
+    }
+  }
+  if (o.streamOutput)
+    return;
+  // Each output size is encoded on its own thread
+  for (size_t i = 0; i < pipeline.outputImgs.size() && !o.silent; i++)
+    printf("Writing lowpoly output to %s\n", o.outputPathFor(i).c_str());
+  threadpool::parallelFor(0, pipeline.outputImgs.size(), 1,
+      [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      tracing::Span span("write image", "io", i);
+      writeImage(o.outputPathFor(i), pipeline.outputImgs[i]);
+    }
+  });
+}
+
+// Called once the traced work is done
+void writeTrace(const CliOptions &o) {
+  if (o.tracePath.empty())
+    return;
+  try {
+    if (!o.silent)
+      printf("Writing trace to %s\n", o.tracePath.c_str());
+    tracing::write(o.tracePath);
+  } catch (const exception &e) {
+    cerr << "Trace Error: " << e.what() << endl;
+    exit(1);
+  }
+}
+
 int main(int argc, char *argv[]) {
 
   // Parse command-line arguments
@@ -40,19 +112,91 @@ int main(int argc, char *argv[]) {
   }
   const CliOptions &o(opts);
 
-  // Read in an image from the specified path
+  // Keep standard output for the image, moving everything printed to stderr
+  if (o.outputPath == "-") {
+    try {
+      claimStdout();
+    } catch (const exception &e) {
+      cerr << "CLI Error: " << e.what() << endl;
+      exit(1);
+    }
+  }
+
+  // Size the shared pool, and keep OpenCV's own threads to the same count
+  threadpool::configure(o.threads, o.pinThreads);
+  cv::setNumThreads(threadpool::size());
+  // Forced kernel variants; Sobel and color means run inside OpenCV, which
+  // dispatches on its own, so the scalar path switches that off as well
+  if (o.isaLevel) {
+    isa::select(*o.isaLevel);
+    if (*o.isaLevel == isa::Level::Scalar)
+      cv::setUseOptimized(false);
+  }
+  tracing::nameThread("main");
+  if (!o.tracePath.empty())
+    tracing::start();
+
+  // Point files skip the image pipeline entirely
+  if (o.points) {
+    Metrics metrics;
+    try {
+      auto start = now();
+      triangulatePointFile(o, metrics);
+      if (!o.silent) {
+        printf("⧖ Triangulated in %f seconds\n", elapsed(start));
+        metrics.print();
+      }
+    } catch (const exception &e) {
+      cerr << "Triangulation Error: " << e.what() << endl;
+      exit(1);
+    }
+    writeTrace(o);
+    return 0;
+  }
+
+  // Read in an image from the specified path, keeping 16-bit and float
+  // depths and single-channel gray as they are (the pipeline has kernels for
+  // each). A JPEG that will be shrunk anyway is decoded at 1/2, 1/4 or 1/8
+  // instead, its size (which the scales depend on) coming from the header;
+  // previews keep every pixel, since they can upscale the input later. Raw
+  // pixels and binary PGM/PPM (from a file or stdin) are mapped in place, the
+  // mapping living as long as main does.
   string basename = o.inputPath.substr(o.inputPath.find_last_of('/') + 1);
-  cv::Mat img = cv::imread(o.inputPath);
+  cv::Mat img;
+  cv::Size fullSize;
+  unique_ptr<MappedImage> mapped;
+  if (o.rawSize || isMappableImage(o.inputPath)) {
+    tracing::Span span("read image", "io");
+    try {
+      mapped = make_unique<MappedImage>(o.inputPath,
+          o.rawSize.value_or(cv::Size()));
+      img = mapped->mat();
+    } catch (const exception &e) {
+      cerr << "Image Error: " << e.what() << endl;
+      exit(1);
+    }
+  } else {
+    tracing::Span span("read image", "io");
+    const optional<JpegInfo> jpeg
+      = o.interactive ? nullopt : readJpegInfo(o.inputPath);
+    const int reduction = jpeg ? decodeReduction(jpeg->size, o) : 1;
+    if (reduction > 1) {
+      img = readReducedJpeg(o.inputPath, *jpeg, reduction);
+      fullSize = jpeg->size;
+      // Decoding applies the EXIF orientation, which the header doesn't
+      if (img.cols != (fullSize.width + reduction - 1) / reduction
+          && img.cols == (fullSize.height + reduction - 1) / reduction)
+        swap(fullSize.width, fullSize.height);
+    } else {
+      img = cv::imread(o.inputPath, cv::IMREAD_ANYDEPTH | cv::IMREAD_ANYCOLOR);
+    }
+  }
   if (img.empty()) {
     cerr << "Image Error: A readable image was not found at " + o.inputPath
       << endl;
     exit(1);
   }
 
-  // Set up the pipeline + interactive loop
-  bool again = o.interactive;
-  Pipeline pipeline;
-
   // Set up prompt for interactive
   string promptIntro = "\nIn any preview window:\n";
   string promptOpt_q = "▶ q: quit\n";
@@ -70,105 +214,105 @@ int main(int argc, char *argv[]) {
     + promptOpt_a
     + (o.targetInputWidth.has_value() ? "" : promptOpt_u)
     + (o.targetInputWidth.has_value() ? "" : promptOpt_d)
-    + (o.targetOutputWidth.has_value() ? "" : promptOpt_U)
-    + (o.targetOutputWidth.has_value() ? "" : promptOpt_D);
-
-  // Interactive state machine to preview and adjust output
-  do {
-    if (o.interactive)
-      printf("\e[2J\e[H"); // clear screen
+    + (o.targetOutputWidths.empty() ? promptOpt_U : "")
+    + (o.targetOutputWidths.empty() ? promptOpt_D : "");
 
+  if (!o.interactive) {
     // Do all the processing
+    Pipeline pipeline;
     try {
       auto start = now();
-      pipeline.process(img, basename, o);
+      // Let the pipeline drop the original
+      pipeline.process(move(img), o, nullptr, fullSize);
       if (!o.silent)
         printf("⧖ Processed in %f seconds\n", elapsed(start));
+      if (o.metrics)
+        pipeline.metrics.print();
     } catch (const exception &e) {
       cerr << "Pipeline Error: " << e.what() << endl;
       exit(1);
     }
+    try {
+      writeOutputs(pipeline, o);
+    } catch (const exception &e) {
+      cerr << "Image Error: " << e.what() << endl;
+      exit(1);
+    }
+    writeTrace(o);
+    return 0;
+  }
 
-    if (o.interactive) {
-      printf("%s", prompt.c_str());
-      char key = '_';
-      bool breakOuter;
-      while (true) { // poll keyboard input in GUI window
-        breakOuter = true;
-        key = cv::waitKey(30);
-        switch(key) {
-          case 'q':
-            cv::destroyAllWindows();
-            exit(0);
-          case 'r':
-            break;
-          case 'a':
-            opts.all = true;
-            // fall through
-          case 'w':
-            cv::destroyAllWindows();
-            if (o.all) {
-              if (!o.silent) {
-                printf("Writing Sobel output to %s\n",
-                    o.sobelPath.c_str());
-                printf("Writing vertex image to %s\n",
-                    o.vertexPath.c_str());
-                printf("Writing triangulation to %s\n",
-                    o.triangulatedPath.c_str());
-              }
-              cv::imwrite(o.sobelPath, pipeline.sobelImg);
-              cv::imwrite(o.vertexPath, pipeline.vertexImg);
-              cv::imwrite(o.triangulatedPath, pipeline.triangulatedImg);
-            }
-            if (!o.silent)
-              printf("Writing lowpoly output to %s\n", o.outputPath.c_str());
-            cv::imwrite(o.outputPath, pipeline.outputImg);
-            exit(0);
-          case 'u':
-            if (!o.targetInputWidth.has_value()) {
-              opts.preprocScale *= 2;
-              opts.saltRatio /= 2;
-            }
-            break;
-          case 'd':
-            if (!o.targetInputWidth.has_value()) {
-              opts.preprocScale /= 2;
-              opts.saltRatio *= 2;
-            }
-            break;
-          case 'U':
-            if (!o.targetOutputWidth.has_value())
-              opts.postprocScale *= 2;
-            break;
-          case 'D':
-            if (!o.targetOutputWidth.has_value())
-              opts.postprocScale /= 2;
-            break;
-          default:
-            breakOuter = false;
-            break;
-        }
-        if (breakOuter)
-          break;
+  // Interactive state machine to preview and adjust output. Processing runs in
+  // the background so the windows stay responsive; any key that changes the
+  // parameters cancels the run in flight and starts over.
+  PreviewWorker worker;
+  auto restart = [&]() {
+    printf("\e[2J\e[H"); // clear screen
+    worker.start(img, o);
+  };
+  restart();
+  while (true) {
+    try {
+      Pipeline result;
+      bool isFinal;
+      if (worker.poll(result, isFinal)) {
+        result.show(basename);
+        if (isFinal)
+          printf("%s", prompt.c_str());
       }
-    } else {
-      if (o.all) {
-        if (!o.silent) {
-          printf("Writing Sobel output to %s\n",
-              o.sobelPath.c_str());
-          printf("Writing vertex image to %s\n",
-              o.vertexPath.c_str());
-          printf("Writing triangulation to %s\n",
-              o.triangulatedPath.c_str());
+    } catch (const exception &e) {
+      cerr << "Pipeline Error: " << e.what() << endl;
+      return 1;
+    }
+    char key = cv::waitKey(30);
+    switch(key) {
+      case 'q':
+        // Returning cancels and joins the worker (see ~PreviewWorker)
+        cv::destroyAllWindows();
+        return 0;
+      case 'r':
+        restart();
+        break;
+      case 'a':
+        opts.all = true;
+        // fall through
+      case 'w':
+        cv::destroyAllWindows();
+        try {
+          writeOutputs(worker.waitFinal(), o);
+        } catch (const exception &e) {
+          cerr << "Pipeline Error: " << e.what() << endl;
+          return 1;
         }
-        cv::imwrite(o.sobelPath, pipeline.sobelImg);
-        cv::imwrite(o.vertexPath, pipeline.vertexImg);
-        cv::imwrite(o.triangulatedPath, pipeline.triangulatedImg);
-      }
-      if (!o.silent)
-        printf("Writing lowpoly output to %s\n", o.outputPath.c_str());
-      cv::imwrite(o.outputPath, pipeline.outputImg);
+        return 0;
+      case 'u':
+        if (!o.targetInputWidth.has_value()) {
+          opts.preprocScale *= 2;
+          opts.saltRatio /= 2;
+          restart();
+        }
+        break;
+      case 'd':
+        if (!o.targetInputWidth.has_value()) {
+          opts.preprocScale /= 2;
+          opts.saltRatio *= 2;
+          restart();
+        }
+        break;
+      case 'U':
+        if (o.targetOutputWidths.empty()) {
+          opts.postprocScale *= 2;
+          restart();
+        }
+        break;
+      case 'D':
+        if (o.targetOutputWidths.empty()) {
+          opts.postprocScale /= 2;
+          restart();
+        }
+        break;
+      default:
+        break;
     }
-  } while(again);
+  }
 }
-
@@ -0,0 +1,89 @@
+#include "metrics.h"
+#include "delaunay/trace.h"
+#include "isa.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <sys/resource.h>
+
+using namespace std;
+
+void Metrics::clear() {
+  stages.clear();
+  delaunay = delaunay::Stats();
+  trianglesBefore = trianglesAfter = 0;
+}
+
+void Metrics::startStage(const string &stage) {
+  stages.push_back({ stage, 0.0 });
+  stageAllocs = allocprofile::counters();
+  allocprofile::resetPeak();
+  stageStart = chrono::steady_clock::now();
+  if (tracing::enabled())
+    stageTraceStart = tracing::now();
+}
+
+void Metrics::endStage() {
+  chrono::duration<double> duration = chrono::steady_clock::now() - stageStart;
+  stages.back().seconds = duration.count();
+  if (tracing::enabled())
+    tracing::record(tracing::intern(stages.back().stage), "stage",
+        stageTraceStart, tracing::now());
+  const allocprofile::Counters allocs = allocprofile::counters();
+  stages.back().allocations = allocs.allocations - stageAllocs.allocations;
+  stages.back().allocatedBytes
+    = allocs.allocatedBytes - stageAllocs.allocatedBytes;
+  stages.back().peakLiveBytes = allocs.peakLiveBytes;
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    stages.back().peakMemoryKB = usage.ru_maxrss;
+}
+
+long Metrics::peakMemoryKB() const {
+  long peak = 0;
+  for (const auto &s : stages)
+    peak = max(peak, s.peakMemoryKB);
+  return peak;
+}
+
+void Metrics::print() const {
+  printf("\n⧖ Stage timings (seconds, peak MiB)\n");
+  double total = 0.0;
+  for (const auto &s : stages) {
+    printf("  %-24s %10.4f %10.1f\n",
+        s.stage.c_str(), s.seconds, s.peakMemoryKB / 1024.0);
+    total += s.seconds;
+  }
+  printf("  %-24s %10.4f %10.1f\n", "total", total, peakMemoryKB() / 1024.0);
+  printf("  %-24s %10s\n", "kernel variant", isa::name(isa::active()));
+  if (trianglesBefore > 0)
+    printf("  %-24s %10zu -> %zu\n", "decimated triangles", trianglesBefore,
+        trianglesAfter);
+  if (allocprofile::enabled()) {
+    printf("\n⧖ Stage allocations (count, MiB allocated, peak live MiB)\n");
+    uint64_t allocations = 0, allocatedBytes = 0, peakLiveBytes = 0;
+    for (const auto &s : stages) {
+      printf("  %-24s %10lu %10.1f %10.1f\n", s.stage.c_str(), s.allocations,
+          s.allocatedBytes / 1048576.0, s.peakLiveBytes / 1048576.0);
+      allocations += s.allocations;
+      allocatedBytes += s.allocatedBytes;
+      peakLiveBytes = max(peakLiveBytes, s.peakLiveBytes);
+    }
+    printf("  %-24s %10lu %10.1f %10.1f\n", "total", allocations,
+        allocatedBytes / 1048576.0, peakLiveBytes / 1048576.0);
+  }
+  if (!delaunay.enabled)
+    return;
+  printf("\n△ Delaunay counters\n");
+  printf("  %-24s %10lu\n", "isCCW calls", delaunay.isCCWCalls);
+  printf("  %-24s %10lu\n", "inCircle calls", delaunay.inCircleCalls);
+  printf("  %-24s %10lu\n", "edges connected", delaunay.edgesConnected);
+  printf("  %-24s %10lu\n", "edges severed", delaunay.edgesSevered);
+  printf("  %-24s %10lu\n", "longest sever walk", delaunay.longestSeverWalk);
+  printf("  %-24s %10lu\n", "peak live edges", delaunay.peakLiveEdges);
+  printf("  %-24s %10lu\n", "colinear base cases", delaunay.colinearBaseCases);
+  printf("  %-24s %10lu\n", "recursion depth", delaunay.maxDepth);
+  for (size_t i = 0; i < delaunay.mergeIterations.size(); i++)
+    printf("  merge iterations @ %-4zu %10lu\n",
+        i, delaunay.mergeIterations[i]);
+}
@@ -0,0 +1,40 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "alloc_profile.h"
+#include "delaunay/stats.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct StageMetrics {
+  std::string stage;
+  double seconds = 0.0;
+  long peakMemoryKB = 0; // process high-water mark at the end of the stage
+  // Heap traffic during the stage (LOWPOLY_ALLOC_PROFILE builds only)
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+  uint64_t peakLiveBytes = 0;
+};
+
+// Per-stage wall-clock timings and allocations plus the delaunay library's
+// counters; stages are also spans of the timeline while tracing
+struct Metrics {
+  void clear();
+  void startStage(const std::string &stage);
+  void endStage();
+  void print() const;
+  long peakMemoryKB() const;
+  std::vector<StageMetrics> stages;
+  delaunay::Stats delaunay;
+  // Triangle counts around decimation (both 0 without it)
+  size_t trianglesBefore = 0;
+  size_t trianglesAfter = 0;
+
+private:
+  std::chrono::steady_clock::time_point stageStart;
+  int64_t stageTraceStart = 0;
+  allocprofile::Counters stageAllocs;
+};
+
+#endif // !METRICS_H
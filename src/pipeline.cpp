@@ -1,38 +1,135 @@
 #include "pipeline.h"
+#include <algorithm>
+#include <ctime>
 #include <opencv2/core/base.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/opencv.hpp>
+#include <optional>
 #include <stdexcept>
+#include <string>
 #include "cli_parser.h"
 #include "delaunay/delaunay.h"
 #include "delaunay/quad_edge_ref.h"
+#include "delaunay/thread_pool.h"
+#include "delaunay/trace.h"
 #include "img_util.h"
+#include "row_writer.h"
+#include "stage_cache.h"
 
 using namespace std;
 using namespace quadedge;
 
-void Pipeline::process(
-    cv::Mat img,
-    const std::string &basename,
-    const CliOptions &o) {
-
-  const cv::Size origSize(img.size());
+// Triangles (or cells) colored per parallel chunk
+const size_t COLOR_GRAIN = 1024;
 
+std::pair<float, float> processingScales(
+    const cv::Size &origSize,
+    const CliOptions &o) {
   float inScale = o.targetInputWidth.has_value()
     ? static_cast<float>(o.targetInputWidth.value()) / origSize.width
     : o.preprocScale;
-  float outScale = o.targetOutputWidth.has_value()
-    ? static_cast<float>(o.targetOutputWidth.value()) / origSize.width
+  float outScale = !o.targetOutputWidths.empty()
+    ? static_cast<float>(o.targetOutputWidths.front()) / origSize.width
     : o.postprocScale * inScale;
+  return { inScale, outScale };
+}
+
+int decodeReduction(const cv::Size &origSize, const CliOptions &o) {
+  // Processing needs inScale of the pixels, and composites over the original
+  // (--roi/--mask) need them at every output scale
+  float needed = processingScales(origSize, o).first;
+  if (o.roi || !o.maskPath.empty()) {
+    needed = max(needed, processingScales(origSize, o).second);
+    for (size_t i = 1; i < o.targetOutputWidths.size(); i++)
+      needed = max(needed,
+          static_cast<float>(o.targetOutputWidths[i]) / origSize.width);
+  }
+  int reduction = 1;
+  while (reduction < 8 && needed * reduction * 2 <= 1.0f)
+    reduction *= 2;
+  return reduction;
+}
+
+void Pipeline::process(
+    cv::Mat img,
+    const CliOptions &o,
+    const std::atomic<bool> *cancel,
+    const cv::Size &fullSize) {
+  // The one runtime branch on the pixel type, every kernel below it is
+  // compiled for the type
+  imgutil::dispatchPixelType(img.type(), [&](auto pixel) {
+    processAs<decltype(pixel)>(std::move(img), o, cancel, fullSize);
+  });
+}
+
+template <typename Pixel>
+void Pipeline::processAs(
+    cv::Mat img,
+    const CliOptions &o,
+    const std::atomic<bool> *cancel,
+    const cv::Size &fullSize) {
+
+  // Geometry is in the original image's pixels even when img was decoded
+  // reduced, only the scale stage reads img at its own size
+  const cv::Size origSize(fullSize.empty() ? img.size() : fullSize);
+  metrics.clear();
+  // Low-memory mode drops every intermediate as soon as it is consumed
+  const bool lean = o.maxMemory;
+  imgutil::ScratchBuffer scratch;
+  // Bail out between stages (and between chunks of the long parallel ones)
+  // once the result is no longer wanted
+  auto checkpoint = [cancel]() {
+    if (cancel && cancel->load(std::memory_order_relaxed))
+      throw PipelineCancelled();
+  };
+
+  const auto [inScale, outScale] = processingScales(origSize, o);
+
+  // With --roi or --mask only that region is lowpolied, over the untouched
+  // original; the front end sees it plus a halo wide enough for the Sobel and
+  // (coarse) aNMS windows, so the cost follows the region's area
+  const bool partial = o.roi.has_value() || !o.maskPath.empty();
+  cv::Rect roi(cv::Point(0, 0), origSize);
+  cv::Mat mask;
+  if (o.roi)
+    roi &= *o.roi;
+  if (roi.empty())
+    throw std::domain_error("The --roi lies outside the image");
+  if (!o.maskPath.empty()) {
+    mask = cv::imread(o.maskPath, cv::IMREAD_GRAYSCALE);
+    if (mask.size() != origSize)
+      throw std::domain_error("The mask must be the size of the image");
+    roi = cv::boundingRect(mask(roi)) + roi.tl();
+  }
+  if (roi.empty())
+    throw std::domain_error("The mask is empty inside the image (or --roi)");
+  cv::Rect region = roi;
+  if (partial) {
+    const int halo = cvCeil(
+        (o.anmsKernelRange.second + (2 << o.pyramidLevels)) / inScale);
+    region = cv::Rect(roi.tl() - cv::Point(halo, halo),
+        roi.br() + cv::Point(halo, halo)) & cv::Rect(cv::Point(0, 0), origSize);
+  }
 
   const cv::Size inputSize(
-      origSize.width * inScale,
-      origSize.height * inScale);
+      region.width * inScale,
+      region.height * inScale);
   const cv::Size outputSize(
       origSize.width * outScale,
       origSize.height * outScale);
-  if (inputSize.width == 0 || inputSize.height == 0
-      || outputSize.width == 0 || outputSize.height == 0)
+  // Further widths are rasterized from the same mesh
+  vector<float> outScales = { outScale };
+  vector<cv::Size> outputSizes = { outputSize };
+  for (size_t i = 1; i < o.targetOutputWidths.size(); i++) {
+    outScales.push_back(
+        static_cast<float>(o.targetOutputWidths[i]) / origSize.width);
+    outputSizes.push_back({ static_cast<int>(origSize.width * outScales[i]),
+                            static_cast<int>(origSize.height * outScales[i]) });
+  }
+  for (const cv::Size &size : outputSizes)
+    if (size.width == 0 || size.height == 0)
+      throw std::domain_error("Image left empty after scaling");
+  if (inputSize.width == 0 || inputSize.height == 0)
     throw std::domain_error("Image left empty after scaling");
 
   if (!o.silent)
@@ -50,87 +147,461 @@ void Pipeline::process(
         inScale, inputSize.width, inputSize.height,
         outScale, outputSize.width, outputSize.height
   );
+  for (size_t i = 1; i < outputSizes.size() && !o.silent; i++)
+    printf("Post-process scaling: %.3f -> (%d, %d)\n",
+        outScales[i], outputSizes[i].width, outputSizes[i].height);
+  if (img.size() != origSize && !o.silent)
+    printf("Decoded reduced to (w x h): (%d, %d)\n", img.cols, img.rows);
+  if (partial && !o.silent)
+    printf("Region of interest (x, y, w, h): (%d, %d, %d, %d)\n",
+        roi.x, roi.y, roi.width, roi.height);
 
-  // Scale the input
-  cv::resize(img, inputImg, inputSize);
+  // The region in input coordinates (vertices outside it are dropped) and the
+  // mask at the same scale
+  const cv::Rect roiIn = cv::Rect(
+      cv::Point(cvFloor((roi.x - region.x) * inScale),
+                cvFloor((roi.y - region.y) * inScale)),
+      cv::Point(cvCeil((roi.br().x - region.x) * inScale),
+                cvCeil((roi.br().y - region.y) * inScale)))
+    & cv::Rect(cv::Point(0, 0), inputSize);
+  if (roiIn.empty())
+    throw std::domain_error("Region of interest left empty after scaling");
+  cv::Mat maskIn;
+  if (!mask.empty())
+    cv::resize(mask(region), maskIn, inputSize, 0, 0, cv::INTER_NEAREST);
+
+  // Scale the input (the region of it); a partial result keeps the original
+  // to be composited over
+  metrics.startStage("scale");
+  const double decodedX = static_cast<double>(img.cols) / origSize.width;
+  const double decodedY = static_cast<double>(img.rows) / origSize.height;
+  const cv::Rect decodedRegion = cv::Rect(
+      cv::Point(cvFloor(region.x * decodedX), cvFloor(region.y * decodedY)),
+      cv::Point(cvCeil(region.br().x * decodedX),
+                cvCeil(region.br().y * decodedY)))
+    & cv::Rect(cv::Point(0, 0), img.size());
+  if (decodedRegion.size() == img.size() && inputSize == img.size())
+    inputImg = img;
+  else if (inputSize == decodedRegion.size())
+    img(decodedRegion).copyTo(inputImg);
+  else
+    cv::resize(img(decodedRegion), inputImg, inputSize);
+  cv::Mat original;
+  if (partial)
+    original = img;
+  img.release();
+  metrics.endStage();
   if (!o.silent)
     printf("▲ Scaled for processing\n");
-  if (o.interactive)
-    cv::imshow(basename, inputImg);
+  checkpoint();
+
+  // Stage results are content-addressed by the input pixels plus the options
+  // each stage depends on; salt and output size are applied after lookup
+  optional<StageCache> cache;
+  CacheKey inputKey;
+  if (!o.cacheDir.empty()) {
+    cache.emplace(o.cacheDir);
+    inputKey.add(inputImg);
+  }
+  const bool pyramid
+    = o.pyramidLevels > 0 && o.vertexSelector == VertexSelector::ANMS;
+  const bool refine = o.vertexSelector == VertexSelector::Refine;
+  const bool constrain = o.constrainEpsilon > 0.0f;
+  string edgeKey, vertexKey;
+  if (cache) {
+    // Plain Sobel depends on the input alone, the pyramid also selects
+    CacheKey edge = CacheKey(inputKey).add(string("sobel"));
+    if (pyramid)
+      edge.add(o.pyramidLevels).add(o.anmsKernelRange.first)
+        .add(o.anmsKernelRange.second).add(o.edgeThreshold);
+    edgeKey = edge.hex();
+    vertexKey = CacheKey(inputKey).add(string("vertices"))
+      .add(o.vertexSelector).add(o.pyramidLevels).add(o.gridTopK)
+      .add(o.anmsKernelRange.first).add(o.anmsKernelRange.second)
+      .add(o.edgeThreshold).add(o.refineError).add(o.refineTriangles).hex();
+  }
+  // Salt follows the vertex key when caching, so a rerun salts the same
+  // points and the mesh entry (keyed on the salted vertices) still matches
+  const uint64_t saltSeed = cache
+    ? stoull(vertexKey.substr(0, 16), nullptr, 16)
+    : static_cast<uint64_t>(time(nullptr));
 
-  // Apply Sobel edge detector
-  imgutil::sobelMagnitude(inputImg, sobelImg);
+  // Apply Sobel edge detector (coarse-to-fine also selects the vertices)
+  vector<cv::Point> vertices;
+  bool vertexHit = false, edgeHit = false;
+  if (pyramid) {
+    metrics.startStage("pyramid sobel + anms");
+    vertexHit = edgeHit = cache && cache->load(vertexKey, vertices)
+      && ((lean && !constrain) || cache->load(edgeKey, sobelImg));
+    if (!vertexHit) {
+      cv::Mat pyramidImg;
+      imgutil::pyramidVertices<Pixel>(inputImg, sobelImg, pyramidImg,
+          o.anmsKernelRange, o.edgeThreshold, o.pyramidLevels);
+      cv::findNonZero(pyramidImg, vertices);
+      if (cache) {
+        cache->store(edgeKey, sobelImg);
+        cache->store(vertexKey, vertices);
+      }
+    }
+  } else {
+    metrics.startStage("sobel");
+    vertexHit = cache && cache->load(vertexKey, vertices);
+    // The edges are still needed for display unless memory is the priority
+    // (refinement works from the colors alone), and for contours
+    if ((!vertexHit && !refine) || !lean || constrain) {
+      edgeHit = cache && cache->load(edgeKey, sobelImg);
+      if (!edgeHit && lean)
+        imgutil::sobelMagnitude<Pixel>(inputImg, sobelImg, scratch);
+      else if (!edgeHit)
+        imgutil::sobelMagnitude<Pixel>(inputImg, sobelImg);
+      if (!edgeHit && cache)
+        cache->store(edgeKey, sobelImg);
+    }
+  }
+  if (edgeHit || (lean && vertexHit))
+    metrics.stages.back().stage += " (cached)";
+  metrics.endStage();
   if (!o.silent)
     printf("▲ Edges extracted\n");
-  if (o.interactive)
-    cv::imshow(basename + " - Sobel magnitude", sobelImg);
-
-  // Apply non-max suppression
-  imgutil::adaptiveNonMaxSuppress(
-      sobelImg, vertexImg, o.anmsKernelRange,o.edgeThreshold);
-  // Salt the image with extra vertices at random
-  imgutil::salt(vertexImg, o.saltRatio);
-  // Include the corners
-  float maxValue = imgutil::getImageRange(vertexImg.type()).second;
-  vertexImg.at<float>({0, 0}) =
-  vertexImg.at<float>({0, vertexImg.rows - 1}) =
-  vertexImg.at<float>({vertexImg.cols - 1, 0}) =
-  vertexImg.at<float>({vertexImg.cols - 1, vertexImg.rows - 1}) = maxValue;
-  if (o.interactive)
-    cv::imshow(basename + " - Extracted vertices", vertexImg);
-
-  // Extract vertices from the vertex image
-  vector<cv::Point> vertices;
-  cv::findNonZero(vertexImg, vertices);
+  checkpoint();
+
+  // Select vertices: adaptive non-max suppression, top-k per grid cell or
+  // greedy refinement of the worst-colored triangle
+  if (refine) {
+    metrics.startStage("refine");
+    if (!vertexHit)
+      imgutil::refineVertices<Pixel>(
+          inputImg, vertices, o.refineError, o.refineTriangles);
+  } else if (o.vertexSelector == VertexSelector::Grid) {
+    metrics.startStage("grid top-k + salt");
+    if (!vertexHit)
+      imgutil::gridTopK<float>(sobelImg, vertices,
+          o.anmsKernelRange, o.gridTopK, o.edgeThreshold);
+  } else if (pyramid) {
+    metrics.startStage("salt");
+  } else {
+    metrics.startStage("anms + salt");
+    if (!vertexHit)
+      imgutil::adaptiveNonMaxSuppress<float>(
+          sobelImg, vertices, o.anmsKernelRange, o.edgeThreshold, cancel);
+  }
+  // A cancelled selection is incomplete, so it must not reach the cache
+  checkpoint();
+  if (cache && !vertexHit && !pyramid)
+    cache->store(vertexKey, vertices);
+  if (vertexHit)
+    metrics.stages.back().stage += " (cached)";
+  // Vertices stay a point list from here on: salt with extra vertices at
+  // random (refinement placed its vertices deliberately), then the corners
+  if (!refine)
+    imgutil::salt(vertices, inputSize, o.saltRatio, saltSeed);
+  vertices.push_back({ 0, 0 });
+  vertices.push_back({ 0, inputSize.height - 1 });
+  vertices.push_back({ inputSize.width - 1, 0 });
+  vertices.push_back({ inputSize.width - 1, inputSize.height - 1 });
+  // The edges are no longer needed unless memory is not the priority (for
+  // display) or contours are traced from them
+  if (lean && !constrain)
+    sobelImg.release();
+  metrics.endStage();
+  checkpoint();
+
+  // The vertex image is only drawn to be shown or written
+  if (o.all || o.interactive) {
+    metrics.startStage("draw vertices");
+    vertexImg = cv::Mat::zeros(inputSize, CV_32F);
+    for (const auto &vertex : vertices)
+      vertexImg.at<float>(vertex) = 1.0f;
+    metrics.endStage();
+  }
   if (!o.silent)
     printf("• %zu Vertices extracted\n", vertices.size());
-  // Construct the Delaunay triangulation of the vertex set
-  QuadEdgeRef *triangulation = delaunay::triangulate(vertices);
-  vector<vector<cv::Point>> ogTriangles
-    = delaunay::extractTriangles(triangulation), upscaledTris(ogTriangles);
-  freeGraph(triangulation); // don't leak memory :)
-  if (!o.silent)
-    printf("△ %zu Triangles generated\n", ogTriangles.size());
-
-  // Scale the output back up
-  for (auto &triangle : upscaledTris)
-    for (auto &point : triangle)
-      point = point / inScale * outScale;
-
-  // Build the triangulated image (just for show)
-  triangulatedImg.create(outputSize, CV_8UC3);
-  triangulatedImg.setTo(cv::Scalar(0, 0, 0));
-  cv::drawContours(
-      triangulatedImg, upscaledTris,
-      -1, cv::Scalar(200, 100, 100), 1, cv::LINE_AA);
-  for (const auto &triangle : upscaledTris)
-    for (auto &point : triangle)
-      cv::circle(
-          triangulatedImg, point,
-          2, cv::Scalar(255, 0, 255), cv::FILLED, cv::LINE_AA);
-  if (!o.silent)
-    printf("▲ Triangulated\n");
-  if (o.interactive)
-    cv::imshow(basename + " - Triangulated", triangulatedImg);
 
-  // Mark any areas not triangulated bright red (known bug)
-  outputImg.create(outputSize, CV_8UC3);
-  outputImg.setTo(cv::Scalar(0, 0, 255));
+  // Trace strong contours into polylines whose segments become mesh edges,
+  // ignoring those short enough for a single aNMS kernel
+  vector<pair<cv::Point, cv::Point>> constraints;
+  if (constrain) {
+    metrics.startStage("trace contours");
+    imgutil::traceContours<float>(sobelImg, constraints, o.edgeThreshold,
+        o.constrainEpsilon, 2 * o.anmsKernelRange.second + 1);
+    for (const auto &[a, b] : constraints) {
+      vertices.push_back(a);
+      vertices.push_back(b);
+    }
+    if (lean)
+      sobelImg.release();
+    metrics.endStage();
+    if (!o.silent)
+      printf("• %zu Contour segments traced\n", constraints.size());
+    checkpoint();
+  }
+
+  // Only vertices (and contour segments) inside the region are meshed, plus
+  // its corners so the mesh covers all of it
+  if (partial) {
+    metrics.startStage("clip to region");
+    auto outside = [&](const cv::Point &p) {
+      return !roiIn.contains(p) || (!maskIn.empty() && !maskIn.at<uchar>(p));
+    };
+    vertices.erase(remove_if(vertices.begin(), vertices.end(), outside),
+        vertices.end());
+    constraints.erase(remove_if(constraints.begin(), constraints.end(),
+          [&](const auto &segment) {
+      return outside(segment.first) || outside(segment.second);
+    }), constraints.end());
+    vertices.push_back(roiIn.tl());
+    vertices.push_back({ roiIn.x, roiIn.y + roiIn.height - 1 });
+    vertices.push_back({ roiIn.x + roiIn.width - 1, roiIn.y });
+    vertices.push_back(roiIn.br() - cv::Point(1, 1));
+    metrics.endStage();
+    if (!o.silent)
+      printf("• %zu Vertices inside the region\n", vertices.size());
+  }
+
+  // The colored mesh depends only on the input and the final vertex set
+  string meshKey;
+  if (cache && !o.voronoi) {
+    CacheKey key = CacheKey(inputKey).add(string("mesh")).add(vertices)
+      .add(o.triangleOrder).add(o.colorTolerance).add(o.decimateTolerance);
+    for (const auto &[a, b] : constraints)
+      key.add(a).add(b);
+    meshKey = key.hex();
+  }
+  const bool meshHit = !meshKey.empty() && cache->load(meshKey, mesh);
+  // Kept until the colors are in when decimating, and freed on the way out
+  // should a stage in between throw or be cancelled
+  QuadEdgeRef<cv::Point> *triangulation = nullptr;
+  struct GraphGuard {
+    QuadEdgeRef<cv::Point> *&graph;
+    ~GraphGuard() {
+      if (graph)
+        freeGraph(graph);
+    }
+  } graphGuard { triangulation };
+  delaunay::resetStats();
+  if (meshHit) {
+    metrics.startStage("triangulate + color (cached)");
+    metrics.endStage();
+  } else {
+    // Construct the Delaunay triangulation of the vertex set
+    metrics.startStage("triangulate");
+    triangulation = delaunay::triangulate(vertices);
+    metrics.endStage();
+    if (constrain) {
+      metrics.startStage("constrain");
+      delaunay::insertConstraints(triangulation, constraints);
+      metrics.endStage();
+    }
+    if (o.voronoi) {
+      // Cells come from the dual, clipped to the pixel centers' extent
+      metrics.startStage("extract cells");
+      cells = delaunay::extractCells(triangulation, cv::Rect2d(
+            roiIn.x, roiIn.y, roiIn.width - 1, roiIn.height - 1));
+    } else {
+      metrics.startStage("extract triangles");
+      mesh = delaunay::extractTriangles(triangulation, o.triangleOrder);
+    }
+    metrics.endStage();
+    if (o.decimateTolerance <= 0.0f || o.voronoi) {
+      freeGraph(triangulation); // don't leak memory :)
+      triangulation = nullptr;
+    }
+    metrics.delaunay = delaunay::stats();
+  }
+  vector<cv::Point>().swap(vertices); // copied by triangulate
+  checkpoint();
+  if (!o.silent && o.voronoi)
+    printf("⬡ %zu Cells generated\n", cells.size());
+  else if (!o.silent)
+    printf("△ %zu Triangles generated\n", mesh.size());
+
+  // Geometry stays in input coordinates, scaling is applied at raster time
+  const double rasterScale = outScale / inScale;
+  // Where the processed region lands in an output of the given scale
+  auto regionAt = [&](const cv::Size &size, float scale) {
+    return cv::Rect(cvRound(region.x * scale), cvRound(region.y * scale),
+        cvRound(region.width * scale), cvRound(region.height * scale))
+      & cv::Rect(cv::Point(0, 0), size);
+  };
+
+  // Every pixel is averaged unless a tolerance allows sampling
+  auto colorOf = [&](const cv::Point *polygon, int nPoints,
+      imgutil::ScratchBuffer &chunkScratch) {
+    if (o.colorTolerance > 0.0f)
+      return imgutil::sampledColorInPoly<Pixel>(
+          inputImg, polygon, nPoints, o.colorTolerance, chunkScratch);
+    return imgutil::avgColorInPoly<Pixel>(
+        inputImg, polygon, nPoints, chunkScratch);
+  };
 
-  // Generate the final lowpoly output
-  for (uint i = 0; i < upscaledTris.size(); i++) {
-    const auto &ogTri = ogTriangles[i];
-    const auto &upTri = upscaledTris[i];
-    cv::Scalar color = imgutil::avgColorInPoly(inputImg, ogTri);
-    cv::fillConvexPoly(outputImg, upTri, color, cv::LINE_AA);
+  // Determine the average color in each cell, on the same path as triangles
+  if (o.voronoi) {
+    metrics.startStage("color");
+    cells.colors.assign(cells.size(), cv::Scalar(0, 0, 0));
+    threadpool::parallelFor(0, cells.size(), COLOR_GRAIN,
+        [&](size_t begin, size_t end) {
+      checkpoint();
+      tracing::Span span("color", "color", end - begin);
+      imgutil::ScratchBuffer chunkScratch;
+      vector<cv::Point> polygon;
+      for (size_t i = begin; i < end; i++) {
+        if (cells.cellSize(i) < 3)
+          continue;
+        polygon.clear();
+        for (size_t j = 0; j < cells.cellSize(i); j++)
+          polygon.push_back({ cvRound(cells.cell(i)[j].x),
+                              cvRound(cells.cell(i)[j].y) });
+        cells.colors[i] = colorOf(polygon.data(), polygon.size(),
+            chunkScratch);
+      }
+    });
+    metrics.endStage();
+  }
+
+  // Determine the average color in each triangle
+  if (!meshHit && !o.voronoi) {
+    metrics.startStage("color");
+    mesh.colors.resize(mesh.size());
+    threadpool::parallelFor(0, mesh.size(), COLOR_GRAIN,
+        [&](size_t begin, size_t end) {
+      checkpoint();
+      tracing::Span span("color", "color", end - begin);
+      imgutil::ScratchBuffer chunkScratch;
+      cv::Point triangle[3];
+      for (size_t i = begin; i < end; i++) {
+        for (int j = 0; j < 3; j++)
+          triangle[j] = mesh.vertex(i, j);
+        mesh.colors[i] = colorOf(triangle, 3, chunkScratch);
+      }
+    });
+    if (cache && !triangulation)
+      cache->store(meshKey, mesh);
+    metrics.endStage();
+  }
+
+  // Merge neighbours of (nearly) the same color, through the triangulation's
+  // own adjacency
+  if (triangulation) {
+    metrics.startStage("decimate");
+    metrics.trianglesBefore = mesh.size();
+    mesh = delaunay::decimate(triangulation, mesh, o.decimateTolerance,
+        o.triangleOrder, constraints);
+    freeGraph(triangulation);
+    triangulation = nullptr;
+    metrics.trianglesAfter = mesh.size();
+    if (cache)
+      cache->store(meshKey, mesh);
+    metrics.endStage();
+    if (!o.silent)
+      printf("△ %zu Triangles after decimation (%.1f%% fewer)\n", mesh.size(),
+          100.0 * (metrics.trianglesBefore - mesh.size())
+          / max<size_t>(metrics.trianglesBefore, 1));
+    checkpoint();
+  }
+
+  // Build the triangulated image (just for show, streamed later if requested)
+  if (!lean && !o.streamOutput) {
+    metrics.startStage("draw triangulation");
+    triangulatedImg.create(regionAt(outputSize, outScale).size(), CV_8UC3);
+    triangulatedImg.setTo(cv::Scalar(0, 0, 0));
+    if (o.voronoi)
+      imgutil::drawCells(triangulatedImg, cells, rasterScale,
+          cv::Scalar(200, 100, 100), cv::Scalar(255, 0, 255));
+    else
+      imgutil::drawMesh(triangulatedImg, mesh, rasterScale,
+          cv::Scalar(200, 100, 100), cv::Scalar(255, 0, 255));
+    metrics.endStage();
+    if (!o.silent)
+      printf("▲ Triangulated\n");
+    checkpoint();
+  }
+
+  if (lean) {
+    inputImg.release();
+    scratch.data = vector<uchar>();
+  }
+  checkpoint();
+
+  // Mark any areas not triangulated bright red (known bug); every output
+  // size is rasterized from the one mesh, in parallel
+  if (o.streamOutput) {
+    // Rasterize strip by strip straight into the encoder, never holding the
+    // full-size output (or triangulation) in memory
+    metrics.startStage("stream raster + encode");
+    for (size_t i = 0; i < outputSizes.size() && !o.silent; i++)
+      printf("Streaming lowpoly output to %s\n", o.outputPathFor(i).c_str());
+    threadpool::parallelFor(0, outputSizes.size(), 1,
+        [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+        imgutil::streamFillMesh(
+            *makeRowWriter(o.outputPathFor(i), outputSizes[i]),
+            outputSizes[i], mesh, outScales[i] / inScale,
+            cv::Scalar(0, 0, 255));
+    });
+    if (o.all) {
+      if (!o.silent)
+        printf("Streaming triangulation to %s\n", o.triangulatedPath.c_str());
+      imgutil::streamDrawMesh(*makeRowWriter(o.triangulatedPath, outputSize),
+          outputSize, mesh, rasterScale,
+          cv::Scalar(200, 100, 100), cv::Scalar(255, 0, 255));
+    }
+    metrics.endStage();
+  } else {
+    metrics.startStage("raster");
+    outputImgs.assign(outputSizes.size(), cv::Mat());
+    threadpool::parallelFor(0, outputSizes.size(), 1,
+        [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        tracing::Span span("raster", "raster", outputSizes[i].width);
+        const double scale = outScales[i] / inScale;
+        cv::Mat target;
+        if (partial) {
+          // Over the original, only within the region (and mask)
+          imgutil::toBGR8<Pixel>(original, outputImgs[i], outputSizes[i]);
+          target = outputImgs[i](regionAt(outputSizes[i], outScales[i]));
+          if (!mask.empty())
+            target = target.clone();
+        } else {
+          outputImgs[i].create(outputSizes[i], CV_8UC3);
+          outputImgs[i].setTo(cv::Scalar(0, 0, 255));
+          target = outputImgs[i];
+        }
+
+        // Generate the final lowpoly output
+        if (o.voronoi)
+          imgutil::fillCells(target, cells, scale, cancel);
+        else
+          imgutil::fillMesh(target, mesh, scale, cancel);
+        if (partial && !mask.empty()) {
+          cv::Mat view = outputImgs[i](regionAt(outputSizes[i], outScales[i]));
+          cv::Mat maskOut;
+          cv::resize(mask(region), maskOut, view.size(), 0, 0,
+              cv::INTER_NEAREST);
+          target.copyTo(view, maskOut);
+        }
+      }
+    });
+    outputImg = outputImgs.front();
+    metrics.endStage();
+    checkpoint();
   }
   if (!o.silent)
     printf("▲ Output generated\n");
-  if (o.interactive)
-    cv::imshow(basename + " - Output", outputImg);
+
+  if (lean && !o.silent)
+    printf("▲ Peak memory: %.1f MiB\n", metrics.peakMemoryKB() / 1024.0);
 
   // Convert the 32F images to 8U for writing
-  sobelImg.convertTo(sobelImg, CV_8U, 255);
-  vertexImg.convertTo(vertexImg, CV_8U, 255);
+  if (!lean) {
+    sobelImg.convertTo(sobelImg, CV_8U, 255);
+    vertexImg.convertTo(vertexImg, CV_8U, 255);
+  }
 }
 
+void Pipeline::show(const std::string &basename) const {
+  cv::imshow(basename, inputImg);
+  cv::imshow(basename + " - Sobel magnitude", sobelImg);
+  cv::imshow(basename + " - Extracted vertices", vertexImg);
+  cv::imshow(basename + " - Triangulated", triangulatedImg);
+  cv::imshow(basename + " - Output", outputImg);
+}
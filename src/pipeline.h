@@ -2,15 +2,50 @@
 #define PIPELINE_H
 
 #include "cli_parser.h"
+#include "delaunay/mesh.h"
+#include "metrics.h"
+#include <atomic>
+#include <exception>
 #include <opencv2/core/mat.hpp>
 #include <string>
+#include <utility>
+#include <vector>
+
+// Thrown by Pipeline::process when its cancel flag is raised
+struct PipelineCancelled : std::exception {
+  const char *what() const noexcept override { return "Pipeline cancelled"; }
+};
+
+// Input and output scale factors relative to the original image size
+std::pair<float, float> processingScales(
+    const cv::Size &origSize,
+    const CliOptions &o);
+
+// Largest factor (1, 2, 4 or 8) an image of this size can be decoded down by
+// without any stage needing more pixels than that leaves
+int decodeReduction(const cv::Size &origSize, const CliOptions &o);
 
 struct Pipeline {
+  // fullSize is the size img was decoded down from, if it was
   void process(
       cv::Mat img,
-      const std::string &basename,
-      const CliOptions &o);
+      const CliOptions &o,
+      const std::atomic<bool> *cancel = nullptr,
+      const cv::Size &fullSize = cv::Size());
+  void show(const std::string &basename) const;
   cv::Mat inputImg, sobelImg, vertexImg, triangulatedImg, outputImg;
+  std::vector<cv::Mat> outputImgs; // one per output width, outputImg first
+  delaunay::Mesh<cv::Point> mesh;
+  delaunay::Cells<cv::Point> cells;
+  Metrics metrics;
+
+private:
+  template <typename Pixel>
+  void processAs(
+      cv::Mat img,
+      const CliOptions &o,
+      const std::atomic<bool> *cancel,
+      const cv::Size &fullSize);
 };
 
 #endif // !PIPELINE_H
@@ -0,0 +1,48 @@
+#include "point_mode.h"
+#include "delaunay/delaunay.h"
+#include "delaunay/point_io.h"
+#include "delaunay/quad_edge_ref.h"
+#include <cstdio>
+#include <opencv2/core/types.hpp>
+
+using namespace std;
+using namespace quadedge;
+
+template <typename PointT>
+static void triangulateFile(const CliOptions &o, Metrics &metrics) {
+  metrics.clear();
+  metrics.startStage("read points");
+  delaunay::PointFile<PointT> points(o.inputPath);
+  metrics.endStage();
+  if (!o.silent)
+    printf("• %zu Points read from %s\n", points.size(), o.inputPath.c_str());
+
+  // No image involved: triangulate straight from the (mapped) file
+  delaunay::resetStats();
+  metrics.startStage("triangulate");
+  QuadEdgeRef<PointT> *triangulation
+    = delaunay::triangulate(points.data(), points.size());
+  metrics.endStage();
+  metrics.startStage("extract triangles");
+  delaunay::Mesh<PointT> mesh
+    = delaunay::extractTriangles(triangulation, o.triangleOrder);
+  metrics.endStage();
+  freeGraph(triangulation);
+  metrics.delaunay = delaunay::stats();
+  if (!o.silent)
+    printf("△ %zu Triangles from %zu vertices\n",
+        mesh.size(), mesh.vertices.size());
+
+  metrics.startStage("write mesh");
+  if (!o.silent)
+    printf("Writing mesh to %s\n", o.outputPath.c_str());
+  delaunay::writeMesh(o.outputPath, mesh);
+  metrics.endStage();
+}
+
+void triangulatePointFile(const CliOptions &o, Metrics &metrics) {
+  if (delaunay::pointFormat(o.inputPath) == delaunay::PointFormat::Int32)
+    triangulateFile<cv::Point>(o, metrics);
+  else
+    triangulateFile<cv::Point2d>(o, metrics);
+}
@@ -0,0 +1,13 @@
+#ifndef POINT_MODE_H
+#define POINT_MODE_H
+
+#include "cli_parser.h"
+#include "metrics.h"
+
+// Triangulation-only mode (--points): the input is a point file instead of an
+// image, and the index mesh is written instead of a rendering. Points in
+// .i32 files are triangulated with exact integer predicates, all others as
+// cv::Point2d.
+void triangulatePointFile(const CliOptions &o, Metrics &metrics);
+
+#endif // !POINT_MODE_H
@@ -0,0 +1,122 @@
+#include "preview_worker.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+using namespace std;
+
+// Width of the quick first pass (skipped when the real input is not much wider)
+const uint PREVIEW_WIDTH = 320;
+
+PreviewWorker::~PreviewWorker() {
+  {
+    lock_guard<std::mutex> lock(stateMutex);
+    if (cancelCurrent)
+      cancelCurrent->store(true);
+  }
+  for (auto &[thread, done] : threads)
+    thread.join();
+}
+
+void PreviewWorker::start(const cv::Mat &img, const CliOptions &o) {
+  lock_guard<std::mutex> lock(stateMutex);
+  if (cancelCurrent)
+    cancelCurrent->store(true);
+  reapFinished();
+  cancelCurrent = make_shared<atomic<bool>>(false);
+  hasLatest = latestFinal = finalReady = false;
+  error = nullptr;
+  auto done = make_shared<atomic<bool>>(false);
+  threads.emplace_back(
+      [this, job = ++currentJob, img, o, cancel = cancelCurrent, done]() {
+        run(job, img, o, cancel);
+        done->store(true);
+      },
+      done);
+}
+
+bool PreviewWorker::poll(Pipeline &result, bool &isFinal) {
+  lock_guard<std::mutex> lock(stateMutex);
+  if (error)
+    rethrow_exception(exchange(error, nullptr));
+  if (!hasLatest)
+    return false;
+  result = latest;
+  isFinal = latestFinal;
+  hasLatest = false;
+  return true;
+}
+
+Pipeline PreviewWorker::waitFinal() {
+  unique_lock<std::mutex> lock(stateMutex);
+  finished.wait(lock, [this]() { return finalReady || error; });
+  if (error)
+    rethrow_exception(exchange(error, nullptr));
+  return finalResult;
+}
+
+void PreviewWorker::run(
+    uint64_t job,
+    cv::Mat img,
+    CliOptions o,
+    shared_ptr<atomic<bool>> cancel) {
+  try {
+    // Quick pass: small input, same output size so the windows refine in place
+    const auto [inScale, outScale] = processingScales(img.size(), o);
+    const uint inputWidth = img.cols * inScale;
+    if (inputWidth > 2 * PREVIEW_WIDTH) {
+      CliOptions quick = o;
+      quick.silent = true;
+      quick.targetInputWidth = PREVIEW_WIDTH;
+      quick.targetOutputWidths = { max(1u, static_cast<uint>(img.cols * outScale)) };
+      quick.saltRatio = min(1.0f,
+          o.saltRatio * static_cast<float>(inputWidth) / PREVIEW_WIDTH);
+      Pipeline preview;
+      preview.process(img, quick, cancel.get());
+      publish(job, preview, false);
+    }
+    // Full-resolution pass
+    auto start = chrono::steady_clock::now();
+    Pipeline pipeline;
+    pipeline.process(img, o, cancel.get());
+    if (!o.silent) {
+      chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+      printf("⧖ Processed in %f seconds\n", seconds.count());
+    }
+    if (o.metrics)
+      pipeline.metrics.print();
+    publish(job, pipeline, true);
+  } catch (const PipelineCancelled &) {
+    // Superseded by a newer job, nothing to report
+  } catch (...) {
+    lock_guard<std::mutex> lock(stateMutex);
+    if (job == currentJob)
+      error = current_exception();
+    finished.notify_all();
+  }
+}
+
+void PreviewWorker::publish(uint64_t job, Pipeline &result, bool isFinal) {
+  lock_guard<std::mutex> lock(stateMutex);
+  if (job != currentJob)
+    return; // stale
+  latest = result;
+  hasLatest = true;
+  latestFinal = isFinal;
+  if (isFinal) {
+    finalResult = result;
+    finalReady = true;
+    finished.notify_all();
+  }
+}
+
+void PreviewWorker::reapFinished() {
+  for (auto it = threads.begin(); it != threads.end();) {
+    if (it->second->load()) {
+      it->first.join();
+      it = threads.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef PREVIEW_WORKER_H
+#define PREVIEW_WORKER_H
+
+#include "cli_parser.h"
+#include "pipeline.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <thread>
+#include <vector>
+
+// Runs the pipeline off the UI thread: a quick low-resolution pass followed by
+// the full-resolution pass. Starting a new job cancels the one in flight.
+struct PreviewWorker {
+  ~PreviewWorker();
+  void start(const cv::Mat &img, const CliOptions &o);
+  // Takes the newest result not yet taken (UI thread, non-blocking)
+  bool poll(Pipeline &result, bool &isFinal);
+  // Blocks until the current job's full-resolution result is available
+  Pipeline waitFinal();
+
+private:
+  void run(
+      uint64_t job,
+      cv::Mat img,
+      CliOptions o,
+      std::shared_ptr<std::atomic<bool>> cancel);
+  void publish(uint64_t job, Pipeline &result, bool isFinal);
+  void reapFinished();
+
+  std::mutex stateMutex;
+  std::condition_variable finished;
+  uint64_t currentJob = 0;
+  std::shared_ptr<std::atomic<bool>> cancelCurrent;
+  // Cancelled workers run to their next cancel check in the background
+  std::vector<std::pair<std::thread, std::shared_ptr<std::atomic<bool>>>>
+    threads;
+  Pipeline latest;
+  bool hasLatest = false, latestFinal = false, finalReady = false;
+  Pipeline finalResult;
+  std::exception_ptr error;
+};
+
+#endif // !PREVIEW_WORKER_H
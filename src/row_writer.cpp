@@ -0,0 +1,202 @@
+#include "row_writer.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+// Size of each deflate output buffer (and so the largest IDAT chunk)
+const size_t PNG_CHUNK_BYTES = 1 << 16;
+
+static string lowerExtension(const string &path) {
+  size_t dot = path.find_last_of('.');
+  size_t lastSlash = path.find_last_of('/');
+  if (dot == string::npos || (lastSlash != string::npos && dot < lastSlash))
+    return "";
+  string ext = path.substr(dot + 1);
+  transform(ext.begin(), ext.end(), ext.begin(),
+      [](unsigned char c) { return tolower(c); });
+  return ext;
+}
+
+// Descriptor of the original standard output once claimed
+static int imageFd = -1;
+
+void claimStdout() {
+  fflush(stdout);
+  imageFd = dup(STDOUT_FILENO);
+  if (imageFd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    throw runtime_error("Cannot claim standard output");
+}
+
+FILE *openOutput(const string &path) {
+  if (path != "-")
+    return fopen(path.c_str(), "wb");
+  // Closing the stream leaves the claimed descriptor for later outputs
+  const int fd = imageFd < 0 ? -1 : dup(imageFd);
+  return fd < 0 ? nullptr : fdopen(fd, "wb");
+}
+
+bool isStreamableFormat(const string &path) {
+  string ext = lowerExtension(path);
+  return ext == "png" || ext == "ppm" || ext == "pnm" || path == "-";
+}
+
+unique_ptr<RowWriter> makeRowWriter(const string &path, const cv::Size &size) {
+  string ext = lowerExtension(path);
+  if (ext == "png")
+    return make_unique<PngRowWriter>(path, size);
+  if (ext == "ppm" || ext == "pnm" || path == "-")
+    return make_unique<PpmRowWriter>(path, size);
+  throw invalid_argument("No streaming encoder for " + path
+      + " (use .png or .ppm)");
+}
+
+void RowWriter::writeRows(const cv::Mat &rows) {
+  CV_Assert(rows.type() == CV_8UC3);
+  for (int r = 0; r < rows.rows; r++)
+    writeRow(rows.ptr<uchar>(r));
+}
+
+// Swap BGR to RGB
+inline void toRGB(const uchar *bgr, uchar *rgb, int width) {
+  for (int c = 0; c < width; c++) {
+    rgb[3 * c] = bgr[3 * c + 2];
+    rgb[3 * c + 1] = bgr[3 * c + 1];
+    rgb[3 * c + 2] = bgr[3 * c];
+  }
+}
+
+inline void putBigEndian(uchar *dst, uint32_t value) {
+  dst[0] = value >> 24;
+  dst[1] = value >> 16;
+  dst[2] = value >> 8;
+  dst[3] = value;
+}
+
+PngRowWriter::PngRowWriter(const string &path, const cv::Size &size)
+  : path(path),
+    size(size),
+    file(openOutput(path)),
+    row(1 + 3 * size.width),
+    compressed(PNG_CHUNK_BYTES) {
+  if (!file)
+    throw runtime_error("Could not open " + path + " for writing");
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    fclose(file);
+    throw runtime_error("Could not initialize zlib");
+  }
+  const uchar signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  write(signature, sizeof(signature));
+  // 8 bits per channel, RGB, default compression/filtering, not interlaced
+  uchar header[13] = { 0 };
+  putBigEndian(header, size.width);
+  putBigEndian(header + 4, size.height);
+  header[8] = 8;
+  header[9] = 2;
+  writeChunk("IHDR", header, sizeof(header));
+}
+
+PngRowWriter::~PngRowWriter() {
+  if (!finished) {
+    deflateEnd(&stream);
+    fclose(file);
+  }
+}
+
+void PngRowWriter::writeRow(const uchar *bgr) {
+  if (rowsWritten == size.height)
+    throw logic_error("More rows written than the image has");
+  uchar *rgb = row.data() + 1;
+  toRGB(bgr, rgb, size.width);
+  // Sub filter (difference from the pixel to the left), applied back to
+  // front so the left neighbours are still raw; flat triangles become zeros
+  row[0] = 1;
+  for (int i = 3 * size.width - 1; i >= 3; i--)
+    rgb[i] -= rgb[i - 3];
+  compress(row.data(), row.size(), Z_NO_FLUSH);
+  rowsWritten++;
+}
+
+void PngRowWriter::finish() {
+  if (rowsWritten != size.height)
+    throw logic_error("Fewer rows written than the image has");
+  compress(nullptr, 0, Z_FINISH);
+  deflateEnd(&stream);
+  writeChunk("IEND", nullptr, 0);
+  finished = true;
+  if (fclose(file) != 0)
+    throw runtime_error("Failed writing " + path);
+}
+
+void PngRowWriter::compress(const uchar *data, size_t length, int flush) {
+  stream.next_in = const_cast<Bytef*>(data);
+  stream.avail_in = length;
+  do {
+    stream.next_out = compressed.data();
+    stream.avail_out = compressed.size();
+    if (deflate(&stream, flush) == Z_STREAM_ERROR)
+      throw runtime_error("zlib failed compressing " + path);
+    size_t produced = compressed.size() - stream.avail_out;
+    if (produced > 0)
+      writeChunk("IDAT", compressed.data(), produced);
+  } while (stream.avail_out == 0);
+}
+
+void PngRowWriter::writeChunk(
+    const char *type,
+    const uchar *data,
+    size_t length) {
+  uchar buffer[4];
+  putBigEndian(buffer, length);
+  write(buffer, 4);
+  write(type, 4);
+  uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+  if (length > 0) {
+    write(data, length);
+    crc = crc32(crc, data, length);
+  }
+  putBigEndian(buffer, crc);
+  write(buffer, 4);
+}
+
+void PngRowWriter::write(const void *data, size_t length) {
+  if (fwrite(data, 1, length, file) != length)
+    throw runtime_error("Failed writing " + path);
+}
+
+PpmRowWriter::PpmRowWriter(const string &path, const cv::Size &size)
+  : path(path),
+    size(size),
+    file(openOutput(path)),
+    row(3 * size.width) {
+  if (!file)
+    throw runtime_error("Could not open " + path + " for writing");
+  fprintf(file, "P6\n%d %d\n255\n", size.width, size.height);
+}
+
+PpmRowWriter::~PpmRowWriter() {
+  if (file)
+    fclose(file);
+}
+
+void PpmRowWriter::writeRow(const uchar *bgr) {
+  if (rowsWritten == size.height)
+    throw logic_error("More rows written than the image has");
+  toRGB(bgr, row.data(), size.width);
+  if (fwrite(row.data(), 1, row.size(), file) != row.size())
+    throw runtime_error("Failed writing " + path);
+  rowsWritten++;
+}
+
+void PpmRowWriter::finish() {
+  if (rowsWritten != size.height)
+    throw logic_error("Fewer rows written than the image has");
+  int status = fclose(file);
+  file = nullptr;
+  if (status != 0)
+    throw runtime_error("Failed writing " + path);
+}
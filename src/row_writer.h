@@ -0,0 +1,69 @@
+#ifndef ROW_WRITER_H
+#define ROW_WRITER_H
+
+#include <cstdio>
+#include <memory>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Encodes an 8-bit BGR image top to bottom as its rows arrive, so the whole
+// image never has to be held in memory
+struct RowWriter {
+  virtual ~RowWriter() = default;
+  virtual void writeRow(const uchar *bgr) = 0;
+  virtual void finish() = 0;
+  void writeRows(const cv::Mat &rows);
+};
+
+// RGB PNG, deflated incrementally into a sequence of IDAT chunks
+struct PngRowWriter : RowWriter {
+  PngRowWriter(const std::string &path, const cv::Size &size);
+  ~PngRowWriter() override;
+  void writeRow(const uchar *bgr) override;
+  void finish() override;
+
+private:
+  void compress(const uchar *data, size_t length, int flush);
+  void writeChunk(const char *type, const uchar *data, size_t length);
+  void write(const void *data, size_t length);
+  std::string path;
+  cv::Size size;
+  FILE *file;
+  z_stream stream;
+  std::vector<uchar> row, compressed;
+  int rowsWritten = 0;
+  bool finished = false;
+};
+
+// Binary PPM (P6), rows written as-is
+struct PpmRowWriter : RowWriter {
+  PpmRowWriter(const std::string &path, const cv::Size &size);
+  ~PpmRowWriter() override;
+  void writeRow(const uchar *bgr) override;
+  void finish() override;
+
+private:
+  std::string path;
+  cv::Size size;
+  FILE *file;
+  std::vector<uchar> row;
+  int rowsWritten = 0;
+};
+
+// "-" as an output path is standard output, which takes a binary PPM.
+// claimStdout() reserves it for the image, sending everything else printed
+// to stdout (progress, metrics) to stderr instead.
+void claimStdout();
+// fopen(path, "wb"), or the claimed standard output for "-"
+FILE *openOutput(const std::string &path);
+
+// Whether the extension of path has a row encoder (.png, .ppm or .pnm, and
+// "-")
+bool isStreamableFormat(const std::string &path);
+std::unique_ptr<RowWriter> makeRowWriter(
+    const std::string &path,
+    const cv::Size &size);
+
+#endif // !ROW_WRITER_H
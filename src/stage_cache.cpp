@@ -0,0 +1,213 @@
+#include "stage_cache.h"
+#include "delaunay/trace.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t finalize(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+CacheKey &CacheKey::add(const void *data, size_t n) {
+  const unsigned char *bytes = static_cast<const unsigned char*>(data);
+  // Two independently mixed lanes, one 8-byte word at a time (tail padded)
+  for (size_t i = 0; i < n; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, bytes + i, min<size_t>(8, n - i));
+    lanes[0] = rotl((lanes[0] ^ word) * 0x9e3779b97f4a7c15ULL, 31);
+    lanes[1] = rotl(lanes[1] + word * 0xc2b2ae3d27d4eb4fULL, 27)
+      * 0x165667b19e3779f9ULL;
+  }
+  length += n;
+  return *this;
+}
+
+CacheKey &CacheKey::add(const string &text) {
+  add(text.size());
+  return add(text.data(), text.size());
+}
+
+CacheKey &CacheKey::add(const cv::Mat &mat) {
+  add(mat.rows);
+  add(mat.cols);
+  add(mat.type());
+  const size_t rowBytes = mat.cols * mat.elemSize();
+  for (int r = 0; r < mat.rows; r++)
+    add(mat.ptr(r), rowBytes);
+  return *this;
+}
+
+string CacheKey::hex() const {
+  char buffer[33];
+  snprintf(buffer, sizeof(buffer), "%016llx%016llx",
+      static_cast<unsigned long long>(finalize(lanes[0] ^ length)),
+      static_cast<unsigned long long>(finalize(lanes[1] + length)));
+  return buffer;
+}
+
+// Every entry starts with this, followed by its payload arrays
+struct EntryHeader {
+  char magic[4];
+  uint32_t kind;
+  uint64_t counts[3];
+};
+
+const char ENTRY_MAGIC[4] = { 'L', 'P', 'C', '1' };
+enum EntryKind : uint32_t { MAT = 1, POINTS = 2, MESH = 3 };
+
+static const char *extension(EntryKind kind) {
+  switch (kind) {
+    case MAT: return ".mat";
+    case POINTS: return ".points";
+    default: return ".mesh";
+  }
+}
+
+// Maps the entry read-only and hands its header and payload to read, which
+// returns false if they are inconsistent (treated as a miss)
+template <typename Read>
+bool readEntry(const string &path, EntryKind kind, Read read) {
+  tracing::Span span("cache read", "io");
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0
+      || static_cast<size_t>(info.st_size) < sizeof(EntryHeader)) {
+    close(fd);
+    return false;
+  }
+  const size_t size = info.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+  EntryHeader header;
+  memcpy(&header, mapped, sizeof(header));
+  const char *payload = static_cast<const char*>(mapped) + sizeof(header);
+  bool ok = memcmp(header.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) == 0
+    && header.kind == kind
+    && read(header, payload, size - sizeof(header));
+  munmap(mapped, size);
+  return ok;
+}
+
+// Writes header + payload arrays to a unique temporary file, then renames it
+// over path (atomic on POSIX, so readers see the old entry or the new one)
+static void writeEntry(
+    const string &path,
+    EntryKind kind,
+    const uint64_t (&counts)[3],
+    const vector<pair<const void*, size_t>> &arrays) {
+  tracing::Span span("cache write", "io");
+  static atomic<uint64_t> serial(0);
+  const string tmpPath = path + ".tmp." + to_string(getpid()) + "."
+    + to_string(serial++);
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (!file)
+    return;
+  EntryHeader header;
+  memcpy(header.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+  header.kind = kind;
+  memcpy(header.counts, counts, sizeof(header.counts));
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (const auto &[data, bytes] : arrays)
+    ok = ok && (bytes == 0 || fwrite(data, 1, bytes, file) == bytes);
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+    remove(tmpPath.c_str());
+}
+
+StageCache::StageCache(const string &dir) : dir(dir) {
+  error_code error;
+  filesystem::create_directories(dir, error);
+  if (!filesystem::is_directory(dir))
+    throw runtime_error("Cache directory " + dir + " is not usable");
+}
+
+bool StageCache::load(const string &key, cv::Mat &mat) const {
+  return readEntry(dir + "/" + key + extension(MAT), MAT,
+      [&](const EntryHeader &h, const char *payload, size_t bytes) {
+        const int rows = h.counts[0], cols = h.counts[1], type = h.counts[2];
+        if (rows < 0 || cols < 0
+            || bytes != static_cast<size_t>(rows) * cols * CV_ELEM_SIZE(type))
+          return false;
+        // Copy out of the mapping so the result outlives it
+        cv::Mat(rows, cols, type, const_cast<char*>(payload)).copyTo(mat);
+        return true;
+      });
+}
+
+bool StageCache::load(const string &key, vector<cv::Point> &points) const {
+  return readEntry(dir + "/" + key + extension(POINTS), POINTS,
+      [&](const EntryHeader &h, const char *payload, size_t bytes) {
+        if (bytes != h.counts[0] * sizeof(cv::Point))
+          return false;
+        const cv::Point *first = reinterpret_cast<const cv::Point*>(payload);
+        points.assign(first, first + h.counts[0]);
+        return true;
+      });
+}
+
+bool StageCache::load(const string &key, delaunay::Mesh<cv::Point> &mesh) const {
+  return readEntry(dir + "/" + key + extension(MESH), MESH,
+      [&](const EntryHeader &h, const char *payload, size_t bytes) {
+        const size_t nVertices = h.counts[0], nIndices = h.counts[1];
+        const size_t nColors = h.counts[2];
+        if (bytes != nVertices * sizeof(cv::Point)
+            + nIndices * sizeof(uint32_t) + nColors * sizeof(cv::Scalar))
+          return false;
+        // Widest elements first so every array stays aligned in the mapping
+        const cv::Scalar *colors = reinterpret_cast<const cv::Scalar*>(payload);
+        payload += nColors * sizeof(cv::Scalar);
+        const cv::Point *vertices = reinterpret_cast<const cv::Point*>(payload);
+        payload += nVertices * sizeof(cv::Point);
+        const uint32_t *indices = reinterpret_cast<const uint32_t*>(payload);
+        for (size_t i = 0; i < nIndices; i++)
+          if (indices[i] >= nVertices)
+            return false;
+        mesh.vertices.assign(vertices, vertices + nVertices);
+        mesh.indices.assign(indices, indices + nIndices);
+        mesh.colors.assign(colors, colors + nColors);
+        return true;
+      });
+}
+
+void StageCache::store(const string &key, const cv::Mat &mat) const {
+  cv::Mat continuous = mat.isContinuous() ? mat : mat.clone();
+  writeEntry(dir + "/" + key + extension(MAT), MAT,
+      { static_cast<uint64_t>(mat.rows), static_cast<uint64_t>(mat.cols),
+        static_cast<uint64_t>(mat.type()) },
+      { { continuous.data, continuous.total() * continuous.elemSize() } });
+}
+
+void StageCache::store(const string &key, const vector<cv::Point> &points) const {
+  writeEntry(dir + "/" + key + extension(POINTS), POINTS,
+      { points.size(), 0, 0 },
+      { { points.data(), points.size() * sizeof(cv::Point) } });
+}
+
+void StageCache::store(
+    const string &key,
+    const delaunay::Mesh<cv::Point> &mesh) const {
+  writeEntry(dir + "/" + key + extension(MESH), MESH,
+      { mesh.vertices.size(), mesh.indices.size(), mesh.colors.size() },
+      { { mesh.colors.data(), mesh.colors.size() * sizeof(cv::Scalar) },
+        { mesh.vertices.data(), mesh.vertices.size() * sizeof(cv::Point) },
+        { mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t) } });
+}
@@ -0,0 +1,53 @@
+#ifndef STAGE_CACHE_H
+#define STAGE_CACHE_H
+
+#include "delaunay/mesh.h"
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Incremental 128-bit content hash of everything a stage result depends on,
+// rendered as a hex string to name the cache entry
+struct CacheKey {
+  CacheKey &add(const void *data, size_t length);
+  CacheKey &add(const std::string &text);
+  CacheKey &add(const cv::Mat &mat);
+  template <typename T>
+  CacheKey &add(const std::vector<T> &values) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    add(values.size());
+    return add(values.data(), values.size() * sizeof(T));
+  }
+  template <typename T>
+  CacheKey &add(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    return add(&value, sizeof(T));
+  }
+  std::string hex() const;
+
+private:
+  uint64_t lanes[2] = { 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL };
+  uint64_t length = 0;
+};
+
+// Directory of stage results named by their CacheKey. Entries are written to
+// a temporary file and renamed into place, so concurrent processes sharing a
+// directory only ever see complete entries; hits are read through mmap.
+// Failing to write an entry is not an error (it just misses next time).
+struct StageCache {
+  explicit StageCache(const std::string &dir);
+  bool load(const std::string &key, cv::Mat &mat) const;
+  bool load(const std::string &key, std::vector<cv::Point> &points) const;
+  bool load(const std::string &key, delaunay::Mesh<cv::Point> &mesh) const;
+  void store(const std::string &key, const cv::Mat &mat) const;
+  void store(const std::string &key, const std::vector<cv::Point> &points) const;
+  void store(const std::string &key, const delaunay::Mesh<cv::Point> &mesh) const;
+
+private:
+  std::string dir;
+};
+
+#endif // !STAGE_CACHE_H
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <opencv2/core.hpp>
@@ -13,22 +16,27 @@
 #include <unordered_set>
 #include <vector>
 #include "delaunay/delaunay.h"
+#include "delaunay/point_io.h"
 #include "delaunay/quad_edge_ref.h"
+#include "delaunay/thread_pool.h"
+#include "delaunay/trace.h"
 
 using namespace std;
 using namespace quadedge;
 
+using Edge = QuadEdgeRef<cv::Point>;
+
 void testSingleQuadEdge() {
   cout << "Testing a single QuadEdgeRef..." << endl;
-  QuadEdgeRef *quadEdge = makeQuadEdge({0,0}, {1,2});
+  Edge *quadEdge = makeQuadEdge(cv::Point(0,0), cv::Point(1,2));
 
-  QuadEdgeRef *self = quadEdge;
+  Edge *self = quadEdge;
   assert(self != nullptr);
-  QuadEdgeRef *rot = self->rot;
+  Edge *rot = self->rot;
   assert(rot != nullptr);
-  QuadEdgeRef *sym = rot->rot;
+  Edge *sym = rot->rot;
   assert(sym != nullptr);
-  QuadEdgeRef *tor = sym->rot;
+  Edge *tor = sym->rot;
   assert(tor != nullptr);
   assert(tor->rot == self);
   cout << "✅  Verified circularity of rotations" << endl;
@@ -39,10 +47,11 @@ void testSingleQuadEdge() {
   assert(self->sym()->rot == tor);
   cout << "✅  Verified basic structure" << endl;
 
-  assert(self->origCoords == cv::Point(0,0));
+  assert(self->origCoords() == cv::Point(0,0));
   assert(self->termCoords() == cv::Point(1,2));
-  assert(!rot->origCoords.has_value());
-  assert(!rot->termCoords().has_value());
+  assert(self->isPrimal() && sym->isPrimal());
+  assert(!rot->isPrimal() && !tor->isPrimal());
+  assert(self->quad() == rot->quad() && sym->quad() == tor->quad());
   cout << "✅  Verified coordinates" << endl;
 
   assert(self->onext == self);
@@ -57,11 +66,11 @@ void testSingleQuadEdge() {
 
 void testTriangle() {
   cout << "Testing a triangle..." << endl;
-  QuadEdgeRef *e1 = makeTriangle({0,0}, {0,2}, {1,1});
+  Edge *e1 = makeTriangle(cv::Point(0,0), cv::Point(0,2), cv::Point(1,1));
   assert(e1->lnext()->lnext()->lnext() == e1);
   cout << "✅  Verified triangular connnectivity" << endl;
 
-  QuadEdgeRef *e2 = e1->lnext(), *e3 = e2->lnext();
+  Edge *e2 = e1->lnext(), *e3 = e2->lnext();
   assert(e1->rot == e2->rot->onext);
   assert(e2->rot == e3->rot->onext);
   assert(e3->rot == e1->rot->onext);
@@ -77,13 +86,13 @@ void testTriangle() {
 void testPolygon() {
   cout << "Testing a polygon..." << endl;
   vector<cv::Point> points = { {0,0}, {0,2}, {1,1}, {2,0} };
-  QuadEdgeRef *e1 = makePolygon(points), *e = e1;
+  Edge *e1 = makePolygon(points), *e = e1;
   for (uint i = 0; i < points.size(); i++)
     e = e->lnext();
   assert(e == e1);
   cout << "✅  Verified polygon connnectivity" << endl;
 
-  QuadEdgeRef *e2 = e1->lnext();
+  Edge *e2 = e1->lnext();
   for (uint i = 0; i < points.size(); i++) {
     assert(e1->rot == e2->rot->onext);
     assert(e1->rot->sym() == e2->rot->sym()->oprev());
@@ -97,13 +106,13 @@ void testPolygon() {
 
 void testConnect() {
   cout << "Test connecting a new edge..." << endl;
-  QuadEdgeRef *quadrangle = makePolygon({ {0,0}, {0,2}, {1,3}, {2,2}, {2,0} });
-  QuadEdgeRef *ab = quadrangle,
+  Edge *quadrangle = makePolygon<cv::Point>({ {0,0}, {0,2}, {1,3}, {2,2}, {2,0} });
+  Edge *ab = quadrangle,
               *bc = ab->lnext(),
               *cd = bc->lnext(),
               *de = cd->lnext(),
               *ea = de->lnext();
-  QuadEdgeRef *ad = connect(ab->sym(), cd->sym());
+  Edge *ad = connect(ab->sym(), cd->sym());
   assert(ad->onext == ab);
   assert(ad == ea->sym()->onext);
   assert(ad->sym()->onext == de);
@@ -116,13 +125,27 @@ void testConnect() {
 
 void testInCircle() {
   cout << "Testing InCircle..." << endl;
-  assert(delaunay::inCircle({2,2}, {6,0}, {8,6}, {4,2}));
-  assert(delaunay::inCircle({2,2}, {8,6}, {6,0}, {4,2}));
-  assert(!delaunay::inCircle({2,2}, {6,0}, {8,6}, {5,8}));
-  assert(!delaunay::inCircle({2,2}, {8,6}, {6,0}, {5,8}));
+  assert(delaunay::inCircle<cv::Point>({2,2}, {6,0}, {8,6}, {4,2}));
+  assert(delaunay::inCircle<cv::Point>({2,2}, {8,6}, {6,0}, {4,2}));
+  assert(!delaunay::inCircle<cv::Point>({2,2}, {6,0}, {8,6}, {5,8}));
+  assert(!delaunay::inCircle<cv::Point>({2,2}, {8,6}, {6,0}, {5,8}));
   cout << "✅  Verified circle test" << endl;
 }
 
+void testSubPixel() {
+  cout << "Testing sub-pixel triangulation..." << endl;
+  vector<cv::Point2f> points = { {0.25f,0.5f}, {0.75f,0.5f}, {0.5f,0.1f},
+                                 {0.5f,0.9f} };
+  QuadEdgeRef<cv::Point2f> *graph = delaunay::triangulate(points);
+  delaunay::Mesh<cv::Point2f> mesh = delaunay::extractTriangles(graph);
+  freeGraph(graph);
+  assert(mesh.size() == 2);
+  assert(mesh.vertices.size() == 4);
+  for (const auto &vertex : mesh.vertices)
+    assert(find(points.begin(), points.end(), vertex) != points.end());
+  cout << "✅  Verified vertices are not rounded" << endl;
+}
+
 struct PointHash {
   size_t operator()(const cv::Point &p) const {
     return hasher(to_string(p.x) + to_string(p.y));
@@ -130,13 +153,291 @@ struct PointHash {
   hash<string> hasher;
 };
 
-int main () {
+void testVoronoiCells() {
+  cout << "Testing Voronoi cells from the dual..." << endl;
+  vector<cv::Point> points = { {0,0}, {4,0}, {0,4}, {4,4}, {2,2} };
+  QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+  delaunay::Cells<cv::Point> cells
+    = delaunay::extractCells(graph, cv::Rect2d(0, 0, 4, 4));
+  freeGraph(graph);
+  assert(cells.size() == 5);
+  double total = 0.0;
+  for (size_t i = 0; i < cells.size(); i++) {
+    const cv::Point2d *cell = cells.cell(i);
+    const size_t n = cells.cellSize(i);
+    double area = 0.0;
+    for (size_t j = 0; j < n; j++)
+      area += cell[j].x * cell[(j+1) % n].y - cell[(j+1) % n].x * cell[j].y;
+    area /= 2;
+    // The center's cell is the diamond of circumcenters, corners get the rest
+    assert(abs(area - (cells.sites[i] == cv::Point(2,2) ? 8.0 : 2.0)) < 1e-9);
+    total += area;
+  }
+  assert(abs(total - 16.0) < 1e-9);
+  cout << "✅  Verified cells tile the bounds" << endl;
+}
+
+void testInsertSite() {
+  cout << "Testing incremental site insertion..." << endl;
+  vector<cv::Point> points = { {0,0}, {8,0}, {0,8}, {8,8} };
+  QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+  for (const cv::Point &site : vector<cv::Point>{ {6,1}, {1,6}, {5,4} }) {
+    // Find the triangle strictly containing the site
+    QuadEdgeRef<cv::Point> *face = nullptr;
+    unordered_set<QuadEdgeRef<cv::Point>*> seen;
+    vector<QuadEdgeRef<cv::Point>*> stack = { graph, graph->sym() };
+    while (face == nullptr && !stack.empty()) {
+      QuadEdgeRef<cv::Point> *e = stack.back();
+      stack.pop_back();
+      if (!seen.insert(e).second)
+        continue;
+      stack.push_back(e->sym());
+      stack.push_back(e->lnext());
+      cv::Point a = e->origCoords(), b = e->termCoords();
+      cv::Point c = e->lnext()->termCoords();
+      if (e->lnext()->lnext()->lnext() == e && delaunay::isCCW(a, b, site)
+          && delaunay::isCCW(b, c, site) && delaunay::isCCW(c, a, site))
+        face = e;
+    }
+    assert(face != nullptr);
+    assert(delaunay::insertSite(face, site)->origCoords() == site);
+    points.push_back(site);
+  }
+  delaunay::Mesh<cv::Point> mesh = delaunay::extractTriangles(graph);
+  freeGraph(graph);
+  // Four hull vertices: 2n - 2 - 4 triangles, each with an empty circumcircle
+  assert(mesh.size() == 2 * points.size() - 6);
+  for (size_t t = 0; t < mesh.size(); t++)
+    for (const cv::Point &p : points)
+      if (p != mesh.vertex(t, 0) && p != mesh.vertex(t, 1)
+          && p != mesh.vertex(t, 2))
+        assert(!delaunay::inCircle(
+              mesh.vertex(t, 0), mesh.vertex(t, 1), mesh.vertex(t, 2), p));
+  cout << "✅  Verified insertion keeps the triangulation Delaunay" << endl;
+}
+
+void testConstraints() {
+  cout << "Testing constrained edges..." << endl;
+  // A row of points above and below y = 4, so the Delaunay edges all cross
+  // the segment between the two ends
+  vector<cv::Point> points = { {0,4}, {12,4} };
+  for (int x = 1; x < 12; x += 2) {
+    points.push_back({ x, 3 });
+    points.push_back({ x + 1, 5 });
+  }
+  QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+  assert(delaunay::insertConstraints(graph, { { {0,4}, {12,4} } }) == 1);
+  delaunay::Mesh<cv::Point> mesh = delaunay::extractTriangles(graph);
+  freeGraph(graph);
+  // Still a triangulation of the points, now with the segment as an edge
+  assert(mesh.size() == points.size() - 2);
+  bool found = false;
+  for (size_t t = 0; t < mesh.size(); t++)
+    for (int j = 0; j < 3; j++)
+      found = found || (mesh.vertex(t, j) == cv::Point(0,4)
+          && mesh.vertex(t, (j + 1) % 3) == cv::Point(12,4));
+  assert(found);
+  cout << "✅  Verified the segment is forced into the mesh" << endl;
+}
+
+void testDecimate() {
+  cout << "Testing color decimation..." << endl;
+  vector<cv::Point> points = { {0,0}, {100,0}, {0,100}, {100,100} };
+  cv::RNG rng(5);
+  for (int i = 0; i < 500; i++)
+    points.push_back({ rng.uniform(1, 100), rng.uniform(1, 100) });
+  const cv::Scalar dark(20, 40, 60), light(200, 180, 160);
+  for (bool split : { false, true }) {
+    QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+    delaunay::Mesh<cv::Point> mesh = delaunay::extractTriangles(graph);
+    // Dark on the left half, light on the right (or everywhere)
+    for (size_t t = 0; t < mesh.size(); t++)
+      mesh.colors.push_back(split && mesh.vertex(t, 0).x + mesh.vertex(t, 1).x
+          + mesh.vertex(t, 2).x < 150 ? dark : light);
+    delaunay::Mesh<cv::Point> decimated = delaunay::decimate(graph, mesh, 1.0);
+    freeGraph(graph);
+    // Still covering the square, in the input's colors only
+    double area = 0.0;
+    for (size_t t = 0; t < decimated.size(); t++) {
+      const cv::Point a = decimated.vertex(t, 0), b = decimated.vertex(t, 1);
+      const cv::Point c = decimated.vertex(t, 2);
+      assert(delaunay::isCCW(a, b, c));
+      area += (b - a).cross(c - a) / 2.0;
+      auto near = [&](const cv::Scalar &color) {
+        for (int ch = 0; ch < 3; ch++)
+          if (abs(decimated.colors[t][ch] - color[ch]) > 1e-6)
+            return false;
+        return true;
+      };
+      assert(near(dark) || near(light));
+    }
+    assert(area == 100.0 * 100.0);
+    // One color leaves only the corners; two keep the vertices between them
+    if (split)
+      assert(decimated.size() > 2 && 4 * decimated.size() < mesh.size());
+    else
+      assert(decimated.size() == 2);
+  }
+  // A constrained segment through the middle survives a flat region
+  points.insert(points.end(), { {20,50}, {50,50}, {80,50} });
+  const vector<pair<cv::Point, cv::Point>> segments = {
+    { {20,50}, {50,50} }, { {50,50}, {80,50} } };
+  QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+  delaunay::insertConstraints(graph, segments);
+  delaunay::Mesh<cv::Point> mesh = delaunay::extractTriangles(graph);
+  mesh.colors.assign(mesh.size(), light);
+  delaunay::Mesh<cv::Point> decimated = delaunay::decimate(graph, mesh, 1.0,
+      delaunay::TriangleOrder::Traversal, segments);
+  freeGraph(graph);
+  assert(decimated.size() < mesh.size());
+  int covered = 0;
+  for (size_t t = 0; t < decimated.size(); t++)
+    for (int j = 0; j < 3; j++) {
+      const cv::Point a = decimated.vertex(t, j);
+      const cv::Point b = decimated.vertex(t, (j + 1) % 3);
+      if (a.y == 50 && b.y == 50 && a.x >= 20 && b.x <= 80 && a.x < b.x)
+        covered += b.x - a.x;
+    }
+  assert(covered == 60);
+  cout << "✅  Verified flat regions collapse without mixing colors or "
+    "crossing constraints" << endl;
+}
+
+void testTriangleOrder() {
+  cout << "Testing Hilbert triangle order..." << endl;
+  vector<cv::Point> points;
+  cv::RNG rng(11);
+  for (int i = 0; i < 2000; i++)
+    points.push_back({ rng.uniform(0, 1000), rng.uniform(0, 1000) });
+  QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+  delaunay::Mesh<cv::Point> walked = delaunay::extractTriangles(graph);
+  delaunay::Mesh<cv::Point> sorted = delaunay::extractTriangles(
+      graph, delaunay::TriangleOrder::Hilbert);
+  freeGraph(graph);
+  // The same triangles (as CCW corner triples), only in another order
+  auto triangles = [](const delaunay::Mesh<cv::Point> &mesh) {
+    vector<vector<int>> result;
+    for (size_t t = 0; t < mesh.size(); t++) {
+      // Start from the lowest corner so rotations compare equal
+      int first = 0;
+      for (int j = 1; j < 3; j++)
+        if (make_pair(mesh.vertex(t, j).x, mesh.vertex(t, j).y)
+            < make_pair(mesh.vertex(t, first).x, mesh.vertex(t, first).y))
+          first = j;
+      vector<int> corners;
+      for (int j = 0; j < 3; j++) {
+        corners.push_back(mesh.vertex(t, (first + j) % 3).x);
+        corners.push_back(mesh.vertex(t, (first + j) % 3).y);
+      }
+      result.push_back(corners);
+    }
+    sort(result.begin(), result.end());
+    return result;
+  };
+  assert(sorted.vertices.size() == walked.vertices.size());
+  assert(triangles(sorted) == triangles(walked));
+  // Runs of consecutive triangles cover fewer 64-pixel tiles along the curve
+  auto tilesPerRun = [](const delaunay::Mesh<cv::Point> &mesh) {
+    const size_t RUN = 256;
+    size_t nTiles = 0;
+    for (size_t first = 0; first + RUN <= mesh.size(); first += RUN) {
+      unordered_set<cv::Point, PointHash> tiles;
+      for (size_t t = first; t < first + RUN; t++)
+        tiles.insert({ (mesh.vertex(t, 0).x + mesh.vertex(t, 1).x
+                        + mesh.vertex(t, 2).x) / 3 / 64,
+                       (mesh.vertex(t, 0).y + mesh.vertex(t, 1).y
+                        + mesh.vertex(t, 2).y) / 3 / 64 });
+      nTiles += tiles.size();
+    }
+    return nTiles;
+  };
+  assert(3 * tilesPerRun(sorted) < 2 * tilesPerRun(walked));
+  cout << "✅  Verified the sorted mesh is the same, with better locality"
+    << endl;
+}
+
+void testParallelTriangulate() {
+  cout << "Testing triangulation on the thread pool..." << endl;
+  // Large enough for both halves of the top levels to run as pool tasks
+  vector<cv::Point> points;
+  cv::RNG rng(7);
+  for (int i = 0; i < 50000; i++)
+    points.push_back({ rng.uniform(0, 5000), rng.uniform(0, 5000) });
+  vector<delaunay::Mesh<cv::Point>> meshes;
+  for (unsigned nThreads : { 1u, 4u }) {
+    threadpool::configure(nThreads);
+    QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+    meshes.push_back(delaunay::extractTriangles(graph));
+    freeGraph(graph);
+  }
+  threadpool::configure(0);
+  assert(meshes[0].vertices == meshes[1].vertices);
+  assert(meshes[0].indices == meshes[1].indices);
+  cout << "✅  Verified the mesh does not depend on the thread count" << endl;
+}
+
+void testTrace() {
+  cout << "Testing trace output..." << endl;
+  vector<cv::Point> points;
+  cv::RNG rng(11);
+  for (int i = 0; i < 20000; i++)
+    points.push_back({ rng.uniform(0, 2000), rng.uniform(0, 2000) });
+  const string path = "/tmp/test_delaunay_trace.json";
+  threadpool::configure(4);
+  tracing::start();
+  QuadEdgeRef<cv::Point> *graph = delaunay::triangulate(points);
+  tracing::write(path);
+  freeGraph(graph);
+  threadpool::configure(0);
+  assert(!tracing::enabled());
+  ifstream file(path);
+  const string json((istreambuf_iterator<char>(file)),
+      istreambuf_iterator<char>());
+  remove(path.c_str());
+  assert(json.rfind("{\"displayTimeUnit\"", 0) == 0);
+  assert(json.find("\"cat\":\"delaunay\",\"name\":\"triangulate\"")
+      != string::npos);
+  assert(json.find("\"name\":\"worker 1\"") != string::npos);
+  cout << "✅  Verified triangulation subtrees are traced per thread" << endl;
+}
+
+void testPointFile() {
+  cout << "Testing point files..." << endl;
+  const string path = "/tmp/test_delaunay_points.txt";
+  FILE *file = fopen(path.c_str(), "w");
+  assert(file != nullptr);
+  fprintf(file, "# x y\n0 0\n4,0\n  0 4\n4 4 # corner\n2 2\n");
+  fclose(file);
+  delaunay::PointFile<cv::Point> points(path);
+  remove(path.c_str());
+  assert(points.size() == 5);
+  assert(points.data()[1] == cv::Point(4,0) && points.data()[4] == cv::Point(2,2));
+  QuadEdgeRef<cv::Point> *graph
+    = delaunay::triangulate(points.data(), points.size());
+  assert(delaunay::extractTriangles(graph).size() == 4);
+  freeGraph(graph);
+  cout << "✅  Verified text points parse and triangulate" << endl;
+}
+
+int main (int argc, char *argv[]) {
   testSingleQuadEdge();
   testTriangle();
   testPolygon();
   testConnect();
   testInCircle();
+  testSubPixel();
+  testVoronoiCells();
+  testInsertSite();
+  testConstraints();
+  testDecimate();
+  testTriangleOrder();
+  testParallelTriangulate();
+  testTrace();
+  testPointFile();
   cout << "ALL TESTS PASSED!" << endl;
+  // The random triangulation viewer needs a display, so only on request
+  if (argc < 2 || string(argv[1]) != "--interactive")
+    return 0;
   cout << "(r)etry/(q)uit" << endl;
   while (true) {
     const int IMG_HEIGHT = 1000, IMG_WIDTH = 2000, N_POINTS = 1000, SCALE = 1;
@@ -152,34 +453,37 @@ int main () {
       pointSet.insert({x, y});
     }
     vector<cv::Point> points(pointSet.begin(), pointSet.end());
-    QuadEdgeRef *graph = delaunay::triangulate(points);
-    vector<vector<cv::Point>> triangles
-      = delaunay::extractTriangles(graph);
-
-    // printf("%zu Triangles:\n", triangles.size());
-    // for (const auto &s : triangles) {
-    //   for (const auto &point : s)
-    //     printf("(%d,%d) ", point.x, point.y);
+    Edge *graph = delaunay::triangulate(points);
+    delaunay::Mesh<cv::Point> mesh = delaunay::extractTriangles(graph);
+    freeGraph(graph);
+
+    // printf("%zu Triangles:\n", mesh.size());
+    // for (size_t i = 0; i < mesh.size(); i++) {
+    //   for (int j = 0; j < 3; j++)
+    //     printf("(%d,%d) ", mesh.vertex(i, j).x, mesh.vertex(i, j).y);
     //   printf("\n");
     // }
 
-    for (auto &s : triangles)
-      for (auto &point : s)
-        point *= SCALE;
+    for (auto &point : mesh.vertices)
+      point *= SCALE;
     for (auto &point : points)
       point *= SCALE;
 
     cv::Mat img(IMG_HEIGHT*SCALE, IMG_WIDTH*SCALE, CV_8UC3, cv::Scalar(100, 100, 100));
-    for (const auto &triangle : triangles)
-      cv::fillConvexPoly(img, triangle, cv::Scalar(0, 0, 0));
-    cv::drawContours(img, triangles, -1, cv::Scalar(255, 100, 100), 2);
+    for (size_t i = 0; i < mesh.size(); i++) {
+      cv::Point triangle[3]
+        = { mesh.vertex(i, 0), mesh.vertex(i, 1), mesh.vertex(i, 2) };
+      cv::fillConvexPoly(img, triangle, 3, cv::Scalar(0, 0, 0));
+      const cv::Point *contour = triangle;
+      const int nPoints = 3;
+      cv::polylines(img, &contour, &nPoints, 1, true,
+          cv::Scalar(255, 100, 100), 2);
+    }
     for (const auto &point : points)
       cv::circle(img, point, 3, cv::Scalar(100, 0, 255), cv::FILLED);
-    for (const auto &triangle : triangles) {
-      cv::Point centroid(0, 0);
-      for (const auto &point : triangle)
-        centroid += point;
-      centroid /= 3;
+    for (size_t i = 0; i < mesh.size(); i++) {
+      cv::Point centroid
+        = (mesh.vertex(i, 0) + mesh.vertex(i, 1) + mesh.vertex(i, 2)) / 3;
       cv::circle(img, centroid, 3, cv::Scalar(0, 255, 255));
     }
     cv::flip(img, img, 0);
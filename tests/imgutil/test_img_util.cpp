@@ -0,0 +1,135 @@
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <opencv2/core.hpp>
+#include <opencv2/core/mat.hpp>
+#include <opencv2/core/types.hpp>
+#include <vector>
+#include "img_util.h"
+#include "isa.h"
+
+using namespace std;
+
+// RMS distance between two colors, as the pipeline's tolerances measure it
+double distance(const cv::Scalar &a, const cv::Scalar &b) {
+  double sumSq = 0.0;
+  for (int ch = 0; ch < 3; ch++)
+    sumSq += (a[ch] - b[ch]) * (a[ch] - b[ch]);
+  return sqrt(sumSq);
+}
+
+void testSampledColor() {
+  cout << "Testing sampled polygon colors..." << endl;
+  // Large enough to be sampled rather than averaged exactly
+  const cv::Point triangle[] = { {10, 10}, {390, 40}, {120, 290} };
+  const cv::Point quad[] = { {20, 300}, {380, 320}, {360, 390}, {30, 395} };
+  const double tolerance = 2.0;
+  imgutil::ScratchBuffer scratch;
+
+  // A flat polygon reads its color whatever is sampled
+  cv::Mat flat(400, 400, CV_8UC3, cv::Scalar(30, 120, 210));
+  cv::Mat flatGray(400, 400, CV_32FC1, cv::Scalar(0.5));
+  for (const cv::Point *polygon : { triangle, quad }) {
+    const int n = polygon == triangle ? 3 : 4;
+    assert(distance(imgutil::sampledColorInPoly<cv::Vec3b>(
+          flat, polygon, n, tolerance, scratch), { 30, 120, 210 }) < 1e-9);
+    assert(distance(imgutil::sampledColorInPoly<float>(
+          flatGray, polygon, n, tolerance, scratch), cv::Scalar::all(127.5))
+        < 1e-9);
+  }
+
+  // A noisy polygon's estimate stays near the exact mean, and repeats
+  cv::Mat noisy(400, 400, CV_8UC3);
+  cv::RNG rng(7);
+  rng.fill(noisy, cv::RNG::NORMAL, cv::Scalar(100, 128, 160),
+      cv::Scalar(25, 25, 25));
+  for (const cv::Point *polygon : { triangle, quad }) {
+    const int n = polygon == triangle ? 3 : 4;
+    const cv::Scalar exact
+      = imgutil::avgColorInPoly<cv::Vec3b>(noisy, polygon, n, scratch);
+    const cv::Scalar sampled = imgutil::sampledColorInPoly<cv::Vec3b>(
+        noisy, polygon, n, tolerance, scratch);
+    // The tolerance bounds the standard error, so allow a few of them
+    assert(distance(sampled, exact) < 3 * tolerance);
+    imgutil::ScratchBuffer otherScratch;
+    assert(imgutil::sampledColorInPoly<cv::Vec3b>(
+          noisy, polygon, n, tolerance, otherScratch) == sampled);
+  }
+  cout << "✅  Verified sampled means are close to exact and repeatable"
+    << endl;
+}
+
+// Every kernel output at the active level, for an edge image of Pixel
+template <typename Pixel>
+vector<cv::Mat> edgeKernelOutputs(const cv::Mat &edges) {
+  cv::Mat nms, anms;
+  imgutil::nonMaxSuppress<Pixel>(edges, nms, 5, 0.2);
+  imgutil::adaptiveNonMaxSuppress<Pixel>(edges, anms, { 2, 6 }, 0.1);
+  vector<cv::Point> points;
+  imgutil::adaptiveNonMaxSuppress<Pixel>(edges, points, { 2, 6 }, 0.1);
+  return { nms, anms, cv::Mat(points, true) };
+}
+
+template <typename Pixel>
+cv::Mat refineOutput(const cv::Mat &img) {
+  vector<cv::Point> points;
+  imgutil::refineVertices<Pixel>(img, points, 4.0, 500);
+  return cv::Mat(points, true);
+}
+
+bool identical(const vector<cv::Mat> &a, const vector<cv::Mat> &b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); i++)
+    if (a[i].size() != b[i].size() || a[i].type() != b[i].type()
+        || (!a[i].empty() && cv::norm(a[i], b[i], cv::NORM_INF) != 0))
+      return false;
+  return true;
+}
+
+void testIsaLevels() {
+  cout << "Testing kernels at every instruction set..." << endl;
+  // Odd sizes, so vector loops end in a scalar tail
+  cv::Mat noise(123, 157, CV_8UC3);
+  cv::RNG rng(11);
+  rng.fill(noise, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat gray8, gray16, grayF, color16, colorF;
+  cv::extractChannel(noise, gray8, 0);
+  gray8.convertTo(gray16, CV_16U, 257.0);
+  gray8.convertTo(grayF, CV_32F, 1.0 / 255);
+  noise.convertTo(color16, CV_16U, 257.0);
+  noise.convertTo(colorF, CV_32F, 1.0 / 255);
+  auto outputs = [&]() {
+    vector<cv::Mat> all;
+    for (const vector<cv::Mat> &edge : { edgeKernelOutputs<uchar>(gray8),
+          edgeKernelOutputs<ushort>(gray16), edgeKernelOutputs<float>(grayF) })
+      all.insert(all.end(), edge.begin(), edge.end());
+    all.push_back(refineOutput<uchar>(gray8));
+    all.push_back(refineOutput<cv::Vec3b>(noise));
+    all.push_back(refineOutput<ushort>(gray16));
+    all.push_back(refineOutput<cv::Vec3w>(color16));
+    all.push_back(refineOutput<float>(grayF));
+    all.push_back(refineOutput<cv::Vec3f>(colorF));
+    return all;
+  };
+  const isa::Level detected = isa::detected();
+  isa::select(isa::Level::Scalar);
+  const vector<cv::Mat> reference = outputs();
+  for (isa::Level level : { isa::Level::AVX2, isa::Level::AVX512 }) {
+    if (level > detected)
+      continue;
+    isa::select(level);
+    assert(identical(outputs(), reference));
+    cout << "  " << isa::name(level) << " matches scalar" << endl;
+  }
+  isa::select(detected);
+  cout << "✅  Verified every supported level computes the same outputs"
+    << endl;
+}
+
+int main () {
+  testSampledColor();
+  testIsaLevels();
+  cout << "ALL TESTS PASSED!" << endl;
+  return 0;
+}
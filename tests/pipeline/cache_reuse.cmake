@@ -0,0 +1,21 @@
+# Runs lowpoly twice on the same image and cache directory, changing only the
+# output width, and checks the second run takes the mesh from the cache.
+# Usage: cmake -DLOWPOLY=<binary> -DINPUT=<image> -DWORK_DIR=<dir> -P <this>
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+foreach(width 400 800)
+  execute_process(
+    COMMAND ${LOWPOLY} ${INPUT} --cache ${WORK_DIR}/cache --metrics
+      --target-input-width 400 --target-output-width ${width}
+      --output ${WORK_DIR}/out_${width}.png
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "lowpoly failed (width ${width}):\n${output}")
+  endif()
+endforeach()
+if(NOT output MATCHES "triangulate \\+ color \\(cached\\)")
+  message(FATAL_ERROR
+    "Mesh was recomputed for a new output width:\n${output}")
+endif()